@@ -0,0 +1,294 @@
+/*
+ * Microbenchmarks of the hot paths of the counters module.
+ *
+ * The module is built against the ZNC stand-in of this directory, so the
+ * benchmarks run without ZNC. Each benchmark is run with more and more
+ * iterations until it lasts at least MIN_TIME, like Google Benchmark, and
+ * the results are printed and written as Google Benchmark JSON.
+ *
+ * Usage : counters_bench [results.json] [filter]
+ */
+#include "../counters.cpp"
+
+#include <znc/User.h>
+#include <znc/WebModules.h>
+#include <znc/znc.h>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+
+/**
+ * Module with the protected members used by the benchmarks made public.
+ */
+class CBenchCountersMod : public CCountersMod {
+public:
+    using CCountersMod::CCountersMod;
+    using CCountersMod::OnChanMsg;
+    using CCountersMod::createCounterCommand;
+    using CCountersMod::executeSimpleCommand;
+    using CCountersMod::findCounter;
+    using CCountersMod::m_listeners;
+};
+
+struct SBenchmark {
+    const char* sName;
+    /** run the benchmark iterations times */
+    std::function<void(size_t iterations)> run;
+};
+
+struct SResult {
+    CString sName;
+    size_t iterations;
+    double realTime;
+    double cpuTime;
+};
+
+static const double MIN_TIME = 0.5;
+static const size_t MAX_ITERATIONS = 1000000000;
+
+static double getWallTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double getCpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Run benchmark with growing iterations until it lasts MIN_TIME.
+ */
+static SResult runBenchmark(const SBenchmark& benchmark) {
+    size_t iterations = 1;
+    while (true) {
+        double wall = getWallTime();
+        double cpu = getCpuTime();
+        benchmark.run(iterations);
+        wall = getWallTime() - wall;
+        cpu = getCpuTime() - cpu;
+        if (wall >= MIN_TIME || iterations >= MAX_ITERATIONS) {
+            return SResult{benchmark.sName, iterations, wall * 1e9 / iterations, cpu * 1e9 / iterations};
+        }
+        //aim 40% over MIN_TIME like Google Benchmark, growing at most 10 times
+        double multiplier = wall > 0 ? MIN_TIME * 1.4 / wall : 10;
+        multiplier = std::min(10.0, std::max(2.0, multiplier));
+        iterations = std::min(MAX_ITERATIONS, (size_t) (iterations * multiplier));
+    }
+}
+
+static CString toJSON(const std::vector<SResult>& results) {
+    std::ostringstream json;
+    char date[64];
+    std::time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    json << "{\n  \"context\": {\n    \"date\": \"" << date << "\",\n"
+            << "    \"library_build_type\": \"release\"\n  },\n  \"benchmarks\": [\n";
+    json << std::setprecision(10);
+    for (size_t i = 0; i < results.size(); i++) {
+        const SResult& result = results[i];
+        json << "    {\n      \"name\": \"" << result.sName << "\",\n"
+                << "      \"run_name\": \"" << result.sName << "\",\n"
+                << "      \"run_type\": \"iteration\",\n"
+                << "      \"iterations\": " << result.iterations << ",\n"
+                << "      \"real_time\": " << result.realTime << ",\n"
+                << "      \"cpu_time\": " << result.cpuTime << ",\n"
+                << "      \"time_unit\": \"ns\",\n"
+                << "      \"items_per_second\": " << 1e9 / result.cpuTime << "\n    }"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+int main(int argc, char** argv) {
+    char sDirectory[] = "/tmp/counters_bench.XXXXXX";
+    if (!mkdtemp(sDirectory)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    CUser user("bench");
+    user.m_sUserPath = CString(sDirectory) + "/user";
+    CZNC::Get().m_sZNCPath = sDirectory;
+    CIRCNetwork network(&user, "bench");
+    CChan channel("#bench");
+    network.m_vChans.push_back(&channel);
+    CBenchCountersMod module(nullptr, &user, &network, "counters", sDirectory, CModInfo::NetworkModule);
+    CString sLoadMessage;
+    module.OnLoad("", sLoadMessage);
+    //the hit benchmark measures the handling of a line, not the rate limit of its nickname
+    module.OnModCommand("Queue nickburst 1e18");
+    module.OnModCommand("Queue nickrate 1e18");
+
+    //counters and listeners looked up by the benchmarks, among others
+    for (int i = 0; i < 1000; i++) {
+        module.OnModCommand("Create counter" + CString(i));
+        module.OnModCommand("CreateListener counter" + CString(i) + " viewer" + CString(i) + " !trigger" + CString(i));
+    }
+    module.OnModCommand("Create -i 5 -s 2 -m \"{NAME} went from {PREVIOUS_VALUE} to {CURRENT_VALUE}\" deaths");
+    module.OnModCommand("CreateListener deaths streamer !deaths");
+    //moderators granted one by one and by a mask, with a condition of mode
+    for (int i = 0; i < 40; i++) {
+        module.OnModCommand("CreateListener deaths moderator" + CString(i) + " !deaths");
+    }
+    module.OnModCommand("CreateListener --mode ov deaths *!*@mods.bench.example !deaths");
+    //the same trigger routed to another counter on another channel, so lines of #bench look up both
+    module.OnModCommand("CreateListener --channel #other counter0 streamer !deaths");
+    CCounter* pDeaths = module.findCounter("deaths");
+
+    CNick streamer("streamer!streamer@bench.example");
+    CNick viewer("viewer!viewer@bench.example");
+    CNick moderator("helper!helper@mods.bench.example");
+    moderator.AddPerm('@');
+    CString sHitLine = "!deaths incr";
+    CString sIndexMissLine = "!unknown incr";
+    CString sPrefilterMissLine = "hello everyone, nice stream";
+    CString sRender;
+
+    std::vector<SBenchmark> benchmarks = {
+        {"BM_CounterIncrement", [&](size_t iterations) {
+            CCounter counter("bench");
+            for (size_t i = 0; i < iterations; i++) {
+                counter.incrementDefault();
+            }
+        }},
+        {"BM_SharedCounterIncrement", [&](size_t iterations) {
+            CCounter counter("bench");
+            counter.setShared(CSharedValues::get("bench/shared"), 0);
+            for (size_t i = 0; i < iterations; i++) {
+                counter.incrementDefault();
+                counter.publish();
+            }
+            counter.detachShared();
+        }},
+        {"BM_ShardedValueAdd_4Threads", [&](size_t iterations) {
+            //each thread adds to its own shard, iterations times
+            std::shared_ptr<CShardedValue> pValue = CShardedValue::create();
+            std::vector<std::thread> threads;
+            for (unsigned int uShard = 0; uShard < 4; uShard++) {
+                threads.emplace_back([&pValue, iterations, uShard]() {
+                    for (size_t i = 0; i < iterations; i++) {
+                        pValue->add(uShard, 1);
+                    }
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            if (pValue->read() != (long long) (4 * iterations)) {
+                abort();
+            }
+        }},
+        {"BM_GetNamedFormat", [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++) {
+                pDeaths->getNamedFormat(sRender);
+            }
+        }},
+        {"BM_OnChanMsg_PrefilterMiss", [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++) {
+                module.OnChanMsg(viewer, channel, sPrefilterMissLine);
+            }
+        }},
+        {"BM_OnChanMsg_IndexMiss", [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++) {
+                module.OnChanMsg(viewer, channel, sIndexMissLine);
+            }
+        }},
+        {"BM_OnChanMsg_NickMiss", [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++) {
+                module.OnChanMsg(viewer, channel, sHitLine);
+            }
+        }},
+        {"BM_OnChanMsg_Hit", [&](size_t iterations) {
+            for (size_t i = 0; i < iterations; i++) {
+                module.OnChanMsg(streamer, channel, sHitLine);
+            }
+            //flush the journal between runs so its buffer does not grow
+            module.onJournalTimer();
+        }},
+        {"BM_FindCounter", [&](size_t iterations) {
+            CString sName = "counter500";
+            for (size_t i = 0; i < iterations; i++) {
+                if (!module.findCounter(sName)) {
+                    abort();
+                }
+            }
+        }},
+        {"BM_ExecuteSimpleCommand", [&](size_t iterations) {
+            CString sCommand = "Incr deaths";
+            for (size_t i = 0; i < iterations; i++) {
+                module.executeSimpleCommand(sCommand, OPERATION_INCREMENT);
+            }
+            module.onJournalTimer();
+        }},
+        {"BM_CreateCommandParse", [&](size_t iterations) {
+            //the counter exists, so only the parsing and the lookup are measured
+            CString sCommand = "Create -i 5 -s 2 -c 10 -d 3 -m \"{NAME} is {CURRENT_VALUE}\" deaths";
+            for (size_t i = 0; i < iterations; i++) {
+                module.createCounterCommand(sCommand);
+            }
+        }},
+        {"BM_ListenerLookup", [&](size_t iterations) {
+            const char* sTrigger = "!trigger500";
+            size_t length = strlen(sTrigger);
+            CString sNickname = "viewer500";
+            for (size_t i = 0; i < iterations; i++) {
+                const CListenerIndex::STrigger* trigger = module.m_listeners.findTrigger("", sTrigger, length);
+                if (!trigger || !CListenerIndex::findListener(*trigger, sNickname)) {
+                    abort();
+                }
+            }
+        }},
+        {"BM_ListenerMatchMask", [&](size_t iterations) {
+            const CListenerIndex::STrigger* trigger = module.m_listeners.findTrigger("", "!deaths", 7);
+            for (size_t i = 0; i < iterations; i++) {
+                if (!CListenerIndex::match(*trigger, moderator)) {
+                    abort();
+                }
+            }
+        }},
+        {"BM_MetricsExport", [&](size_t iterations) {
+            //the page of 1000 counters, written to the stand-in of the web socket
+            CTemplate tmpl;
+            for (size_t i = 0; i < iterations; i++) {
+                CWebSock socket;
+                module.OnWebRequest(socket, "metrics", tmpl);
+                if (socket.m_uWritten == 0) {
+                    abort();
+                }
+            }
+        }},
+    };
+
+    const char* sFilter = argc > 2 ? argv[2] : nullptr;
+    std::vector<SResult> results;
+    std::cout << std::left << std::setw(32) << "Benchmark" << std::right << std::setw(14) << "Time (ns)"
+            << std::setw(14) << "CPU (ns)" << std::setw(14) << "Iterations" << std::setw(16) << "items/s" << "\n";
+    for (const SBenchmark& benchmark : benchmarks) {
+        if (sFilter && !strstr(benchmark.sName, sFilter)) {
+            continue;
+        }
+        SResult result = runBenchmark(benchmark);
+        results.push_back(result);
+        std::cout << std::left << std::setw(32) << result.sName << std::right << std::fixed << std::setprecision(1)
+                << std::setw(14) << result.realTime << std::setw(14) << result.cpuTime
+                << std::setw(14) << result.iterations << std::setw(16) << std::setprecision(0)
+                << 1e9 / result.cpuTime << "\n";
+    }
+
+    int status = 0;
+    if (argc > 1) {
+        std::ofstream file(argv[1]);
+        file << toJSON(results);
+        if (!file) {
+            std::cerr << "Unable to write " << argv[1] << "\n";
+            status = 1;
+        }
+    }
+    if (std::system(("rm -rf " + CString(sDirectory)).c_str()) != 0) {
+        std::cerr << "Unable to remove " << sDirectory << "\n";
+    }
+    return status;
+}
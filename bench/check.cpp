@@ -0,0 +1,441 @@
+/*
+ * Round-trip checks of the counters module.
+ *
+ * The module is built against the ZNC stand-in of this directory, like the
+ * benchmarks. Each check loads the module on a new data directory, changes
+ * counters with its commands, then unloads and loads it again to verify what
+ * the journal and the snapshot restore. A failed check prints its line.
+ *
+ * Usage : counters_check
+ */
+#include "../counters.cpp"
+
+#include <znc/User.h>
+#include <znc/znc.h>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+/**
+ * Module with the protected members used by the checks made public.
+ */
+class CCheckCountersMod : public CCountersMod {
+public:
+    using CCountersMod::CCountersMod;
+    using CCountersMod::OnChanMsg;
+    using CCountersMod::findCounter;
+    using CCountersMod::writeSnapshot;
+    using CCountersMod::m_counters;
+    using CCountersMod::m_snapshot;
+    using CCountersMod::m_journal;
+    using CCountersMod::m_uLinesRefused;
+};
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed : " #condition << std::endl; \
+            g_failures++; \
+        } \
+    } while (0)
+
+/**
+ * A network of a user with its own data directory, where the module can be
+ * unloaded and loaded again.
+ */
+class CNetworkFixture {
+protected:
+    CString m_sDirectory;
+    CUser m_user;
+    CIRCNetwork m_network;
+    CChan m_channel;
+    std::unique_ptr<CCheckCountersMod> m_pModule;
+
+public:
+
+    CNetworkFixture(const CString& sDirectory, const CString& sUserName) : m_sDirectory(sDirectory),
+            m_user(sUserName), m_network(&m_user, sUserName), m_channel("#check") {
+        m_user.m_sUserPath = sDirectory + "/user";
+        m_network.m_vChans.push_back(&m_channel);
+        load();
+    }
+
+    CCheckCountersMod& module() {
+        return *m_pModule;
+    }
+
+    CString getJournalPath() const {
+        return m_sDirectory + "/counters.journal";
+    }
+
+    void load() {
+        m_pModule.reset(new CCheckCountersMod(nullptr, &m_user, &m_network, "counters", m_sDirectory,
+                CModInfo::NetworkModule));
+        CString sMessage;
+        m_pModule->OnLoad("", sMessage);
+        m_pModule->OnModCommand("Queue nickburst 1e18");
+        m_pModule->OnModCommand("Queue nickrate 1e18");
+    }
+
+    /**
+     * Write the journal, then unload the module and load it again.
+     */
+    void reload() {
+        m_pModule->onJournalTimer();
+        unload();
+        load();
+    }
+
+    void unload() {
+        m_pModule.reset();
+    }
+
+    void command(const CString& sCommand) {
+        m_pModule->OnModCommand(sCommand);
+    }
+
+    void say(const CString& sNick, const CString& sLine) {
+        CNick nick(sNick + "!" + sNick + "@check.example");
+        CString sMessage = sLine;
+        m_pModule->OnChanMsg(nick, m_channel, sMessage);
+    }
+
+    /**
+     * @return the current value of a counter, "none" if it doesn't exist
+     */
+    CString value(const CString& sName) {
+        CCounter* counter = m_pModule->findCounter(sName);
+        return counter ? counter->getCurrentValue() : CString("none");
+    }
+
+};
+
+static CString g_sRoot;
+static unsigned int g_uDirectories = 0;
+
+static CString newDirectory() {
+    CString sDirectory = g_sRoot + "/" + CString(g_uDirectories++);
+    mkdir(sDirectory.c_str(), 0700);
+    return sDirectory;
+}
+
+static CString readAll(const CString& sPath) {
+    std::ifstream file(sPath, std::ios::binary);
+    std::ostringstream data;
+    data << file.rdbuf();
+    return data.str();
+}
+
+static bool writeAll(const CString& sPath, const CString& sData) {
+    return CCountersJournal::replaceFile(sPath, sData);
+}
+
+/**
+ * Creations, changes and renames are restored from the journal.
+ */
+static void checkJournalRoundTrip() {
+    CNetworkFixture fixture(newDirectory(), "journal");
+    fixture.command("Create -i 5 -s 2 a");
+    fixture.command("Incr a");
+    fixture.command("Create b");
+    fixture.command("Decr b 3");
+    fixture.command("Set a name renamed");
+    fixture.command("Batch incr renamed 10; incr b 1");
+    fixture.reload();
+    CHECK(fixture.value("a") == "none");
+    CHECK(fixture.value("renamed") == "17");
+    CHECK(fixture.value("b") == "-2");
+    CCounter* counter = fixture.module().findCounter("renamed");
+    CHECK(counter && counter->getPreviousValue() == 7);
+}
+
+/**
+ * Records are replayed in order, so a name reused after a rename or a
+ * deletion gets the state of its last counter.
+ */
+static void checkReplayAfterRenameAndDelete() {
+    CNetworkFixture fixture(newDirectory(), "replay");
+    fixture.command("Create a");
+    fixture.command("Incr a 4");
+    fixture.command("Set a name b");
+    fixture.command("Create a");
+    fixture.command("Incr a");
+    fixture.command("Delete b");
+    fixture.command("Create -i 7 b");
+    fixture.command("Create c");
+    fixture.command("Delete c");
+    fixture.reload();
+    CHECK(fixture.value("a") == "1");
+    CHECK(fixture.value("b") == "7");
+    CHECK(fixture.value("c") == "none");
+    CHECK(fixture.module().m_counters.size() == 2);
+}
+
+/**
+ * A snapshot empties the journal, and its counters are only materialized
+ * when they are used.
+ */
+static void checkSnapshotLazyLoad() {
+    CNetworkFixture fixture(newDirectory(), "snapshot");
+    for (int i = 0; i < 100; i++) {
+        fixture.command("Create -i " + CString(i) + " counter" + CString(i));
+    }
+    fixture.command("Incr counter42 100");
+    fixture.command("CreateListener counter7 viewer !seven");
+    fixture.module().writeSnapshot();
+    CHECK(fixture.module().m_journal.size() == 0);
+    fixture.reload();
+    CHECK(fixture.module().m_counters.size() == 0);
+    CHECK(fixture.module().m_snapshot.size() == 100);
+    CHECK(fixture.value("counter42") == "142");
+    CHECK(fixture.module().m_counters.size() == 1);
+    CHECK(fixture.module().m_snapshot.size() == 99);
+    //the listener of the snapshot materializes its counter
+    fixture.say("viewer", "!seven incr");
+    CHECK(fixture.value("counter7") == "8");
+    //changes after the snapshot go to the journal, over the snapshot
+    fixture.command("Incr counter42");
+    fixture.command("Delete counter0");
+    fixture.command("Set counter1 name one");
+    fixture.reload();
+    CHECK(fixture.value("counter42") == "143");
+    CHECK(fixture.value("counter7") == "8");
+    CHECK(fixture.value("counter0") == "none");
+    CHECK(fixture.value("counter1") == "none");
+    CHECK(fixture.value("one") == "1");
+    CHECK(fixture.value("counter99") == "99");
+    //a snapshot copies the counters not materialized yet
+    fixture.module().writeSnapshot();
+    fixture.reload();
+    CHECK(fixture.module().m_snapshot.size() == 99);
+    CHECK(fixture.value("counter50") == "50");
+    CHECK(fixture.value("counter42") == "143");
+}
+
+/**
+ * A truncated last record is dropped, and the journal goes on after the
+ * last whole record.
+ */
+static void checkTruncatedRecord() {
+    CNetworkFixture fixture(newDirectory(), "truncated");
+    fixture.command("Create a");
+    fixture.command("Incr a 2");
+    fixture.module().onJournalTimer();
+    size_t uWhole = readAll(fixture.getJournalPath()).size();
+    fixture.command("Incr a 3");
+    fixture.module().onJournalTimer();
+    fixture.unload();
+    CString sJournal = readAll(fixture.getJournalPath());
+    CHECK(sJournal.size() > uWhole + 1);
+    sJournal.resize(sJournal.size() - 1);
+    CHECK(writeAll(fixture.getJournalPath(), sJournal));
+    fixture.load();
+    CHECK(fixture.value("a") == "2");
+    CHECK(readAll(fixture.getJournalPath()).size() == uWhole);
+    fixture.command("Incr a 10");
+    fixture.reload();
+    CHECK(fixture.value("a") == "12");
+}
+
+/**
+ * A journal of an older snapshot is ignored, its changes are already in the
+ * snapshot.
+ */
+static void checkGenerationSkip() {
+    CNetworkFixture fixture(newDirectory(), "generation");
+    fixture.command("Create a");
+    fixture.command("Incr a 5");
+    fixture.module().onJournalTimer();
+    CString sOldJournal = readAll(fixture.getJournalPath());
+    fixture.module().writeSnapshot();
+    fixture.command("Incr a");
+    fixture.unload();
+    //the journal of the previous generation, as left by a crash during a snapshot
+    CHECK(writeAll(fixture.getJournalPath(), sOldJournal));
+    fixture.load();
+    CHECK(fixture.value("a") == "5");
+    CHECK(fixture.module().m_journal.size() == 0);
+    fixture.command("Incr a 2");
+    fixture.reload();
+    CHECK(fixture.value("a") == "7");
+}
+
+/**
+ * Limits with the three arithmetic modes, and their restore.
+ */
+static void checkArithmetic() {
+    CNetworkFixture fixture(newDirectory(), "arithmetic");
+    fixture.command("Create w");
+    fixture.command("Set w lower 0");
+    fixture.command("Set w upper 9");
+    fixture.command("Set w arithmetic wrap");
+    fixture.command("Incr w 25");
+    CHECK(fixture.value("w") == "5");
+    fixture.command("Decr w 7");
+    CHECK(fixture.value("w") == "8");
+
+    fixture.command("Create s");
+    fixture.command("Set s upper 3");
+    fixture.command("Incr s 10");
+    CHECK(fixture.value("s") == "3");
+    fixture.command("Reset s 100");
+    CHECK(fixture.value("s") == "3");
+
+    fixture.command("Create r");
+    fixture.command("Set r upper 3");
+    fixture.command("Set r arithmetic reject");
+    fixture.command("Incr r 2");
+    fixture.command("Incr r 2");
+    CHECK(fixture.value("r") == "2");
+    //a rejected change cancels its whole batch
+    fixture.command("Batch incr w 1; incr r 5");
+    CHECK(fixture.value("w") == "8");
+    CHECK(fixture.value("r") == "2");
+
+    fixture.reload();
+    CHECK(fixture.value("w") == "8");
+    CHECK(fixture.value("s") == "3");
+    CHECK(fixture.value("r") == "2");
+    fixture.command("Incr w 2");
+    fixture.command("Incr r 2");
+    CHECK(fixture.value("w") == "0");
+    CHECK(fixture.value("r") == "2");
+}
+
+/**
+ * The timer wheel fires each entry at its tick, across the cascades of its
+ * levels, and not after a cancel.
+ */
+static void checkWheel() {
+    CAnnouncementWheel wheel;
+    const unsigned long long delays[] = {1, 63, 64, 65, 4095, 4097, 300000};
+    std::vector<unsigned long long> fired;
+    for (unsigned long long uDelay : delays) {
+        SPendingAnnouncement announcement = SPendingAnnouncement();
+        announcement.counter.uSlot = (unsigned int) uDelay;
+        wheel.schedule(announcement, uDelay);
+    }
+    SPendingAnnouncement cancelled = SPendingAnnouncement();
+    wheel.cancel(wheel.schedule(cancelled, 100));
+    CHECK(wheel.size() == 7);
+    unsigned long long uTick = 0;
+    while (wheel.size() > 0 && uTick < 400000) {
+        unsigned long long uNext = wheel.nextDue();
+        CHECK(uNext > wheel.getNow());
+        uTick = uNext;
+        wheel.advance(uTick, [&](const SPendingAnnouncement& announcement) {
+            //an entry fires at its tick, except the one over the horizon which is parked
+            CHECK(announcement.uDue == uTick || announcement.counter.uSlot == 300000);
+            CHECK(announcement.uDue == announcement.counter.uSlot || announcement.counter.uSlot == 300000);
+            fired.push_back(announcement.counter.uSlot);
+        });
+    }
+    CHECK(fired.size() == 7);
+    CHECK(std::is_sorted(fired.begin(), fired.end()));
+    CHECK(wheel.nextDue() == CAnnouncementWheel::NEVER);
+}
+
+/**
+ * A delayed message is sent by the announcement timer once it is due.
+ */
+static void checkDelayedMessage() {
+    CNetworkFixture fixture(newDirectory(), "delay");
+    fixture.command("Create -d 30ms a");
+    unsigned long long uLines = fixture.module().m_uIRCLines;
+    fixture.command("Incr a");
+    fixture.module().onAnnouncementTimer();
+    fixture.module().onQueueTimer();
+    CHECK(fixture.module().m_uIRCLines == uLines);
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    fixture.module().onAnnouncementTimer();
+    fixture.module().onQueueTimer();
+    CHECK(fixture.module().m_uIRCLines == uLines + 1);
+    CHECK(fixture.module().m_sLastIRCLine == "PRIVMSG #check :a has value : 1");
+}
+
+/**
+ * Lines refused by a listener change nothing and get no answer, and
+ * nicknames are case insensitive.
+ */
+static void checkListeners() {
+    CNetworkFixture fixture(newDirectory(), "listeners");
+    fixture.command("Create -i 10 a");
+    fixture.command("CreateListener a Streamer[1] !a");
+    fixture.command("SetListener Streamer[1] !a maxstep 5");
+    fixture.say("streamer{1}", "!a incr 2");
+    CHECK(fixture.value("a") == "12");
+    unsigned long long uModuleLines = fixture.module().m_uModuleLines;
+    unsigned long long uRefused = fixture.module().m_uLinesRefused;
+    fixture.say("STREAMER[1]", "!a incr 6");
+    fixture.say("STREAMER[1]", "!a reset 16");
+    fixture.say("STREAMER[1]", "!a delete");
+    fixture.say("STREAMER[1]", "!a incr x");
+    CHECK(fixture.value("a") == "12");
+    CHECK(fixture.module().m_uModuleLines == uModuleLines);
+    CHECK(fixture.module().m_uLinesRefused == uRefused + 4);
+    fixture.say("STREAMER[1]", "!a reset 15");
+    CHECK(fixture.value("a") == "15");
+    fixture.reload();
+    fixture.say("Streamer{1}", "!a incr 5");
+    CHECK(fixture.value("a") == "20");
+}
+
+/**
+ * The shared flag is restored with the counter, from the journal and from
+ * the snapshot.
+ */
+static void checkSharedFlag() {
+    CNetworkFixture fixture(newDirectory(), "shared");
+    fixture.command("Create a");
+    fixture.command("Set a shared on");
+    fixture.command("Incr a 3");
+    fixture.reload();
+    CCounter* counter = fixture.module().findCounter("a");
+    CHECK(counter && counter->isShared());
+    CHECK(fixture.value("a") == "3");
+    fixture.module().writeSnapshot();
+    fixture.reload();
+    counter = fixture.module().findCounter("a");
+    CHECK(counter && counter->isShared());
+    fixture.command("Set a shared off");
+    fixture.reload();
+    counter = fixture.module().findCounter("a");
+    CHECK(counter && !counter->isShared());
+}
+
+int main(int argc, char** argv) {
+    char sDirectory[] = "/tmp/counters_check.XXXXXX";
+    if (!mkdtemp(sDirectory)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    g_sRoot = sDirectory;
+    CZNC::Get().m_sZNCPath = g_sRoot;
+
+    const std::vector<std::pair<const char*, void (*)()>> checks = {
+        {"journal round trip", checkJournalRoundTrip},
+        {"replay after rename and delete", checkReplayAfterRenameAndDelete},
+        {"snapshot and lazy load", checkSnapshotLazyLoad},
+        {"truncated record", checkTruncatedRecord},
+        {"generation skip", checkGenerationSkip},
+        {"arithmetic", checkArithmetic},
+        {"timer wheel", checkWheel},
+        {"delayed message", checkDelayedMessage},
+        {"listeners", checkListeners},
+        {"shared flag", checkSharedFlag},
+    };
+    for (const auto& check : checks) {
+        int failures = g_failures;
+        check.second();
+        std::cout << (g_failures == failures ? "ok    " : "FAIL  ") << check.first << std::endl;
+    }
+    if (system(("rm -rf " + g_sRoot).c_str()) != 0) {
+        std::cerr << "Unable to remove " << g_sRoot << std::endl;
+    }
+    std::cout << (g_failures ? "failed checks : " + CString(g_failures) : CString("all checks passed")) << std::endl;
+    return g_failures ? 1 : 0;
+}
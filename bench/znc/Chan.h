@@ -0,0 +1,17 @@
+#ifndef BENCH_ZNC_CHAN_H
+#define BENCH_ZNC_CHAN_H
+
+#include <znc/main.h>
+#include <znc/Nick.h>
+
+class CChan {
+public:
+    CChan(const CString& sName) : m_sName(sName) {}
+    const CString& GetName() const { return m_sName; }
+    bool IsOn() const { return true; }
+
+protected:
+    CString m_sName;
+};
+
+#endif
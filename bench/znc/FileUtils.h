@@ -0,0 +1,25 @@
+#ifndef BENCH_ZNC_FILEUTILS_H
+#define BENCH_ZNC_FILEUTILS_H
+
+#include <znc/main.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cerrno>
+
+class CDir {
+public:
+    /** Create a directory and its parents. */
+    static bool MakeDir(const CString& sPath, mode_t iMode = 0700) {
+        for (size_t i = 1; i <= sPath.size(); i++) {
+            if (i == sPath.size() || sPath[i] == '/') {
+                CString sParent = sPath.substr(0, i);
+                if (mkdir(sParent.c_str(), iMode) != 0 && errno != EEXIST) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+#endif
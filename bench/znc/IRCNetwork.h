@@ -0,0 +1,22 @@
+#ifndef BENCH_ZNC_IRCNETWORK_H
+#define BENCH_ZNC_IRCNETWORK_H
+
+#include <znc/main.h>
+#include <znc/Chan.h>
+#include <znc/IRCSock.h>
+
+class CIRCNetwork {
+public:
+    CIRCNetwork(CUser* pUser, const CString& sName) : m_pUser(pUser), m_sName(sName), m_pIRCSock(nullptr) {}
+    const std::vector<CChan*>& GetChans() const { return m_vChans; }
+    CIRCSock* GetIRCSock() { return m_pIRCSock; }
+    const CString& GetName() const { return m_sName; }
+    CUser* GetUser() const { return m_pUser; }
+
+    std::vector<CChan*> m_vChans;
+    CUser* m_pUser;
+    CString m_sName;
+    CIRCSock* m_pIRCSock;
+};
+
+#endif
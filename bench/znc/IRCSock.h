@@ -0,0 +1,12 @@
+#ifndef BENCH_ZNC_IRCSOCK_H
+#define BENCH_ZNC_IRCSOCK_H
+
+#include <znc/main.h>
+
+class CIRCSock {
+public:
+    CString GetISupport(const CString& sKey, const CString& sDefault = "") const;
+    MCString m_mISupport;
+};
+
+#endif
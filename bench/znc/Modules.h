@@ -0,0 +1,91 @@
+#ifndef BENCH_ZNC_MODULES_H
+#define BENCH_ZNC_MODULES_H
+
+#include <znc/main.h>
+#include <znc/Utils.h>
+
+class CChan;
+class CNick;
+class CTemplate;
+class CWebSock;
+
+class CModInfo {
+public:
+    enum EModuleType { GlobalModule, UserModule, NetworkModule };
+};
+
+/**
+ * Timers are owned by their module but never run : the benchmarks call the
+ * callbacks of the module directly.
+ */
+class CTimer {
+public:
+    CTimer(CModule* pModule, unsigned int uInterval, unsigned int uCycles, const CString& sLabel,
+           const CString& sDescription) : m_pModule(pModule), m_sName(sLabel) {}
+    virtual ~CTimer() {}
+    CModule* GetModule() const { return m_pModule; }
+    const CString& GetName() const { return m_sName; }
+    void StartMaxCycles(double dTimeSequence, unsigned int uMaxCycles) {}
+    void Start(double dTimeSequence) {}
+    void Stop() {}
+
+protected:
+    virtual void RunJob() = 0;
+
+    CModule* m_pModule;
+    CString m_sName;
+};
+
+class CModule {
+public:
+    typedef std::function<void(const CString& sLine)> CmdFunc;
+    enum EModRet { CONTINUE = 1, HALT = 2, HALTMODS = 3, HALTCORE = 4 };
+
+    CModule(void* pDLL, CUser* pUser, CIRCNetwork* pNetwork, const CString& sModName,
+            const CString& sDataDir, CModInfo::EModuleType eType);
+    virtual ~CModule();
+
+    virtual bool OnLoad(const CString& sArgs, CString& sMessage) { return true; }
+    virtual EModRet OnChanMsg(CNick& Nick, CChan& Channel, CString& sMessage) { return CONTINUE; }
+    virtual void OnModCommand(const CString& sCommand);
+    virtual void OnIRCConnected() {}
+    virtual bool OnWebRequest(CWebSock& WebSock, const CString& sPageName, CTemplate& Tmpl) { return false; }
+    virtual bool WebRequiresLogin() { return true; }
+
+    bool AddCommand(const CString& sCmd, const CString& sArgs, const CString& sDesc, CmdFunc func);
+    void AddHelpCommand() {}
+    bool AddTimer(CTimer* pTimer);
+    unsigned int PutModule(const CString& sLine);
+    unsigned int PutModule(const CTable& table);
+    bool PutIRC(const CString& sLine);
+    CIRCNetwork* GetNetwork() const { return m_pNetwork; }
+    CUser* GetUser() const { return m_pUser; }
+    const CString& GetSavePath() const { return m_sSavePath; }
+    bool SetNV(const CString& sName, const CString& sValue, bool bWriteToDisk = true);
+    CString GetNV(const CString& sName) const;
+    bool DelNV(const CString& sName, bool bWriteToDisk = true);
+    MCString::iterator BeginNV() { return m_mssRegistry.begin(); }
+    MCString::iterator EndNV() { return m_mssRegistry.end(); }
+
+    //counters of the stand-in, read by the benchmarks and the checks
+    unsigned long long m_uModuleLines;
+    unsigned long long m_uIRCLines;
+    CString m_sLastIRCLine;
+
+protected:
+    CUser* m_pUser;
+    CIRCNetwork* m_pNetwork;
+    CString m_sSavePath;
+    std::map<CString, CmdFunc> m_mCommands;
+    std::vector<CTimer*> m_vTimers;
+    MCString m_mssRegistry;
+};
+
+#define MODCONSTRUCTOR(CLASS) \
+    CLASS(void* pDLL, CUser* pUser, CIRCNetwork* pNetwork, const CString& sModName, \
+          const CString& sModPath, CModInfo::EModuleType eType) \
+        : CModule(pDLL, pUser, pNetwork, sModName, sModPath, eType)
+
+#define NETWORKMODULEDEFS(CLASS, DESCRIPTION)
+
+#endif
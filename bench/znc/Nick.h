@@ -0,0 +1,25 @@
+#ifndef BENCH_ZNC_NICK_H
+#define BENCH_ZNC_NICK_H
+
+#include <znc/main.h>
+
+class CNick {
+public:
+    CNick(const CString& sMask = "");
+    const CString& GetNick() const { return m_sNick; }
+    const CString& GetIdent() const { return m_sIdent; }
+    const CString& GetHost() const { return m_sHost; }
+    CString GetHostMask() const { return m_sNick + "!" + m_sIdent + "@" + m_sHost; }
+    bool HasPerm(char cPerm) const { return m_sPerms.find(cPerm) != CString::npos; }
+    CString GetPermStr() const { return m_sPerms; }
+    void AddPerm(char cPerm) { m_sPerms += cPerm; }
+    bool NickEquals(const CString& sNickname) const { return m_sNick.Equals(sNickname); }
+
+protected:
+    CString m_sNick;
+    CString m_sIdent;
+    CString m_sHost;
+    CString m_sPerms;
+};
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef BENCH_ZNC_USER_H
+#define BENCH_ZNC_USER_H
+
+#include <znc/main.h>
+
+class CUser {
+public:
+    CUser(const CString& sUserName) : m_sUserName(sUserName), m_sNick(sUserName), m_bAdmin(false) {}
+    const CString& GetUserName() const { return m_sUserName; }
+    const CString& GetNick(bool bAllowDefault = true) const { return m_sNick; }
+    const CString& GetTimezone() const { return m_sTimezone; }
+    const CString& GetUserPath() const { return m_sUserPath; }
+    bool IsAdmin() const { return m_bAdmin; }
+    const std::vector<CIRCNetwork*>& GetNetworks() const { return m_vNetworks; }
+
+    CString m_sUserName;
+    CString m_sNick;
+    CString m_sTimezone;
+    CString m_sUserPath;
+    bool m_bAdmin;
+    std::vector<CIRCNetwork*> m_vNetworks;
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef BENCH_ZNC_UTILS_H
+#define BENCH_ZNC_UTILS_H
+
+#include <znc/main.h>
+
+class CTable : protected std::vector<std::vector<CString>> {
+public:
+    CTable() {}
+    virtual ~CTable() {}
+    bool AddColumn(const CString& sName);
+    size_type AddRow();
+    bool SetCell(const CString& sColumn, const CString& sValue, size_type uRowIdx = ~0);
+    bool empty() const { return std::vector<std::vector<CString>>::empty(); }
+
+protected:
+    std::vector<CString> m_vsHeaders;
+};
+
+#endif
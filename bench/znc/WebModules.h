@@ -0,0 +1,37 @@
+#ifndef BENCH_ZNC_WEBMODULES_H
+#define BENCH_ZNC_WEBMODULES_H
+
+#include <znc/main.h>
+
+class CTemplate {};
+
+class Csock {
+public:
+    enum ECloseType { CLT_DONT, CLT_NOW, CLT_AFTERWRITE, CLT_DEREFERENCE };
+    virtual ~Csock() {}
+};
+
+/**
+ * Web request of a module : the response is counted, not sent.
+ */
+class CWebSock : public Csock {
+public:
+    bool PrintHeader(off_t uContentLength, const CString& sContentType = "", unsigned int uStatusId = 200,
+                     const CString& sStatusMsg = "OK") {
+        m_sContentType = sContentType;
+        return true;
+    }
+    bool Write(const CString& sData) {
+        m_uWritten += sData.size();
+        m_uWrites++;
+        return true;
+    }
+    void Close(ECloseType eCloseType = CLT_NOW) {}
+
+    //response of the stand-in, read by the benchmarks
+    CString m_sContentType;
+    size_t m_uWritten = 0;
+    size_t m_uWrites = 0;
+};
+
+#endif
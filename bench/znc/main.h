@@ -0,0 +1,79 @@
+/*
+ * Minimal stand-in of the ZNC API used by counters.cpp, to build the
+ * benchmarks without ZNC. Only what the module uses is declared, see
+ * znc_shim.cpp for the implementation.
+ */
+#ifndef BENCH_ZNC_MAIN_H
+#define BENCH_ZNC_MAIN_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <sstream>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <sys/types.h>
+
+class CUser;
+class CIRCNetwork;
+class CModule;
+
+class CString : public std::string {
+public:
+    CString() {}
+    CString(const char* s) : std::string(s) {}
+    CString(const char* s, size_t n) : std::string(s, n) {}
+    CString(const std::string& s) : std::string(s) {}
+    CString(size_t n, char c) : std::string(n, c) {}
+    explicit CString(bool b) : std::string(b ? "true" : "false") {}
+    explicit CString(char c) : std::string(1, c) {}
+    explicit CString(unsigned char c) : std::string(1, (char) c) {}
+    explicit CString(short i) : std::string(std::to_string(i)) {}
+    explicit CString(unsigned short i) : std::string(std::to_string(i)) {}
+    explicit CString(int i) : std::string(std::to_string(i)) {}
+    explicit CString(unsigned int i) : std::string(std::to_string(i)) {}
+    explicit CString(long i) : std::string(std::to_string(i)) {}
+    explicit CString(unsigned long i) : std::string(std::to_string(i)) {}
+    explicit CString(long long i) : std::string(std::to_string(i)) {}
+    explicit CString(unsigned long long i) : std::string(std::to_string(i)) {}
+    explicit CString(double d, int precision = 2);
+    explicit CString(float f, int precision = 2);
+
+    CString Token(size_t uPos, bool bRest = false, const CString& sSep = " ", bool bAllowEmpty = false) const;
+    size_t Split(const CString& sDelim, std::vector<CString>& vsRet, bool bAllowEmpty = true,
+                 const CString& sLeft = "", const CString& sRight = "", bool bTrimQuotes = true,
+                 bool bTrimWhiteSpace = false) const;
+    bool Equals(const CString& s, bool bCaseSensitive = false) const;
+    bool StartsWith(const CString& s) const;
+    bool WildCmp(const CString& sWild, bool bCaseSensitive = true) const;
+    static bool WildCmp(const CString& sWild, const CString& sString, bool bCaseSensitive = true);
+    CString AsLower() const;
+    CString AsUpper() const;
+    int ToInt() const;
+    long long ToLongLong() const;
+    unsigned int ToUInt() const;
+    double ToDouble() const;
+    CString& Trim(const CString& s = " \t\r\n");
+    CString Trim_n(const CString& s = " \t\r\n") const;
+    static CString NamedFormat(const CString& sFormat, const std::map<CString, CString>& msValues);
+};
+
+typedef std::vector<CString> VCString;
+typedef std::set<CString> SCString;
+
+class MCString : public std::map<CString, CString> {
+public:
+    virtual ~MCString() {}
+};
+
+class CUtils {
+public:
+    static CString FormatTime(time_t t, const CString& sFormat, const CString& sTimezone);
+};
+
+#define t_d(x) (x)
+#define t_s(x) CString(x)
+
+#endif
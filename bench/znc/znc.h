@@ -0,0 +1,17 @@
+#ifndef BENCH_ZNC_ZNC_H
+#define BENCH_ZNC_ZNC_H
+
+#include <znc/main.h>
+
+class CZNC {
+public:
+    static CZNC& Get() {
+        static CZNC znc;
+        return znc;
+    }
+    const CString& GetZNCPath() const { return m_sZNCPath; }
+
+    CString m_sZNCPath;
+};
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * Implementation of the ZNC stand-in used by the benchmarks.
+ */
+#include <znc/main.h>
+#include <znc/Modules.h>
+#include <znc/Nick.h>
+#include <znc/IRCSock.h>
+#include <algorithm>
+#include <cstdio>
+#include <strings.h>
+
+CString::CString(double d, int precision) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", precision, d);
+    assign(buffer);
+}
+
+CString::CString(float f, int precision) : CString((double) f, precision) {}
+
+CString CString::Token(size_t uPos, bool bRest, const CString& sSep, bool bAllowEmpty) const {
+    size_t uStart = 0;
+    if (!bAllowEmpty) {
+        while (compare(uStart, sSep.size(), sSep) == 0 && uStart < size()) {
+            uStart += sSep.size();
+        }
+    }
+    for (size_t i = 0; i < uPos; i++) {
+        size_t uNext = find(sSep, uStart);
+        if (uNext == npos) {
+            return "";
+        }
+        uStart = uNext + sSep.size();
+        if (!bAllowEmpty) {
+            while (compare(uStart, sSep.size(), sSep) == 0 && uStart < size()) {
+                uStart += sSep.size();
+            }
+        }
+    }
+    if (bRest) {
+        return substr(uStart);
+    }
+    size_t uEnd = find(sSep, uStart);
+    return substr(uStart, uEnd == npos ? npos : uEnd - uStart);
+}
+
+size_t CString::Split(const CString& sDelim, VCString& vsRet, bool bAllowEmpty, const CString& sLeft,
+                      const CString& sRight, bool bTrimQuotes, bool bTrimWhiteSpace) const {
+    vsRet.clear();
+    if (empty()) {
+        return 0;
+    }
+    CString sToken;
+    bool bQuoted = false;
+    size_t i = 0;
+    while (i < size()) {
+        if (!sLeft.empty() && !bQuoted && compare(i, sLeft.size(), sLeft) == 0) {
+            bQuoted = true;
+            if (!bTrimQuotes) {
+                sToken += sLeft;
+            }
+            i += sLeft.size();
+        } else if (bQuoted && compare(i, sRight.size(), sRight) == 0) {
+            bQuoted = false;
+            if (!bTrimQuotes) {
+                sToken += sRight;
+            }
+            i += sRight.size();
+        } else if (!bQuoted && compare(i, sDelim.size(), sDelim) == 0) {
+            if (bTrimWhiteSpace) {
+                sToken.Trim();
+            }
+            if (bAllowEmpty || !sToken.empty()) {
+                vsRet.push_back(sToken);
+            }
+            sToken.clear();
+            i += sDelim.size();
+        } else {
+            sToken += (*this)[i];
+            i++;
+        }
+    }
+    if (bTrimWhiteSpace) {
+        sToken.Trim();
+    }
+    if (bAllowEmpty || !sToken.empty()) {
+        vsRet.push_back(sToken);
+    }
+    return vsRet.size();
+}
+
+bool CString::Equals(const CString& s, bool bCaseSensitive) const {
+    return bCaseSensitive ? *this == s : size() == s.size() && strcasecmp(c_str(), s.c_str()) == 0;
+}
+
+bool CString::StartsWith(const CString& s) const { return compare(0, s.size(), s) == 0; }
+
+bool CString::WildCmp(const CString& sWild, const CString& sString, bool bCaseSensitive) {
+    CString sWildCopy = bCaseSensitive ? sWild : sWild.AsLower();
+    CString sStringCopy = bCaseSensitive ? sString : sString.AsLower();
+    const char* wild = sWildCopy.c_str();
+    const char* string = sStringCopy.c_str();
+    const char* cp = nullptr;
+    const char* mp = nullptr;
+    while (*string && *wild != '*') {
+        if (*wild != *string && *wild != '?') {
+            return false;
+        }
+        wild++;
+        string++;
+    }
+    while (*string) {
+        if (*wild == '*') {
+            if (!*++wild) {
+                return true;
+            }
+            mp = wild;
+            cp = string + 1;
+        } else if (*wild == *string || *wild == '?') {
+            wild++;
+            string++;
+        } else {
+            wild = mp;
+            string = cp++;
+        }
+    }
+    while (*wild == '*') {
+        wild++;
+    }
+    return *wild == 0;
+}
+
+bool CString::WildCmp(const CString& sWild, bool bCaseSensitive) const {
+    return WildCmp(sWild, *this, bCaseSensitive);
+}
+
+CString CString::AsLower() const {
+    CString sRet(*this);
+    std::transform(sRet.begin(), sRet.end(), sRet.begin(), ::tolower);
+    return sRet;
+}
+
+CString CString::AsUpper() const {
+    CString sRet(*this);
+    std::transform(sRet.begin(), sRet.end(), sRet.begin(), ::toupper);
+    return sRet;
+}
+
+int CString::ToInt() const { return (int) strtol(c_str(), nullptr, 10); }
+long long CString::ToLongLong() const { return strtoll(c_str(), nullptr, 10); }
+unsigned int CString::ToUInt() const { return (unsigned int) strtoul(c_str(), nullptr, 10); }
+double CString::ToDouble() const { return strtod(c_str(), nullptr); }
+
+CString& CString::Trim(const CString& s) {
+    size_t uStart = find_first_not_of(s);
+    if (uStart == npos) {
+        clear();
+        return *this;
+    }
+    size_t uEnd = find_last_not_of(s);
+    assign(substr(uStart, uEnd - uStart + 1));
+    return *this;
+}
+
+CString CString::Trim_n(const CString& s) const {
+    CString sRet(*this);
+    return sRet.Trim(s);
+}
+
+CString CString::NamedFormat(const CString& sFormat, const std::map<CString, CString>& msValues) {
+    CString sRet;
+    CString sKey;
+    bool bEscape = false;
+    bool bParam = false;
+    for (char c : sFormat) {
+        if (!bParam) {
+            if (bEscape) {
+                sRet += c;
+                bEscape = false;
+            } else if (c == '\\') {
+                bEscape = true;
+            } else if (c == '{') {
+                bParam = true;
+                sKey.clear();
+            } else {
+                sRet += c;
+            }
+        } else if (bEscape) {
+            sKey += c;
+            bEscape = false;
+        } else if (c == '\\') {
+            bEscape = true;
+        } else if (c == '}') {
+            bParam = false;
+            auto it = msValues.find(sKey);
+            if (it != msValues.end()) {
+                sRet += it->second;
+            }
+        } else {
+            sKey += c;
+        }
+    }
+    return sRet;
+}
+
+CString CUtils::FormatTime(time_t t, const CString& sFormat, const CString& sTimezone) {
+    char buffer[64];
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buffer, sizeof(buffer), sFormat.c_str(), &tm);
+    return buffer;
+}
+
+bool CTable::AddColumn(const CString& sName) {
+    m_vsHeaders.push_back(sName);
+    return true;
+}
+
+CTable::size_type CTable::AddRow() {
+    push_back(std::vector<CString>(m_vsHeaders.size()));
+    return size() - 1;
+}
+
+bool CTable::SetCell(const CString& sColumn, const CString& sValue, size_type uRowIdx) {
+    if (std::vector<std::vector<CString>>::empty()) {
+        return false;
+    }
+    if (uRowIdx == (size_type) ~0) {
+        uRowIdx = size() - 1;
+    }
+    for (size_t i = 0; i < m_vsHeaders.size(); i++) {
+        if (m_vsHeaders[i] == sColumn) {
+            (*this)[uRowIdx][i] = sValue;
+            return true;
+        }
+    }
+    return false;
+}
+
+CNick::CNick(const CString& sMask) {
+    m_sNick = sMask.Token(0, false, "!");
+    m_sIdent = sMask.Token(1, false, "!").Token(0, false, "@");
+    m_sHost = sMask.Token(1, true, "@");
+}
+
+CString CIRCSock::GetISupport(const CString& sKey, const CString& sDefault) const {
+    auto it = m_mISupport.find(sKey.AsUpper());
+    return it == m_mISupport.end() ? sDefault : it->second;
+}
+
+CModule::CModule(void* pDLL, CUser* pUser, CIRCNetwork* pNetwork, const CString& sModName,
+                 const CString& sDataDir, CModInfo::EModuleType eType)
+    : m_uModuleLines(0), m_uIRCLines(0), m_pUser(pUser), m_pNetwork(pNetwork), m_sSavePath(sDataDir) {}
+
+CModule::~CModule() {
+    for (CTimer* pTimer : m_vTimers) {
+        delete pTimer;
+    }
+}
+
+void CModule::OnModCommand(const CString& sCommand) {
+    auto it = m_mCommands.find(sCommand.Token(0).AsLower());
+    if (it != m_mCommands.end()) {
+        it->second(sCommand);
+    }
+}
+
+bool CModule::AddCommand(const CString& sCmd, const CString& sArgs, const CString& sDesc, CmdFunc func) {
+    return m_mCommands.insert(std::make_pair(sCmd.AsLower(), func)).second;
+}
+
+bool CModule::AddTimer(CTimer* pTimer) {
+    m_vTimers.push_back(pTimer);
+    return true;
+}
+
+unsigned int CModule::PutModule(const CString& sLine) {
+    m_uModuleLines++;
+    return 1;
+}
+
+unsigned int CModule::PutModule(const CTable& table) {
+    m_uModuleLines++;
+    return 1;
+}
+
+bool CModule::PutIRC(const CString& sLine) {
+    m_uIRCLines++;
+    m_sLastIRCLine = sLine;
+    return true;
+}
+
+bool CModule::SetNV(const CString& sName, const CString& sValue, bool bWriteToDisk) {
+    m_mssRegistry[sName] = sValue;
+    return true;
+}
+
+CString CModule::GetNV(const CString& sName) const {
+    auto it = m_mssRegistry.find(sName);
+    return it == m_mssRegistry.end() ? CString() : it->second;
+}
+
+bool CModule::DelNV(const CString& sName, bool bWriteToDisk) {
+    return m_mssRegistry.erase(sName) > 0;
+}
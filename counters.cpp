@@ -2,12 +2,33 @@
 #include <string>
 #include <ctime>
 #include <functional>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <cstring>
+#include <strings.h>
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <znc/main.h>
 #include <znc/Modules.h>
 #include <znc/IRCNetwork.h>
+#include <znc/IRCSock.h>
 #include <znc/Chan.h>
 #include <znc/User.h>
-#include "argparse.hpp"
+#include <znc/FileUtils.h>
+#include <znc/WebModules.h>
+#include <znc/znc.h>
 
 
 
@@ -19,695 +40,6200 @@ const int DEFAULT_DELAY = 0;
 const std::string DEFAULT_MESSAGE = "{NAME} has value : {CURRENT_VALUE}";
 
 
-class MyMap : public MCString {
-private:
+/**
+ * How the delayed messages of a counter are grouped.
+ */
+enum ECoalesce {
+    COALESCE_NONE, /**< Each change sends its own message. */
+    COALESCE_DEBOUNCE, /**< One message, sent when there is no change during the delay. */
+    COALESCE_THROTTLE /**< One message, sent at the end of the delay after the first change. */
+};
+
+
+/**
+ * Which changes of a counter during its cooldown are announced.
+ */
+enum EEdge {
+    EDGE_LEADING = 1, /**< The change starting the cooldown, the next ones are not announced. */
+    EDGE_TRAILING = 2, /**< One message at the end of the cooldown, with the latest values. */
+    EDGE_BOTH = EDGE_LEADING | EDGE_TRAILING
+};
+
+
+/**
+ * What happens when a change would take the value of a counter out of its
+ * limits, or out of 64 bits.
+ */
+enum EArithmetic {
+    ARITHMETIC_SATURATE, /**< The value stops at the limit. */
+    ARITHMETIC_WRAP, /**< The value goes on from the other limit. */
+    ARITHMETIC_REJECT /**< The change is refused. */
+};
+
+
+/**
+ * Where a counter lives, and so which networks see it.
+ */
+enum EScope {
+    SCOPE_NETWORK, /**< Only the network of the module. */
+    SCOPE_USER, /**< All networks of the user. */
+    SCOPE_GLOBAL /**< All networks of all users. */
+};
+
+
+/**
+ * Fields of a counter that can be used in its message.
+ */
+enum EMessageField {
+    FIELD_NAME,
+    FIELD_INITIAL,
+    FIELD_STEP,
+    FIELD_COOLDOWN, /**< In milliseconds, shown in seconds. */
+    FIELD_DELAY, /**< In milliseconds, shown in seconds. */
+    FIELD_PREVIOUS_VALUE,
+    FIELD_CURRENT_VALUE,
+    FIELD_MINIMUM_VALUE,
+    FIELD_MAXIMUM_VALUE,
+    FIELD_RATE_1M, /**< Changes of the last minute. */
+    FIELD_RATE_1H, /**< Changes of the last hour. */
+    FIELD_TODAY, /**< Changes since midnight. */
+    FIELD_COUNT,
+    FIELD_LITERAL = FIELD_COUNT
+};
+
+
+/**
+ * Message of a counter compiled once into literal spans and fields, with the
+ * same syntax as CString::NamedFormat : "{KEY}" is replaced by the field KEY,
+ * unknown keys are removed and '\' escapes the next character.
+ */
+class CMessageTemplate {
+protected:
+    struct SToken {
+        unsigned int uField; /**< An EMessageField, FIELD_LITERAL for a span of m_sLiterals. */
+        unsigned int uOffset;
+        unsigned int uLength;
+    };
     
-    MyMap() {
-        
-    }
+    CString m_sLiterals; /**< Unescaped literal text of the message. */
+    std::vector<SToken> m_tokens;
+    unsigned int m_uFields; /**< Bit of each field used by the message. */
     
-    ~MyMap() {
+    
+    static unsigned int findField(const CString& sKey) {
+        static const char* const names[FIELD_COUNT] = {"NAME", "INITIAL", "STEP", "COOLDOWN", "DELAY",
+                "PREVIOUS_VALUE", "CURRENT_VALUE", "MINIMUM_VALUE", "MAXIMUM_VALUE", "RATE_1M", "RATE_1H", "TODAY"};
+        for (unsigned int field = 0; field < FIELD_COUNT; field++) {
+            if (sKey == names[field]) {
+                return field;
+            }
+        }
+        return FIELD_COUNT;
     }
     
-protected:
+    void addLiteral(char c) {
+        if (m_tokens.empty() || m_tokens.back().uField != FIELD_LITERAL) {
+            m_tokens.push_back({FIELD_LITERAL, (unsigned int) m_sLiterals.size(), 0});
+        }
+        m_sLiterals += c;
+        m_tokens.back().uLength++;
+    }
     
-
 public:
     
-    //CONSTRUCTORS AND DESCTRUTORS FOR SINGLETON
-    static MyMap& getInstance() {
-        static MyMap instance;
-        return instance;
+    CMessageTemplate(const CString& sMessage = "") {
+        compile(sMessage);
     }
-    MyMap(MyMap const&) = delete;
-    void operator=(MyMap const&) = delete;
-
-};
-
-
-class CCounter {
-protected:
-    //DATA MEMBERS
-    //"constants" defined by constructor and can be changed by user with "set" command
-    CString m_sName;
-    int m_initial;
-    int m_step;
-    int m_cooldown; /**< Cooldown between 2 messages when value change. */
-    int m_delay; /**< Delay to send message when value change. */
-    CString m_sMessage; /**< The message to send when value change. */
-    
-    //values that can change
-    int m_current_value;
-    int m_previous_value;
-    int m_minimum_value;
-    int m_maximum_value;
-    std::time_t m_last_change;
-    double m_time_chrono;
     
-    //other variable
-    std::time_t m_creation_datetime;
+    void compile(const CString& sMessage) {
+        m_sLiterals.clear();
+        m_tokens.clear();
+        m_uFields = 0;
+        CString sKey;
+        bool bEscape = false;
+        bool bParam = false;
+        for (char c : sMessage) {
+            if (bEscape) {
+                if (bParam)
+                    sKey += c;
+                else
+                    addLiteral(c);
+                bEscape = false;
+            }
+            else if (c == '\\') {
+                bEscape = true;
+            }
+            else if (!bParam) {
+                if (c == '{') {
+                    bParam = true;
+                    sKey.clear();
+                }
+                else {
+                    addLiteral(c);
+                }
+            }
+            else if (c == '}') {
+                bParam = false;
+                unsigned int field = findField(sKey);
+                if (field != FIELD_COUNT) {
+                    m_tokens.push_back({field, 0, 0});
+                    m_uFields |= 1u << field;
+                }
+            }
+            else {
+                sKey += c;
+            }
+        }
+    }
     
+    /**
+     * @return true if the message uses the field, so fields costly to compute are skipped
+     */
+    bool hasField(EMessageField field) const {
+        return m_uFields & (1u << field);
+    }
     
-    //MEMBER FUNCTIONS
     /**
-     * Set the previous value at current value and set last_change to now.
-     * Should be called before changing current value.
+     * Append an integer to a string without temporary string.
      */
-    void preChangeValue() {
-        m_previous_value = m_current_value;
-        //to improve : it's possible to send multiple messages in same time !
-        time_t now = time(nullptr);
-        double diffTime = difftime(now, m_last_change);
-        m_time_chrono -= diffTime;
-        if (m_time_chrono < 0) {
-            m_time_chrono = m_cooldown;
-        }
-        //to avoid flood of messages when the difference between 'm_last_change' and 'now' is 0
-        if (diffTime == 0) {
-            m_time_chrono -= 1;
+    static void appendInt(CString& sBuffer, long long value) {
+        char digits[24];
+        char* end = digits + sizeof(digits);
+        char* begin = end;
+        unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long) value : (unsigned long long) value;
+        do {
+            *--begin = (char) ('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude);
+        if (value < 0) {
+            *--begin = '-';
         }
-        m_last_change = now;
+        sBuffer.append(begin, end - begin);
     }
     
     /**
-     * Change minimum and maximum values depending of current value.
-     * Should be called after changing current valaue.
+     * Append a duration in milliseconds as seconds, with the decimals needed : 1500 is "1.5".
      */
-    void postChangeValue() {
-        if (m_current_value < m_minimum_value) {
-            m_minimum_value = m_current_value;
+    static void appendSeconds(CString& sBuffer, long long milliseconds) {
+        if (milliseconds < 0) {
+            sBuffer += '-';
         }
-        if (m_current_value > m_maximum_value) {
-            m_maximum_value = m_current_value;
+        unsigned long long magnitude = milliseconds < 0 ? 0ull - (unsigned long long) milliseconds
+                : (unsigned long long) milliseconds;
+        appendInt(sBuffer, (long long) (magnitude / 1000));
+        unsigned int fraction = (unsigned int) (magnitude % 1000);
+        if (fraction) {
+            char decimals[4] = {'.', (char) ('0' + fraction / 100), (char) ('0' + fraction / 10 % 10),
+                    (char) ('0' + fraction % 10)};
+            size_t length = 4;
+            while (decimals[length - 1] == '0') {
+                length--;
+            }
+            sBuffer.append(decimals, length);
         }
     }
     
     /**
-     * Reset minimum, maximum, previous values to current value.
+     * Render the message in sBuffer, which is cleared but keeps its capacity.
+     * @param sBuffer the buffer receiving the message
+     * @param sName value of the field NAME
+     * @param values values of the numeric fields, indexed by EMessageField
      */
-    void resetValues() {
-        m_maximum_value = m_minimum_value = m_previous_value = m_current_value;
+    void render(CString& sBuffer, const CString& sName, const long long values[FIELD_COUNT]) const {
+        sBuffer.clear();
+        for (const SToken& token : m_tokens) {
+            if (token.uField == FIELD_LITERAL)
+                sBuffer.append(m_sLiterals, token.uOffset, token.uLength);
+            else if (token.uField == FIELD_NAME)
+                sBuffer.append(sName);
+            else if (token.uField == FIELD_COOLDOWN || token.uField == FIELD_DELAY)
+                appendSeconds(sBuffer, values[token.uField]);
+            else
+                appendInt(sBuffer, values[token.uField]);
+        }
     }
     
+};
+
+
+/**
+ * Types of the records of the journal and of the snapshot.
+ */
+enum ERecordType {
+    RECORD_COUNTER = 1, /**< Whole state of a counter, at creation or in a snapshot. */
+    RECORD_DELETE,
+    RECORD_RESET,
+    RECORD_INCREMENT,
+    RECORD_DECREMENT,
+    RECORD_SET, /**< Change of a property with the "set" command. */
+    RECORD_LISTENER, /**< A listener, with its permissions and conditions. */
+    RECORD_DELETE_LISTENER,
+    RECORD_BATCH, /**< Records of a "batch" command, replayed all or none. */
+    RECORD_RENAME /**< Change of the name of a counter. */
+};
+
+
+/**
+ * Write records in a buffer : [32 bits length][8 bits type][fields], integers
+ * are little endian and strings are prefixed by their 32 bits length.
+ */
+class CRecordWriter {
+protected:
+    CString& m_sBuffer;
+    size_t m_uStart; /**< Position of the length of the current record. */
+    
 public:
     
-    //CONSTRUCTORS & DESTRUCTOR
-    CCounter(const CString& sName, const int initial = DEFAULT_INITIAL, const int step = DEFAULT_STEP,
-            const int cooldown = DEFAULT_COOLDOWN, const int delay = DEFAULT_DELAY,
-            const CString& sMessage = DEFAULT_MESSAGE) : m_sName(sName), m_initial(initial),
-            m_step(step), m_cooldown(cooldown), m_delay(delay), m_sMessage(sMessage) {
-        
-        m_previous_value = m_current_value = initial;
-        m_maximum_value = m_minimum_value = m_current_value;
-        m_last_change = m_creation_datetime = time(nullptr);
-        m_time_chrono = -1;
+    CRecordWriter(CString& sBuffer, ERecordType type) : m_sBuffer(sBuffer), m_uStart(sBuffer.size()) {
+        writeUInt32(0);
+        m_sBuffer += (char) type;
     }
     
-    ~CCounter() {
-
+    /**
+     * Write the length of the record.
+     */
+    ~CRecordWriter() {
+        unsigned int length = (unsigned int) (m_sBuffer.size() - m_uStart - 4);
+        for (int i = 0; i < 4; i++) {
+            m_sBuffer[m_uStart + i] = (char) (length >> (8 * i));
+        }
     }
     
-    
-    //GETTERS
-    CString getInfos(CUser* user) {
-        return CString("Name : " + m_sName + "\nCreated at : " + getCreationTime(user)
-                + "\nInitial : " + CString(m_initial) + "\nStep : " + CString(m_step)
-                + "\nCooldown : " + CString(m_cooldown) + "\nDelay : " + CString(m_delay)
-                + "\nMessage : " + m_sMessage + "\nCurrent : " + CString(m_current_value)
-                + "\nPrevious : " + CString(m_previous_value) + "\nMinimum : "
-                + CString(m_minimum_value) + "\nMaximum : " + CString(m_maximum_value)
-                + "\nLast change : " + getLastChangeTime(user));
+    CRecordWriter& writeUInt32(unsigned int value) {
+        for (int i = 0; i < 4; i++) {
+            m_sBuffer += (char) (value >> (8 * i));
+        }
+        return *this;
     }
     
-    CTable getInfosTable(CUser* user) {
-        CTable tableInfos = CTable();
-        tableInfos.AddColumn("Attribute");
-        tableInfos.AddColumn("Value");
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Name");
-        tableInfos.SetCell("Value",m_sName);
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Created at");
-        tableInfos.SetCell("Value",getCreationTime(user));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Initial");
-        tableInfos.SetCell("Value",CString(m_initial));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Step");
-        tableInfos.SetCell("Value",CString(m_step));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Cooldown");
-        tableInfos.SetCell("Value",CString(m_cooldown));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Delay");
-        tableInfos.SetCell("Value",CString(m_delay));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Message");
-        tableInfos.SetCell("Value",m_sMessage);
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Current value");
-        tableInfos.SetCell("Value",CString(m_current_value));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Previous value");
-        tableInfos.SetCell("Value",CString(m_previous_value));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Minimum value");
-        tableInfos.SetCell("Value",CString(m_minimum_value));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Maximum value");
-        tableInfos.SetCell("Value",CString(m_maximum_value));
-        tableInfos.AddRow();
-        tableInfos.SetCell("Attribute","Last change");
-        tableInfos.SetCell("Value",getLastChangeTime(user));
-        return tableInfos;
+    CRecordWriter& writeInt(long long value) {
+        for (int i = 0; i < 8; i++) {
+            m_sBuffer += (char) ((unsigned long long) value >> (8 * i));
+        }
+        return *this;
     }
     
-    CString getName() {
-        return m_sName;
+    CRecordWriter& writeString(const CString& sValue) {
+        writeUInt32((unsigned int) sValue.size());
+        m_sBuffer.append(sValue);
+        return *this;
     }
     
-    int getDelay() {
-        return m_delay;
-    }
+};
+
+
+/**
+ * Read the records written by CRecordWriter. Reading past the end of a record
+ * makes the reader invalid instead of failing.
+ */
+class CRecordReader {
+protected:
+    const unsigned char* m_pos;
+    const unsigned char* m_end;
+    bool m_bValid;
     
-    CString getCreationTime(CUser* user) {
-        return CUtils::FormatTime(m_creation_datetime, "%Y/%m/%d %H:%M:%S", user->GetTimezone());
+    bool has(size_t length) {
+        if ((size_t) (m_end - m_pos) < length) {
+            m_bValid = false;
+        }
+        return m_bValid;
     }
     
-    CString getLastChangeTime(CUser* user) {
-        return CUtils::FormatTime(m_last_change, "%Y/%m/%d %H:%M:%S", user->GetTimezone());
+public:
+    
+    CRecordReader(const char* data, size_t length) : m_pos((const unsigned char*) data),
+            m_end((const unsigned char*) data + length), m_bValid(true) {
+        
     }
     
-    //to improve ?
-    bool hasActiveCooldown() {
-        return m_time_chrono < m_cooldown && m_cooldown != 0;
+    bool isValid() const {
+        return m_bValid;
     }
     
-    CString getCurrentValue() {
-        return CString(m_current_value);
+    bool atEnd() const {
+        return m_pos == m_end;
     }
     
-    int getPreviousValue() {
-        return m_previous_value;
+    const char* getPosition() const {
+        return (const char*) m_pos;
     }
     
-    int getMinimumValue() {
-        return m_previous_value;
+    unsigned int readUInt32() {
+        unsigned int value = 0;
+        if (has(4)) {
+            for (int i = 0; i < 4; i++) {
+                value |= (unsigned int) m_pos[i] << (8 * i);
+            }
+            m_pos += 4;
+        }
+        return value;
     }
     
-    int getMaximumValue() {
-        return m_maximum_value;
+    long long readInt() {
+        unsigned long long value = 0;
+        if (has(8)) {
+            for (int i = 0; i < 8; i++) {
+                value |= (unsigned long long) m_pos[i] << (8 * i);
+            }
+            m_pos += 8;
+        }
+        return (long long) value;
     }
     
-    double getDiffTime() {
-        return m_time_chrono;
+    CString readString() {
+        unsigned int length = readUInt32();
+        if (!has(length)) {
+            return "";
+        }
+        CString sValue((const char*) m_pos, length);
+        m_pos += length;
+        return sValue;
     }
     
-    CString getNamedFormat() {
-        MyMap::getInstance().at("NAME") = m_sName;
-        MyMap::getInstance().at("INITIAL") = CString(m_initial);
-        MyMap::getInstance().at("STEP") = CString(m_step);
-        MyMap::getInstance().at("COOLDOWN") = CString(m_cooldown);
-        MyMap::getInstance().at("DELAY") = CString(m_delay);
-        MyMap::getInstance().at("PREVIOUS_VALUE") = CString(m_previous_value);
-        MyMap::getInstance().at("CURRENT_VALUE") = CString(m_current_value);
-        MyMap::getInstance().at("MINIMUM_VALUE") = CString(m_minimum_value);
-        MyMap::getInstance().at("MAXIMUM_VALUE") = CString(m_maximum_value);
-        return CString::NamedFormat(m_sMessage,MyMap::getInstance());
+    /**
+     * Read the next record of a sequence.
+     * @param type receives the type of the record
+     * @return a reader of the fields of the record, invalid if the record is truncated
+     */
+    CRecordReader readRecord(ERecordType& type) {
+        unsigned int length = readUInt32();
+        if (length == 0 || !has(length)) {
+            m_bValid = false;
+            return CRecordReader(nullptr, 0);
+        }
+        type = (ERecordType) m_pos[0];
+        CRecordReader record((const char*) m_pos + 1, length - 1);
+        m_pos += length;
+        return record;
     }
     
+};
+
+
+/**
+ * Value of a counter shared by several networks, without lock. Each network
+ * adds its changes to its own shard and the value is the sum of the shards.
+ * Shards are on distinct cache lines, so networks updating the value at the
+ * same time never write the same line.
+ */
+class CShardedValue {
+public:
+    static const unsigned int SHARDS = 16;
+    static const size_t CACHE_LINE_SIZE = 64;
     
-    //SETTERS
-    void setName(const CString sName) {
-        m_sName = sName;
-    }
+protected:
+    struct alignas(CACHE_LINE_SIZE) SShard {
+        std::atomic<long long> value;
+    };
     
-    void setInitial(const int initial) {
-        m_initial = initial;
-    }
+    SShard m_shards[SHARDS];
     
-    void setStep(const int step) {
-        m_step = step;
+    CShardedValue() {
+        for (SShard& shard : m_shards) {
+            shard.value.store(0, std::memory_order_relaxed);
+        }
     }
     
-    void setCooldown(const int cooldown) {
-        m_cooldown = cooldown;
-    }
+public:
     
-    void setDelay(const int delay) {
-        m_delay = delay;
+    /**
+     * Allocate a value aligned on a cache line, which operator new doesn't
+     * guarantee before C++17.
+     */
+    static std::shared_ptr<CShardedValue> create() {
+        void* memory = nullptr;
+        if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(CShardedValue)) != 0) {
+            throw std::bad_alloc();
+        }
+        return std::shared_ptr<CShardedValue>(new (memory) CShardedValue(), [](CShardedValue* value) {
+            value->~CShardedValue();
+            free(value);
+        });
     }
     
-    void setMessage(const CString& sMessage) {
-        m_sMessage = sMessage;
+    /**
+     * Add delta to a shard, wrapping on 64 bits.
+     */
+    void add(unsigned int uShard, long long delta) {
+        m_shards[uShard % SHARDS].value.fetch_add(delta, std::memory_order_relaxed);
     }
     
     /**
-     * Reset the counter at resetValue.
-     * @param resetValue the value that counter will take.
+     * @return the sum of the shards, wrapping on 64 bits
      */
-    void reset(const int resetValue) {
-        preChangeValue();
-        m_current_value = resetValue;
-        resetValues();
+    long long read() const {
+        unsigned long long sum = 0;
+        for (const SShard& shard : m_shards) {
+            sum += (unsigned long long) shard.value.load(std::memory_order_relaxed);
+        }
+        return (long long) sum;
     }
     
     /**
-     * Reset the counter at the initial value.
+     * Shard of the next network using shared values. Networks beyond SHARDS
+     * share shards, which stays correct as shards are only added to.
      */
-    void resetDefault() {
-        reset(m_initial);
+    static unsigned int allocateShard() {
+        static std::atomic<unsigned int> uNext(0);
+        return uNext.fetch_add(1, std::memory_order_relaxed) % SHARDS;
     }
     
-    void increment(int step) {
-        preChangeValue();
-        m_current_value += step;
-        postChangeValue();
+};
+
+
+/**
+ * Registry of the shared values of the process, by key. The lock is only
+ * taken when a counter starts to share its value, never to change it.
+ */
+class CSharedValues {
+protected:
+    static std::mutex& getMutex() {
+        static std::mutex mutex;
+        return mutex;
     }
     
-    void incrementDefault() {
-        increment(m_step);
+    static std::map<CString, std::weak_ptr<CShardedValue>>& getValues() {
+        static std::map<CString, std::weak_ptr<CShardedValue>> values;
+        return values;
     }
     
-    void decrement(const int step) {
-        preChangeValue();
-        m_current_value -= step;
-        postChangeValue();
-    }
+public:
     
-    void decrementDefault() {
-        decrement(m_step);
+    /**
+     * @return the value of a key, created if no counter uses it
+     */
+    static std::shared_ptr<CShardedValue> get(const CString& sKey) {
+        std::lock_guard<std::mutex> lock(getMutex());
+        std::map<CString, std::weak_ptr<CShardedValue>>& values = getValues();
+        std::shared_ptr<CShardedValue> pValue = values[sKey].lock();
+        if (!pValue) {
+            for (auto it = values.begin(); it != values.end(); ) {
+                it = it->second.expired() ? values.erase(it) : std::next(it);
+            }
+            pValue = CShardedValue::create();
+            values[sKey] = pValue;
+        }
+        return pValue;
     }
     
 };
 
-#ifdef HAVE_PTHREAD
-class CCounterJob : public CModuleJob {
+
+/**
+ * Recent changes of a counter : a ring of the last changes, and rings of
+ * the sums of the changes by second, minute and hour, so the changes of the
+ * last minute, hour or day are summed from a fixed number of buckets.
+ * The history uses no memory until it is enabled.
+ */
+class CCounterHistory {
+public:
+    static const unsigned int SAMPLES = 64;
+    
+    struct SSample {
+        long long delta;
+        unsigned int time;
+    };
     
 protected:
+    struct SBucket {
+        long long sum;
+        unsigned int index; /**< Time of the bucket divided by its width. */
+    };
+    
+    static const unsigned int SECONDS = 60;
+    static const unsigned int MINUTES = 60;
+    static const unsigned int HOURS = 24;
+    
+    std::vector<SSample> m_samples;
+    unsigned int m_uNext; /**< Position of the next sample in m_samples. */
+    unsigned int m_uSize;
+    std::vector<SBucket> m_buckets; /**< SECONDS, then MINUTES, then HOURS buckets. */
+    long long m_today;
+    std::time_t m_dayStart;
+    std::time_t m_dayEnd;
+    
     
-    CCounter m_counter;
+    static void add(SBucket* buckets, unsigned int count, unsigned int width, unsigned int time, long long delta) {
+        unsigned int index = time / width;
+        SBucket& bucket = buckets[index % count];
+        if (bucket.index != index) {
+            bucket.index = index;
+            bucket.sum = 0;
+        }
+        bucket.sum = (long long) ((unsigned long long) bucket.sum + (unsigned long long) delta);
+    }
     
+    /**
+     * Sum the buckets of the last units of width seconds, including the current one.
+     */
+    static long long sum(const SBucket* buckets, unsigned int count, unsigned int width, unsigned int time,
+            unsigned int units) {
+        unsigned int index = time / width;
+        unsigned long long total = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            //buckets from the future (clock set back) are ignored too
+            if (index - buckets[i].index < units) {
+                total += (unsigned long long) buckets[i].sum;
+            }
+        }
+        return (long long) total;
+    }
     
 public:
-
-    CCounterJob(CModule* pModule, CCounter counter) : CModuleJob(pModule, "counters",
-    "Send message for counter on channel after a delay"), m_counter(counter) {
+    
+    CCounterHistory() : m_uNext(0), m_uSize(0), m_today(0), m_dayStart(0), m_dayEnd(0) {
         
     }
     
-    virtual ~CCounterJob() override {
-//        if (wasCancelled()) {
-//            GetModule()->PutModule("Counter job cancelled");
-//        }
-//        else {
-//            GetModule()->PutModule("Counter job destroyed");
-//        }
+    bool isEnabled() const {
+        return !m_buckets.empty();
     }
     
-    virtual void runThread() override {
-        int delay = m_counter.getDelay();
-        for (int i = 0; i < delay; i++) {
-            if (wasCancelled()) {
-                return;
-            }
-            sleep(1);
+    void setEnabled(bool bEnabled) {
+        if (bEnabled == isEnabled()) {
+            return;
         }
+        std::vector<SSample>().swap(m_samples);
+        std::vector<SBucket>().swap(m_buckets);
+        m_uNext = m_uSize = 0;
+        m_today = m_dayStart = m_dayEnd = 0;
+        if (bEnabled) {
+            m_samples.resize(SAMPLES);
+            m_buckets.resize(SECONDS + MINUTES + HOURS, SBucket{0, 0});
+        }
+    }
+    
+    /**
+     * Add a change, if the history is enabled.
+     */
+    void record(std::time_t now, long long delta) {
+        if (!isEnabled()) {
+            return;
+        }
+        unsigned int time = (unsigned int) now;
+        m_samples[m_uNext] = SSample{delta, time};
+        m_uNext = (m_uNext + 1) % SAMPLES;
+        if (m_uSize < SAMPLES) {
+            m_uSize++;
+        }
+        add(&m_buckets[0], SECONDS, 1, time, delta);
+        add(&m_buckets[SECONDS], MINUTES, 60, time, delta);
+        add(&m_buckets[SECONDS + MINUTES], HOURS, 3600, time, delta);
+        if (now < m_dayStart || now >= m_dayEnd) {
+            //midnight in the time zone of the server
+            struct tm day;
+            localtime_r(&now, &day);
+            day.tm_hour = day.tm_min = day.tm_sec = 0;
+            day.tm_isdst = -1;
+            m_dayStart = mktime(&day);
+            day.tm_mday++;
+            day.tm_isdst = -1;
+            m_dayEnd = mktime(&day);
+            m_today = 0;
+        }
+        m_today = (long long) ((unsigned long long) m_today + (unsigned long long) delta);
+    }
+    
+    long long getLastMinute(std::time_t now) const {
+        return isEnabled() ? sum(&m_buckets[0], SECONDS, 1, (unsigned int) now, SECONDS) : 0;
+    }
+    
+    long long getLastHour(std::time_t now) const {
+        return isEnabled() ? sum(&m_buckets[SECONDS], MINUTES, 60, (unsigned int) now, MINUTES) : 0;
+    }
+    
+    long long getLastDay(std::time_t now) const {
+        return isEnabled() ? sum(&m_buckets[SECONDS + MINUTES], HOURS, 3600, (unsigned int) now, HOURS) : 0;
+    }
+    
+    long long getToday(std::time_t now) const {
+        return now >= m_dayStart && now < m_dayEnd ? m_today : 0;
     }
     
-    virtual void runMain() override {
-        CString formattedMessage = m_counter.getNamedFormat();
-        CIRCNetwork* network = GetModule()->GetNetwork();
-        std::vector<CChan*> channels = network->GetChans();
-        for (CChan* channel : channels) {
-            GetModule()->PutIRC("PRIVMSG " + channel->GetName() + " :" + formattedMessage);
+    /**
+     * @return the last changes, the most recent first
+     */
+    std::vector<SSample> getSamples() const {
+        std::vector<SSample> samples;
+        samples.reserve(m_uSize);
+        for (unsigned int i = 1; i <= m_uSize; i++) {
+            samples.push_back(m_samples[(m_uNext + SAMPLES - i) % SAMPLES]);
         }
+        return samples;
     }
     
 };
-#endif
 
-class CCounterListener {
-    
+
+#ifdef COUNTERS_STATS
+/**
+ * Hot paths of the module whose latency is measured, when the module is
+ * built with COUNTERS_STATS.
+ */
+enum EProbe {
+    PROBE_CHAN_MSG, /**< OnChanMsg, for the lines not filtered by their first byte. */
+    PROBE_SIMPLE_COMMAND, /**< Commands incr, decr, reset and print. */
+    PROBE_FORMAT, /**< Formatting of the message of a counter. */
+    PROBE_PUT_IRC, /**< Sending of a line of the outbound queue to its targets. */
+    PROBE_COUNT
 };
 
-class CCountersMod : public CModule {
+
+/**
+ * Latencies of the probes measured by one thread, in nanoseconds, in
+ * logarithmic buckets : SUBS buckets for each power of 2, so a percentile
+ * is known within 25 %. Only its thread writes it, with relaxed loads and
+ * stores instead of read-modify-write, so other threads read it without lock.
+ * A reset starts a new window : each thread clears its values at its next
+ * record, and the values of other windows are not read.
+ */
+class CLatencyHistograms {
+public:
+    static const unsigned int SUB_BITS = 2;
+    static const unsigned int SUBS = 1u << SUB_BITS;
+    static const unsigned int BUCKETS = (64 - SUB_BITS + 1) * SUBS;
+    
+    struct SSummary {
+        unsigned long long uCount;
+        unsigned long long uSum;
+        unsigned long long uMax;
+        unsigned long long uP50;
+        unsigned long long uP99;
+    };
+    
 protected:
-    //DATA MEMBERS
-    std::map<CString,CCounter> m_counters;
-    /**
-     * map with keys as couple (nickname,listener_name) and value as counter_name
-     */
-    std::map<std::pair<CString,CString>,CString> m_listeners;
-    ArgumentParser m_parserCreate;
+    struct SHistogram {
+        std::atomic<unsigned long long> buckets[BUCKETS];
+        std::atomic<unsigned long long> uCount;
+        std::atomic<unsigned long long> uSum;
+        std::atomic<unsigned long long> uMax;
+    };
     
+    struct SWindow {
+        std::atomic<unsigned int> uNumber;
+        std::atomic<long long> start; /**< In milliseconds of steady_clock. */
+    };
+    
+    SHistogram m_histograms[PROBE_COUNT];
+    std::atomic<unsigned int> m_uWindow;
+    
+    
+    static long long getMonotonicMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
     
-    //FUNCTIONS
     /**
-     * Casts a CString to another type (specially int). If the cast fails,
-     * return the specified value.
-     * @param text string to cast
-     * @param value default value if fail
-     * @return value represented by text, or value in fail
+     * The current window, started at the first record or at the last reset.
      */
-    template<typename T>
-    T convertWithDefaultValue(const CString text, const T value) {
-        std::stringstream ss(text);
-        T result;
-        return ss >> result ? result : value;
+    static SWindow& getCurrentWindow() {
+        static SWindow window{{0}, {getMonotonicMs()}};
+        return window;
+    }
+    
+    static std::mutex& getMutex() {
+        static std::mutex mutex;
+        return mutex;
     }
     
     /**
-     * Check if a string is empty.
-     * @param text
-     * @param defaultText
-     * @return if text is empty, returns defaultText, else returns text.
+     * Histograms of all threads which recorded a latency, never freed.
      */
-    CString checkStringValue(const CString text, CString defaultText) {
-        return text.empty() ? defaultText : text;
+    static std::vector<CLatencyHistograms*>& getThreads() {
+        static std::vector<CLatencyHistograms*> threads;
+        return threads;
+    }
+    
+    static void add(std::atomic<unsigned long long>& value, unsigned long long delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    
+    void clear() {
+        for (SHistogram& histogram : m_histograms) {
+            for (std::atomic<unsigned long long>& bucket : histogram.buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+            histogram.uCount.store(0, std::memory_order_relaxed);
+            histogram.uSum.store(0, std::memory_order_relaxed);
+            histogram.uMax.store(0, std::memory_order_relaxed);
+        }
+    }
+    
+    CLatencyHistograms() : m_uWindow(getCurrentWindow().uNumber.load(std::memory_order_relaxed)) {
+        clear();
+    }
+    
+    static unsigned int getBucket(unsigned long long ns) {
+        if (ns < SUBS) {
+            return (unsigned int) ns;
+        }
+        unsigned int exponent = 63 - __builtin_clzll(ns);
+        unsigned int sub = (ns >> (exponent - SUB_BITS)) & (SUBS - 1);
+        return (exponent - SUB_BITS + 1) * SUBS + sub;
+    }
+    
+    /**
+     * @return the largest latency of a bucket
+     */
+    static unsigned long long getUpperBound(unsigned int bucket) {
+        if (bucket < SUBS) {
+            return bucket;
+        }
+        unsigned int exponent = bucket / SUBS + SUB_BITS - 1;
+        unsigned long long sub = bucket % SUBS;
+        return ((SUBS + sub + 1) << (exponent - SUB_BITS)) - 1;
+    }
+    
+    static unsigned long long getPercentile(const unsigned long long buckets[BUCKETS], const SSummary& summary,
+            double percentile) {
+        unsigned long long uRank = (unsigned long long) std::ceil(summary.uCount * percentile);
+        unsigned long long uSeen = 0;
+        for (unsigned int bucket = 0; bucket < BUCKETS; bucket++) {
+            uSeen += buckets[bucket];
+            if (uSeen >= uRank && uSeen > 0) {
+                return std::min(getUpperBound(bucket), summary.uMax);
+            }
+        }
+        return summary.uMax;
+    }
+    
+public:
+    
+    /**
+     * @return the histograms of the calling thread, created at its first call
+     */
+    static CLatencyHistograms& getLocal() {
+        static thread_local CLatencyHistograms* pLocal = nullptr;
+        if (!pLocal) {
+            pLocal = new CLatencyHistograms();
+            std::lock_guard<std::mutex> lock(getMutex());
+            getThreads().push_back(pLocal);
+        }
+        return *pLocal;
+    }
+    
+    void record(EProbe probe, unsigned long long ns) {
+        unsigned int uWindow = getCurrentWindow().uNumber.load(std::memory_order_relaxed);
+        if (m_uWindow.load(std::memory_order_relaxed) != uWindow) {
+            clear();
+            m_uWindow.store(uWindow, std::memory_order_relaxed);
+        }
+        SHistogram& histogram = m_histograms[probe];
+        add(histogram.buckets[getBucket(ns)], 1);
+        add(histogram.uCount, 1);
+        add(histogram.uSum, ns);
+        if (ns > histogram.uMax.load(std::memory_order_relaxed)) {
+            histogram.uMax.store(ns, std::memory_order_relaxed);
+        }
+    }
+    
+    /**
+     * Start a new window, the latencies recorded before are forgotten.
+     */
+    static void reset() {
+        getCurrentWindow().start.store(getMonotonicMs(), std::memory_order_relaxed);
+        getCurrentWindow().uNumber.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    /**
+     * @return the duration of the current window, in milliseconds
+     */
+    static long long getWindowDuration() {
+        return getMonotonicMs() - getCurrentWindow().start.load(std::memory_order_relaxed);
+    }
+    
+    /**
+     * Merge the latencies of a probe recorded by all threads in the current window.
+     */
+    static SSummary summarize(EProbe probe) {
+        unsigned long long buckets[BUCKETS] = {};
+        SSummary summary = {0, 0, 0, 0, 0};
+        unsigned int uWindow = getCurrentWindow().uNumber.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(getMutex());
+        for (CLatencyHistograms* pThread : getThreads()) {
+            if (pThread->m_uWindow.load(std::memory_order_relaxed) != uWindow) {
+                continue;
+            }
+            const SHistogram& histogram = pThread->m_histograms[probe];
+            for (unsigned int bucket = 0; bucket < BUCKETS; bucket++) {
+                buckets[bucket] += histogram.buckets[bucket].load(std::memory_order_relaxed);
+            }
+            summary.uCount += histogram.uCount.load(std::memory_order_relaxed);
+            summary.uSum += histogram.uSum.load(std::memory_order_relaxed);
+            summary.uMax = std::max(summary.uMax, histogram.uMax.load(std::memory_order_relaxed));
+        }
+        summary.uP50 = getPercentile(buckets, summary, 0.5);
+        summary.uP99 = getPercentile(buckets, summary, 0.99);
+        return summary;
+    }
+    
+};
+
+
+/**
+ * Measure the latency of a probe, from its construction to its destruction.
+ */
+class CLatencyScope {
+protected:
+    EProbe m_probe;
+    std::chrono::steady_clock::time_point m_start;
+    
+public:
+    
+    CLatencyScope(EProbe probe) : m_probe(probe), m_start(std::chrono::steady_clock::now()) {
+        
+    }
+    
+    ~CLatencyScope() {
+        CLatencyHistograms::getLocal().record(m_probe, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - m_start).count());
+    }
+    
+};
+
+#define COUNTERS_LATENCY(probe) CLatencyScope latencyScope(probe)
+#else
+#define COUNTERS_LATENCY(probe)
+#endif
+
+
+/**
+ * Values of a counter at a change, kept by a delayed message to be formatted
+ * when it is sent.
+ */
+struct SCounterValues {
+    long long previous;
+    long long current;
+    long long minimum;
+    long long maximum;
+};
+
+
+/**
+ * Values of a counter changed by its operations. A CCounterTable keeps them
+ * in an array indexed by slot, apart from the strings of the counters.
+ */
+struct SCounterHotState {
+    long long current;
+    long long previous;
+    long long minimum;
+    long long maximum;
+    std::time_t lastChange;
+    long long cooldownEnd; /**< End of the cooldown, in milliseconds of steady_clock. */
+    bool bCooldownPending; /**< A change waits for the end of the cooldown to be announced. */
+};
+
+
+/**
+ * Hot state of a counter : its own copy, or its entry in the array of a
+ * CCounterTable once the counter is attached to a slot. A copy of the
+ * counter gets its own copy of the values, and an assignment writes the
+ * values where the state is, so a counter of a table stays in its entry.
+ */
+class CCounterHotState {
+protected:
+    SCounterHotState m_own;
+    SCounterHotState* m_pState;
+    
+public:
+    
+    CCounterHotState() : m_own(), m_pState(&m_own) {
+        
+    }
+    
+    CCounterHotState(const CCounterHotState& other) : m_own(*other.m_pState), m_pState(&m_own) {
+        
+    }
+    
+    CCounterHotState& operator=(const CCounterHotState& other) {
+        *m_pState = *other.m_pState;
+        return *this;
+    }
+    
+    SCounterHotState* operator->() const {
+        return m_pState;
+    }
+    
+    const SCounterHotState& get() const {
+        return *m_pState;
+    }
+    
+    /**
+     * Use an entry of the array of a table, which already holds the values.
+     */
+    void attach(SCounterHotState* pState) {
+        m_pState = pState;
+    }
+    
+};
+
+
+class CCounter {
+protected:
+    //DATA MEMBERS
+    //"constants" defined by constructor and can be changed by user with "set" command
+    CString m_sName;
+    long long m_initial;
+    long long m_step;
+    int m_cooldown; /**< Cooldown between 2 messages when value change, in milliseconds. */
+    int m_delay; /**< Delay to send message when value change, in milliseconds. */
+    CString m_sMessage; /**< The message to send when value change. */
+    CMessageTemplate m_template; /**< m_sMessage compiled. */
+    ECoalesce m_coalesce; /**< How delayed messages are grouped. */
+    EEdge m_edge; /**< Which changes are announced during the cooldown. */
+    VCString m_vsTargets; /**< Channels or nicknames receiving messages, all channels if empty. */
+    EArithmetic m_arithmetic; /**< What happens when the value leaves the limits. */
+    long long m_lowerLimit;
+    long long m_upperLimit;
+    EScope m_scope; /**< Not saved in the state, it is given by the file holding the counter. */
+    CCounterHistory m_history; /**< Kept in memory only, only its activation is saved. */
+    
+    //values that can change, in the array of the table of the counter
+    CCounterHotState m_hot;
+    
+    //other variable
+    std::time_t m_creation_datetime;
+    unsigned int m_pendingAnnouncement; /**< Handle of the coalesced message in the timer wheel, ~0u if none. */
+    
+    //shared value, the current value is then the contribution of this network
+    bool m_bShared; /**< Saved with the counter, the module attaches m_pShared when it is loaded. */
+    std::shared_ptr<CShardedValue> m_pShared;
+    unsigned int m_uShard;
+    long long m_published; /**< Part of the current value already added to the shard. */
+    
+    
+    //MEMBER FUNCTIONS
+    /**
+     * Set the previous value at current value and set last_change to now.
+     * Should be called before changing current value.
+     */
+    void preChangeValue() {
+        m_hot->previous = m_hot->current;
+        m_hot->lastChange = time(nullptr);
+    }
+    
+    /**
+     * Set the current value and change minimum and maximum values depending
+     * of it. The value is brought back into the limits following the
+     * arithmetic mode.
+     * @param value the new value, wrapped on 64 bits if bOverflow
+     * @param bOverflow the operation giving value overflowed 64 bits
+     * @param amount the amount of the operation
+     * @param bSubtract the operation subtracts amount
+     * @return false if the change is rejected, nothing is changed then
+     */
+    bool postChangeValue(long long value, bool bOverflow, long long amount, bool bSubtract) {
+        if (bOverflow || value < m_lowerLimit || value > m_upperLimit) {
+            switch (m_arithmetic) {
+                case ARITHMETIC_REJECT:
+                    return false;
+                case ARITHMETIC_WRAP:
+                    value = wrapValue(amount, bSubtract);
+                    break;
+                default:
+                    value = (amount < 0) == bSubtract ? m_upperLimit : m_lowerLimit;
+                    break;
+            }
+        }
+        preChangeValue();
+        m_hot->current = value;
+        if (m_hot->current < m_hot->minimum) {
+            m_hot->minimum = m_hot->current;
+        }
+        if (m_hot->current > m_hot->maximum) {
+            m_hot->maximum = m_hot->current;
+        }
+        return true;
+    }
+    
+    /**
+     * Add amount to the current value modulo the size of the limits, which can
+     * be the whole 64 bits.
+     * @param bSubtract subtract amount instead
+     * @return the new value
+     */
+    long long wrapValue(long long amount, bool bSubtract) const {
+        //number of values between the limits, 0 for 2^64
+        unsigned long long range = (unsigned long long) m_upperLimit - (unsigned long long) m_lowerLimit + 1;
+        unsigned long long magnitude = amount < 0 ? 0 - (unsigned long long) amount : (unsigned long long) amount;
+        unsigned long long offset = (unsigned long long) m_hot->current - (unsigned long long) m_lowerLimit;
+        if (range != 0) {
+            magnitude %= range;
+        }
+        if ((amount < 0) == bSubtract) {
+            offset += magnitude;
+            if (range != 0 && (offset >= range || offset < magnitude)) {
+                offset -= range;
+            }
+        }
+        else {
+            offset = offset >= magnitude ? offset - magnitude : offset + (range - magnitude);
+        }
+        return (long long) ((unsigned long long) m_lowerLimit + offset);
+    }
+    
+    /**
+     * Reset minimum, maximum, previous values to current value.
+     */
+    void resetValues() {
+        m_hot->maximum = m_hot->minimum = m_hot->previous = m_hot->current;
+    }
+    
+public:
+    
+    //CONSTRUCTORS & DESTRUCTOR
+    CCounter(const CString& sName, const long long initial = DEFAULT_INITIAL, const long long step = DEFAULT_STEP,
+            const int cooldown = DEFAULT_COOLDOWN, const int delay = DEFAULT_DELAY,
+            const CString& sMessage = DEFAULT_MESSAGE) : m_sName(sName), m_initial(initial),
+            m_step(step), m_cooldown(cooldown), m_delay(delay), m_sMessage(sMessage),
+            m_template(sMessage), m_coalesce(COALESCE_NONE), m_edge(EDGE_LEADING), m_arithmetic(ARITHMETIC_SATURATE),
+            m_lowerLimit(LLONG_MIN), m_upperLimit(LLONG_MAX), m_scope(SCOPE_NETWORK), m_pendingAnnouncement(~0u),
+            m_bShared(false), m_uShard(0), m_published(0) {
+        
+        m_hot->previous = m_hot->current = initial;
+        m_hot->maximum = m_hot->minimum = m_hot->current;
+        m_hot->lastChange = m_creation_datetime = time(nullptr);
+        m_hot->cooldownEnd = 0;
+        m_hot->bCooldownPending = false;
+    }
+    
+    ~CCounter() {
+
+    }
+    
+    
+    //GETTERS
+    CString getInfos(CUser* user) {
+        return CString("Name : " + m_sName + "\nCreated at : " + getCreationTime(user)
+                + "\nInitial : " + CString(m_initial) + "\nStep : " + CString(m_step)
+                + "\nCooldown : " + getDurationString(m_cooldown) + "\nDelay : " + getDurationString(m_delay)
+                + "\nMessage : " + m_sMessage + "\nCoalesce : " + getCoalesceName()
+                + "\nTargets : " + getTargetsString() + "\nArithmetic : " + getArithmeticName()
+                + "\nLower limit : " + getLimitString(m_lowerLimit, LLONG_MIN)
+                + "\nUpper limit : " + getLimitString(m_upperLimit, LLONG_MAX)
+                + "\nCurrent : " + CString(m_hot->current)
+                + "\nPrevious : " + CString(m_hot->previous) + "\nMinimum : "
+                + CString(m_hot->minimum) + "\nMaximum : " + CString(m_hot->maximum)
+                + "\nLast change : " + getLastChangeTime(user));
+    }
+    
+    CTable getInfosTable(CUser* user) {
+        CTable tableInfos = CTable();
+        tableInfos.AddColumn("Attribute");
+        tableInfos.AddColumn("Value");
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Name");
+        tableInfos.SetCell("Value",m_sName);
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Created at");
+        tableInfos.SetCell("Value",getCreationTime(user));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Initial");
+        tableInfos.SetCell("Value",CString(m_initial));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Step");
+        tableInfos.SetCell("Value",CString(m_step));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Cooldown");
+        tableInfos.SetCell("Value",getDurationString(m_cooldown));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Edge");
+        tableInfos.SetCell("Value",getEdgeName());
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Delay");
+        tableInfos.SetCell("Value",getDurationString(m_delay));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Message");
+        tableInfos.SetCell("Value",m_sMessage);
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Coalesce");
+        tableInfos.SetCell("Value",getCoalesceName());
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Targets");
+        tableInfos.SetCell("Value",m_vsTargets.empty() ? CString("all channels") : getTargetsString());
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Arithmetic");
+        tableInfos.SetCell("Value",getArithmeticName());
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Lower limit");
+        tableInfos.SetCell("Value",getLimitString(m_lowerLimit, LLONG_MIN));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Upper limit");
+        tableInfos.SetCell("Value",getLimitString(m_upperLimit, LLONG_MAX));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","History");
+        tableInfos.SetCell("Value",m_history.isEnabled() ? CString("on") : CString("off"));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Scope");
+        tableInfos.SetCell("Value",getScopeName());
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Shared");
+        tableInfos.SetCell("Value",m_bShared ? CString("yes") : CString("no"));
+        if (m_pShared) {
+            tableInfos.AddRow();
+            tableInfos.SetCell("Attribute","Shared value");
+            tableInfos.SetCell("Value",CString(m_pShared->read()));
+        }
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Current value");
+        tableInfos.SetCell("Value",CString(m_hot->current));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Previous value");
+        tableInfos.SetCell("Value",CString(m_hot->previous));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Minimum value");
+        tableInfos.SetCell("Value",m_bShared ? CString("not tracked when shared") : CString(m_hot->minimum));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Maximum value");
+        tableInfos.SetCell("Value",m_bShared ? CString("not tracked when shared") : CString(m_hot->maximum));
+        tableInfos.AddRow();
+        tableInfos.SetCell("Attribute","Last change");
+        tableInfos.SetCell("Value",getLastChangeTime(user));
+        return tableInfos;
+    }
+    
+    CString getName() {
+        return m_sName;
+    }
+    
+    const CString& getMessage() {
+        return m_sMessage;
+    }
+    
+    long long getInitial() {
+        return m_initial;
+    }
+    
+    long long getStep() {
+        return m_step;
+    }
+    
+    int getDelay() {
+        return m_delay;
+    }
+    
+    ECoalesce getCoalesce() {
+        return m_coalesce;
+    }
+    
+    CString getCoalesceName() {
+        switch (m_coalesce) {
+            case COALESCE_DEBOUNCE:
+                return "debounce";
+            case COALESCE_THROTTLE:
+                return "throttle";
+            default:
+                return "none";
+        }
+    }
+    
+    CString getEdgeName() {
+        switch (m_edge) {
+            case EDGE_TRAILING:
+                return "trailing";
+            case EDGE_BOTH:
+                return "both";
+            default:
+                return "leading";
+        }
+    }
+    
+    /**
+     * @return the duration in seconds if it is a whole number of seconds, in milliseconds otherwise
+     */
+    static CString getDurationString(int milliseconds) {
+        if (milliseconds % 1000 == 0) {
+            return CString(milliseconds / 1000) + " s";
+        }
+        return CString(milliseconds) + " ms";
+    }
+    
+    EArithmetic getArithmetic() {
+        return m_arithmetic;
+    }
+    
+    CString getArithmeticName() {
+        switch (m_arithmetic) {
+            case ARITHMETIC_WRAP:
+                return "wrap";
+            case ARITHMETIC_REJECT:
+                return "reject";
+            default:
+                return "saturate";
+        }
+    }
+    
+    /**
+     * @return the limit, or "none" if it is the default one
+     */
+    static CString getLimitString(long long limit, long long none) {
+        return limit == none ? CString("none") : CString(limit);
+    }
+    
+    EScope getScope() {
+        return m_scope;
+    }
+    
+    CString getScopeName() {
+        switch (m_scope) {
+            case SCOPE_USER:
+                return "user";
+            case SCOPE_GLOBAL:
+                return "global";
+            default:
+                return "network";
+        }
+    }
+    
+    /**
+     * @param sScope "network", "user" or "global"
+     * @return false if sScope is not a scope
+     */
+    static bool parseScope(const CString& sScope, EScope& scope) {
+        if (sScope.Equals("network"))
+            scope = SCOPE_NETWORK;
+        else if (sScope.Equals("user"))
+            scope = SCOPE_USER;
+        else if (sScope.Equals("global"))
+            scope = SCOPE_GLOBAL;
+        else
+            return false;
+        return true;
+    }
+    
+    const VCString& getTargets() {
+        return m_vsTargets;
+    }
+    
+    /**
+     * @return the targets separated by commas
+     */
+    CString getTargetsString() {
+        CString sTargets;
+        for (const CString& sTarget : m_vsTargets) {
+            if (!sTargets.empty()) {
+                sTargets += ",";
+            }
+            sTargets += sTarget;
+        }
+        return sTargets;
+    }
+    
+    unsigned int getPendingAnnouncement() {
+        return m_pendingAnnouncement;
+    }
+    
+    CString getCreationTime(CUser* user) {
+        return CUtils::FormatTime(m_creation_datetime, "%Y/%m/%d %H:%M:%S", user->GetTimezone());
+    }
+    
+    CString getLastChangeTime(CUser* user) {
+        return CUtils::FormatTime(m_hot->lastChange, "%Y/%m/%d %H:%M:%S", user->GetTimezone());
+    }
+    
+    CString getCurrentValue() {
+        return CString(m_hot->current);
+    }
+    
+    long long getPreviousValue() {
+        return m_hot->previous;
+    }
+    
+    long long getMinimumValue() {
+        return m_hot->minimum;
+    }
+    
+    long long getMaximumValue() {
+        return m_hot->maximum;
+    }
+    
+    long long getCooldownEnd() {
+        return m_hot->cooldownEnd;
+    }
+    
+    const SCounterHotState& getHotState() const {
+        return m_hot.get();
+    }
+    
+    /**
+     * Keep the values in an entry of the array of a table, the entry must already hold them.
+     */
+    void attachHotState(SCounterHotState* pState) {
+        m_hot.attach(pState);
+    }
+    
+    /**
+     * @return the values shown by the message, a shared counter shows the value of all networks
+     */
+    SCounterValues getValues() {
+        long long others = getSharedOthers();
+        return SCounterValues{addWrap(m_hot->previous, others), addWrap(m_hot->current, others),
+                m_hot->minimum, m_hot->maximum};
+    }
+    
+    /**
+     * Format the message of the counter with its current values.
+     * @param sBuffer buffer receiving the message, reused between calls
+     * @return sBuffer
+     */
+    const CString& getNamedFormat(CString& sBuffer) {
+        return getNamedFormat(sBuffer, getValues());
+    }
+    
+    /**
+     * Format the message of the counter with values taken earlier, the other
+     * fields are the current ones.
+     * @param sBuffer buffer receiving the message, reused between calls
+     * @param snapshot the values of getValues()
+     * @return sBuffer
+     */
+    const CString& getNamedFormat(CString& sBuffer, const SCounterValues& snapshot) {
+        COUNTERS_LATENCY(PROBE_FORMAT);
+        std::time_t now = 0;
+        if (m_template.hasField(FIELD_RATE_1M) || m_template.hasField(FIELD_RATE_1H) || m_template.hasField(FIELD_TODAY)) {
+            now = time(nullptr);
+        }
+        const long long values[FIELD_COUNT] = {0, m_initial, m_step, m_cooldown, m_delay,
+                snapshot.previous, snapshot.current, snapshot.minimum, snapshot.maximum,
+                now ? m_history.getLastMinute(now) : 0, now ? m_history.getLastHour(now) : 0,
+                now ? m_history.getToday(now) : 0};
+        m_template.render(sBuffer, m_sName, values);
+        return sBuffer;
+    }
+    
+    
+    //SETTERS
+    void setName(const CString sName) {
+        m_sName = sName;
+    }
+    
+    void setInitial(const long long initial) {
+        m_initial = initial;
+    }
+    
+    void setStep(const long long step) {
+        m_step = step;
+    }
+    
+    void setCooldown(const int cooldown) {
+        m_cooldown = cooldown;
+    }
+    
+    void setDelay(const int delay) {
+        m_delay = delay;
+    }
+    
+    void setMessage(const CString& sMessage) {
+        m_sMessage = sMessage;
+        m_template.compile(sMessage);
+    }
+    
+    /**
+     * Set the coalesce policy from its name.
+     * @param sCoalesce "none", "debounce" or "throttle"
+     * @return false if sCoalesce is not a policy
+     */
+    bool setCoalesce(const CString& sCoalesce) {
+        if (sCoalesce.Equals("none"))
+            m_coalesce = COALESCE_NONE;
+        else if (sCoalesce.Equals("debounce"))
+            m_coalesce = COALESCE_DEBOUNCE;
+        else if (sCoalesce.Equals("throttle"))
+            m_coalesce = COALESCE_THROTTLE;
+        else
+            return false;
+        return true;
+    }
+    
+    /**
+     * @param sEdge "leading", "trailing" or "both"
+     * @return false if sEdge is not an edge
+     */
+    bool setEdge(const CString& sEdge) {
+        if (sEdge.Equals("leading"))
+            m_edge = EDGE_LEADING;
+        else if (sEdge.Equals("trailing"))
+            m_edge = EDGE_TRAILING;
+        else if (sEdge.Equals("both"))
+            m_edge = EDGE_BOTH;
+        else
+            return false;
+        return true;
+    }
+    
+    /**
+     * Set the arithmetic mode from its name.
+     * @param sArithmetic "saturate", "wrap" or "reject"
+     * @return false if sArithmetic is not a mode
+     */
+    bool setArithmetic(const CString& sArithmetic) {
+        if (sArithmetic.Equals("saturate"))
+            m_arithmetic = ARITHMETIC_SATURATE;
+        else if (sArithmetic.Equals("wrap"))
+            m_arithmetic = ARITHMETIC_WRAP;
+        else if (sArithmetic.Equals("reject"))
+            m_arithmetic = ARITHMETIC_REJECT;
+        else
+            return false;
+        return true;
+    }
+    
+    /**
+     * Set the limits of the value. A current value out of them is brought
+     * into them as a change, and the previous, minimum and maximum values
+     * are brought into them too, so they stay possible values.
+     * @return false if lower is greater than upper
+     */
+    bool setLimits(const long long lower, const long long upper) {
+        if (lower > upper) {
+            return false;
+        }
+        m_lowerLimit = lower;
+        m_upperLimit = upper;
+        long long value = std::min(std::max(m_hot->current, lower), upper);
+        if (value != m_hot->current) {
+            preChangeValue();
+            m_hot->current = value;
+        }
+        m_hot->previous = std::min(std::max(m_hot->previous, lower), upper);
+        m_hot->minimum = std::min(std::max(m_hot->minimum, lower), upper);
+        m_hot->maximum = std::min(std::max(m_hot->maximum, lower), upper);
+        return true;
+    }
+    
+    long long getLowerLimit() {
+        return m_lowerLimit;
+    }
+    
+    long long getUpperLimit() {
+        return m_upperLimit;
+    }
+    
+    void setScope(const EScope scope) {
+        m_scope = scope;
+    }
+    
+    const CCounterHistory& getHistory() {
+        return m_history;
+    }
+    
+    void setHistory(const bool bHistory) {
+        m_history.setEnabled(bHistory);
+    }
+    
+    /**
+     * Add a change made by an increment or a decrement to the history.
+     * @param delta the step of the change, negative for a decrement
+     */
+    void recordHistory(const long long delta) {
+        m_history.record(m_hot->lastChange, delta);
+    }
+    
+    /**
+     * Set the targets of messages.
+     * @param sTargets channels or nicknames separated by commas, empty or "*" for all channels
+     */
+    void setTargets(const CString& sTargets) {
+        m_vsTargets.clear();
+        if (sTargets != "*") {
+            sTargets.Split(",", m_vsTargets, false);
+        }
+    }
+    
+    void setPendingAnnouncement(const unsigned int pendingAnnouncement) {
+        m_pendingAnnouncement = pendingAnnouncement;
+    }
+    
+    void setLastChange(const std::time_t lastChange) {
+        m_hot->lastChange = lastChange;
+    }
+    
+    std::time_t getLastChange() {
+        return m_hot->lastChange;
+    }
+    
+    
+    //SHARED VALUE
+    static long long addWrap(long long a, long long b) {
+        return (long long) ((unsigned long long) a + (unsigned long long) b);
+    }
+    
+    static long long subWrap(long long a, long long b) {
+        return (long long) ((unsigned long long) a - (unsigned long long) b);
+    }
+    
+    /**
+     * Share the value of the counter : its current value is added to the
+     * shard of this network.
+     */
+    void setShared(const std::shared_ptr<CShardedValue>& pShared, unsigned int uShard) {
+        detachShared();
+        m_bShared = true;
+        m_pShared = pShared;
+        m_uShard = uShard;
+        m_published = 0;
+        publish();
+    }
+    
+    /**
+     * Remove the contribution of this network from the shared value, when
+     * the module is unloaded. The counter stays shared.
+     */
+    void detachShared() {
+        if (m_pShared) {
+            m_pShared->add(m_uShard, subWrap(0, m_published));
+            m_pShared.reset();
+        }
+    }
+    
+    /**
+     * Stop sharing the value, the contribution of this network is removed.
+     */
+    void unshare() {
+        detachShared();
+        m_bShared = false;
+    }
+    
+    /**
+     * @return true if the counter is shared, even if it's not attached to its shared value yet
+     */
+    bool isShared() {
+        return m_bShared;
+    }
+    
+    /**
+     * The limits, the minimum and the maximum only know the part of this
+     * network, so a shared counter can't have limits nor show the minimum
+     * and maximum values.
+     * @return an error message if the counter uses them, empty if it can be shared
+     */
+    CString checkShareable() {
+        if (m_lowerLimit != LLONG_MIN || m_upperLimit != LLONG_MAX) {
+            return "A shared counter can't have limits, remove them first with : set " + m_sName
+                    + " lower none, and : set " + m_sName + " upper none";
+        }
+        if (m_template.hasField(FIELD_MINIMUM_VALUE) || m_template.hasField(FIELD_MAXIMUM_VALUE)) {
+            return "The message of a shared counter can't show {MINIMUM_VALUE} nor {MAXIMUM_VALUE}.";
+        }
+        return "";
+    }
+    
+    /**
+     * Add the changes of the current value to the shared value. It's not done
+     * by the operations, so a batch can change a copy of the counter without
+     * touching the shared value.
+     */
+    void publish() {
+        if (m_pShared && m_hot->current != m_published) {
+            m_pShared->add(m_uShard, subWrap(m_hot->current, m_published));
+            m_published = m_hot->current;
+        }
+    }
+    
+    /**
+     * @return the part of the shared value from other networks, 0 if not shared
+     */
+    long long getSharedOthers() {
+        return m_pShared ? subWrap(m_pShared->read(), m_published) : 0;
+    }
+    
+    
+    //COOLDOWN
+    /**
+     * Cooldown of the messages, a state machine driven by the changes of the
+     * counter and by the end of the cooldown, with times in milliseconds of
+     * steady_clock :
+     * - idle (now >= end) : a change starts a cooldown and is announced with
+     *   EDGE_LEADING, otherwise it waits for the end of the cooldown ;
+     * - cooling (now < end) : a change is not announced, with EDGE_TRAILING
+     *   it waits for the end of the cooldown ;
+     * - end of the cooldown : a change waiting is announced, which starts a new
+     *   cooldown, otherwise the counter is idle.
+     * So 2 messages of the counter are always at least m_cooldown apart.
+     * @param bScheduleEnd set to true if onCooldownEnd() has to be called at getCooldownEnd()
+     * @return true if the change has to be announced now
+     */
+    bool onChangeCooldown(long long now, bool& bScheduleEnd) {
+        bScheduleEnd = false;
+        if (m_cooldown <= 0) {
+            return true;
+        }
+        if (now >= m_hot->cooldownEnd) {
+            m_hot->cooldownEnd = now + m_cooldown;
+            m_hot->bCooldownPending = bScheduleEnd = !(m_edge & EDGE_LEADING);
+            return !m_hot->bCooldownPending;
+        }
+        if ((m_edge & EDGE_TRAILING) && !m_hot->bCooldownPending) {
+            m_hot->bCooldownPending = bScheduleEnd = true;
+        }
+        return false;
+    }
+    
+    /**
+     * End of the cooldown scheduled after onChangeCooldown(). An end scheduled
+     * for an older cooldown does nothing.
+     * @return true if the change waiting has to be announced now
+     */
+    bool onCooldownEnd(long long now) {
+        if (!m_hot->bCooldownPending || now < m_hot->cooldownEnd) {
+            return false;
+        }
+        m_hot->bCooldownPending = false;
+        m_hot->cooldownEnd = now + m_cooldown;
+        return true;
+    }
+    
+    /**
+     * Forget the change waiting for the end of the cooldown, when the end
+     * scheduled for it will never run. The next change during the cooldown
+     * schedules a new end.
+     */
+    void dropCooldownPending() {
+        m_hot->bCooldownPending = false;
+    }
+    
+    
+    //PERSISTENCE
+    static const int STATE_SIZE = 17; /**< Number of values of getState(). */
+    static const int STATE_SHARED = 16; /**< Position of the shared flag in getState(). */
+    
+    /**
+     * Get the values of the counter, except its name and message : initial, step,
+     * cooldown, delay, coalesce, current, previous, minimum, maximum, last change,
+     * creation time, arithmetic mode, lower and upper limits, history enabled,
+     * edge, shared. Cooldown and delay are in milliseconds.
+     */
+    void getState(long long state[STATE_SIZE]) {
+        const long long values[STATE_SIZE] = {m_initial, m_step, m_cooldown, m_delay, m_coalesce,
+                m_hot->current, m_hot->previous, m_hot->minimum, m_hot->maximum,
+                m_hot->lastChange, m_creation_datetime, m_arithmetic, m_lowerLimit, m_upperLimit,
+                m_history.isEnabled(), m_edge, m_bShared};
+        std::copy(values, values + STATE_SIZE, state);
+    }
+    
+    /**
+     * Set the values of the counter returned by getState().
+     */
+    void setState(const long long state[STATE_SIZE]) {
+        m_initial = state[0];
+        m_step = state[1];
+        m_cooldown = (int) state[2];
+        m_delay = (int) state[3];
+        m_coalesce = (ECoalesce) state[4];
+        m_hot->current = state[5];
+        m_hot->previous = state[6];
+        m_hot->minimum = state[7];
+        m_hot->maximum = state[8];
+        m_hot->lastChange = (std::time_t) state[9];
+        m_creation_datetime = (std::time_t) state[10];
+        m_arithmetic = (EArithmetic) state[11];
+        m_lowerLimit = state[12];
+        m_upperLimit = state[13];
+        m_history.setEnabled(state[14] != 0);
+        m_edge = (EEdge) state[15];
+        m_bShared = state[STATE_SHARED] != 0;
+    }
+    
+    /**
+     * Write the whole state of the counter as a RECORD_COUNTER.
+     */
+    void writeState(CString& sBuffer) {
+        CRecordWriter writer(sBuffer, RECORD_COUNTER);
+        writer.writeString(m_sName).writeInt(m_initial).writeInt(m_step).writeInt(m_cooldown)
+                .writeInt(m_delay).writeString(m_sMessage).writeInt(m_coalesce)
+                .writeInt(m_hot->current).writeInt(m_hot->previous).writeInt(m_hot->minimum)
+                .writeInt(m_hot->maximum).writeInt(m_hot->lastChange).writeInt(m_creation_datetime)
+                .writeInt(m_arithmetic).writeInt(m_lowerLimit).writeInt(m_upperLimit)
+                .writeInt(m_history.isEnabled()).writeInt(m_edge).writeString(getTargetsString())
+                .writeInt(m_bShared);
+    }
+    
+    /**
+     * Read the fields of a RECORD_COUNTER written by writeState().
+     * @return false if the record is truncated or longer than the layout
+     */
+    bool readState(CRecordReader& reader) {
+        m_sName = reader.readString();
+        m_initial = reader.readInt();
+        m_step = reader.readInt();
+        m_cooldown = (int) reader.readInt();
+        m_delay = (int) reader.readInt();
+        setMessage(reader.readString());
+        m_coalesce = (ECoalesce) reader.readInt();
+        m_hot->current = reader.readInt();
+        m_hot->previous = reader.readInt();
+        m_hot->minimum = reader.readInt();
+        m_hot->maximum = reader.readInt();
+        m_hot->lastChange = (std::time_t) reader.readInt();
+        m_creation_datetime = (std::time_t) reader.readInt();
+        m_arithmetic = (EArithmetic) reader.readInt();
+        m_lowerLimit = reader.readInt();
+        m_upperLimit = reader.readInt();
+        m_history.setEnabled(reader.readInt() != 0);
+        m_edge = (EEdge) reader.readInt();
+        setTargets(reader.readString());
+        m_bShared = reader.readInt() != 0;
+        return reader.isValid() && reader.atEnd();
+    }
+    
+    /**
+     * Reset the counter at resetValue, brought into the limits.
+     * @param resetValue the value that counter will take.
+     * @return false if resetValue is out of the limits in reject mode
+     */
+    bool reset(const long long resetValue) {
+        if ((resetValue < m_lowerLimit || resetValue > m_upperLimit) && m_arithmetic == ARITHMETIC_REJECT) {
+            return false;
+        }
+        preChangeValue();
+        m_hot->current = std::min(std::max(resetValue, m_lowerLimit), m_upperLimit);
+        resetValues();
+        return true;
+    }
+    
+    /**
+     * Reset the counter at the initial value.
+     */
+    bool resetDefault() {
+        return reset(m_initial);
+    }
+    
+    /**
+     * @return false if the change is rejected by the arithmetic mode
+     */
+    bool increment(const long long step) {
+        long long value;
+        bool bOverflow = __builtin_add_overflow(m_hot->current, step, &value);
+        return postChangeValue(value, bOverflow, step, false);
+    }
+    
+    bool incrementDefault() {
+        return increment(m_step);
+    }
+    
+    /**
+     * @return false if the change is rejected by the arithmetic mode
+     */
+    bool decrement(const long long step) {
+        long long value;
+        bool bOverflow = __builtin_sub_overflow(m_hot->current, step, &value);
+        return postChangeValue(value, bOverflow, step, true);
+    }
+    
+    bool decrementDefault() {
+        return decrement(m_step);
+    }
+    
+};
+
+/**
+ * Handle of a counter in a CCounterTable. The generation of a slot changes
+ * when its counter is erased, so the handle of an erased counter finds
+ * nothing, even when its slot holds another counter.
+ */
+struct SCounterHandle {
+    unsigned int uSlot;
+    unsigned int uGeneration;
+};
+
+
+/**
+ * Kinds of entries of the timer wheel.
+ */
+enum EAnnouncement {
+    ANNOUNCEMENT_MESSAGE, /**< A message formatted from the values of the counter when it was scheduled. */
+    ANNOUNCEMENT_COALESCED, /**< A message formatted from the counter when it is sent. */
+    ANNOUNCEMENT_COOLDOWN /**< The end of the cooldown of the counter. */
+};
+
+
+/**
+ * A message of a counter waiting in the timer wheel to be sent. It holds no
+ * string : the counter is found by its handle and formats the message from
+ * its template when it is sent, so a burst of messages doesn't allocate.
+ */
+struct SPendingAnnouncement {
+    SCounterHandle counter; /**< Handle of the counter in the table of its scope. */
+    EScope scope;
+    EAnnouncement kind;
+    SCounterValues values; /**< Values of the counter when it was scheduled, for ANNOUNCEMENT_MESSAGE. */
+    unsigned long long uDue; /**< Tick at which the message has to be sent. */
+    unsigned int uSlot; /**< Slot of the wheel holding the entry. */
+    unsigned int uPrev;
+    unsigned int uNext;
+};
+
+
+/**
+ * Hierarchical timer wheel holding delayed announcements of counters.
+ * One tick is TICK_MS milliseconds, 3 levels of 64 slots cover 43 minutes,
+ * longer delays are parked in the last level and cascaded again.
+ * Schedule and cancel are O(1), no thread is used : the wheel is advanced by
+ * a single CTimer from the main loop of ZNC, armed for the next due tick.
+ */
+class CAnnouncementWheel {
+public:
+    static const unsigned int NONE = ~0u;
+    static const unsigned long long NEVER = ~0ull;
+    static const unsigned int TICK_MS = 10;
+    
+protected:
+    static const unsigned int SLOT_BITS = 6;
+    static const unsigned int SLOTS = 1u << SLOT_BITS;
+    static const unsigned int SLOT_MASK = SLOTS - 1;
+    static const unsigned int LEVELS = 3;
+    static const unsigned long long HORIZON = 1ull << (SLOT_BITS * LEVELS);
+    
+    std::vector<SPendingAnnouncement> m_entries;
+    unsigned int m_uFree; /**< Head of the free list in m_entries. */
+    unsigned int m_slots[LEVELS * SLOTS];
+    unsigned long long m_uNow;
+    size_t m_uSize;
+    
+    
+    unsigned int slotFor(unsigned long long uDue) const {
+        unsigned long long uDelta = uDue - m_uNow;
+        if (uDelta >= HORIZON) {
+            uDue = m_uNow + HORIZON - 1;
+            uDelta = HORIZON - 1;
+        }
+        unsigned int level = 0;
+        while (uDelta >= (1ull << (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        return level * SLOTS + ((uDue >> (SLOT_BITS * level)) & SLOT_MASK);
+    }
+    
+    void link(unsigned int index) {
+        SPendingAnnouncement& entry = m_entries[index];
+        entry.uSlot = slotFor(entry.uDue);
+        unsigned int& head = m_slots[entry.uSlot];
+        entry.uPrev = NONE;
+        entry.uNext = head;
+        if (head != NONE) {
+            m_entries[head].uPrev = index;
+        }
+        head = index;
+    }
+    
+    void unlink(unsigned int index) {
+        SPendingAnnouncement& entry = m_entries[index];
+        if (entry.uPrev != NONE) {
+            m_entries[entry.uPrev].uNext = entry.uNext;
+        }
+        else {
+            m_slots[entry.uSlot] = entry.uNext;
+        }
+        if (entry.uNext != NONE) {
+            m_entries[entry.uNext].uPrev = entry.uPrev;
+        }
+    }
+    
+    void release(unsigned int index) {
+        SPendingAnnouncement& entry = m_entries[index];
+        entry.uNext = m_uFree;
+        m_uFree = index;
+        m_uSize--;
+    }
+    
+    /**
+     * Move all entries of a slot of an upper level to lower levels.
+     */
+    void cascade(unsigned int level) {
+        unsigned int& head = m_slots[level * SLOTS + ((m_uNow >> (SLOT_BITS * level)) & SLOT_MASK)];
+        unsigned int index = head;
+        head = NONE;
+        while (index != NONE) {
+            unsigned int next = m_entries[index].uNext;
+            link(index);
+            index = next;
+        }
+    }
+    
+public:
+    
+    CAnnouncementWheel(unsigned long long uNow = 0) : m_uFree(NONE), m_uNow(uNow), m_uSize(0) {
+        for (unsigned int slot = 0; slot < LEVELS * SLOTS; slot++) {
+            m_slots[slot] = NONE;
+        }
+    }
+    
+    size_t size() const {
+        return m_uSize;
+    }
+    
+    unsigned long long getNow() const {
+        return m_uNow;
+    }
+    
+    /**
+     * Schedule a message to be sent in uDelay ticks.
+     * @param announcement the counter and the values of the message, its fields of the wheel are set here
+     * @return the handle of the entry, usable with cancel()
+     */
+    unsigned int schedule(const SPendingAnnouncement& announcement, unsigned long long uDelay) {
+        unsigned int index;
+        if (m_uFree != NONE) {
+            index = m_uFree;
+            m_uFree = m_entries[index].uNext;
+        }
+        else {
+            index = (unsigned int) m_entries.size();
+            m_entries.push_back(SPendingAnnouncement());
+        }
+        SPendingAnnouncement& entry = m_entries[index];
+        entry = announcement;
+        entry.uDue = m_uNow + (uDelay ? uDelay : 1);
+        link(index);
+        m_uSize++;
+        return index;
+    }
+    
+    void cancel(unsigned int index) {
+        unlink(index);
+        release(index);
+    }
+    
+    /**
+     * Call visit for each entry waiting in the wheel.
+     */
+    void forEach(const std::function<void(const SPendingAnnouncement&)>& visit) const {
+        for (unsigned int slot = 0; slot < LEVELS * SLOTS; slot++) {
+            for (unsigned int index = m_slots[slot]; index != NONE; index = m_entries[index].uNext) {
+                visit(m_entries[index]);
+            }
+        }
+    }
+    
+    /**
+     * The next tick at which the wheel has something to do : the tick of the
+     * first entry of the lowest level, or the first cascade of an upper level.
+     * @return NEVER if the wheel is empty
+     */
+    unsigned long long nextDue() const {
+        if (m_uSize == 0) {
+            return NEVER;
+        }
+        unsigned long long uNext = NEVER;
+        for (unsigned int level = 0; level < LEVELS; level++) {
+            unsigned long long uBlock = m_uNow >> (SLOT_BITS * level);
+            for (unsigned int i = 1; i <= SLOTS; i++) {
+                if (m_slots[level * SLOTS + ((uBlock + i) & SLOT_MASK)] != NONE) {
+                    uNext = std::min(uNext, (uBlock + i) << (SLOT_BITS * level));
+                    break;
+                }
+            }
+        }
+        return uNext;
+    }
+    
+    /**
+     * Advance the wheel up to uNow and call expire for each due entry.
+     * expire may schedule new entries.
+     */
+    void advance(unsigned long long uNow, std::function<void(const SPendingAnnouncement&)> expire) {
+        if (m_uSize == 0 && m_uNow < uNow) {
+            m_uNow = uNow;
+        }
+        while (m_uNow < uNow) {
+            m_uNow++;
+            for (unsigned int level = 1; level < LEVELS; level++) {
+                if (m_uNow & ((1ull << (SLOT_BITS * level)) - 1)) {
+                    break;
+                }
+                cascade(level);
+            }
+            unsigned int& head = m_slots[m_uNow & SLOT_MASK];
+            unsigned int index = head;
+            head = NONE;
+            while (index != NONE) {
+                unsigned int next = m_entries[index].uNext;
+                SPendingAnnouncement expired = m_entries[index];
+                release(index);
+                expire(expired);
+                index = next;
+            }
+        }
+    }
+    
+};
+
+
+class CAnnouncementTimer : public CTimer {
+public:
+    
+    CAnnouncementTimer(CModule* pModule) : CTimer(pModule, 1, 0, "announcements",
+    "Send delayed messages of counters and end their cooldowns") {
+        
+    }
+    
+    virtual ~CAnnouncementTimer() override {
+        
+    }
+    
+protected:
+    
+    virtual void RunJob() override;
+    
+};
+
+/**
+ * Open addressing hash index from strings to integers, with linear probing.
+ * Lookups take a pointer and a length so they never build a temporary string.
+ */
+class CStringIndex {
+public:
+    static const unsigned int NONE = ~0u;
+    
+protected:
+    struct SBucket {
+        CString sKey;
+        size_t uHash;
+        unsigned int uValue; /**< NONE if the bucket is empty. */
+    };
+    
+    std::vector<SBucket> m_buckets; /**< Size is 0 or a power of 2. */
+    size_t m_uSize;
+    
+    
+    void grow() {
+        std::vector<SBucket> old;
+        old.swap(m_buckets);
+        m_buckets.resize(old.empty() ? 16 : old.size() * 2, SBucket{"", 0, NONE});
+        for (SBucket& bucket : old) {
+            if (bucket.uValue != NONE) {
+                size_t mask = m_buckets.size() - 1;
+                size_t i = bucket.uHash & mask;
+                while (m_buckets[i].uValue != NONE) {
+                    i = (i + 1) & mask;
+                }
+                m_buckets[i].sKey.swap(bucket.sKey);
+                m_buckets[i].uHash = bucket.uHash;
+                m_buckets[i].uValue = bucket.uValue;
+            }
+        }
+    }
+    
+    /**
+     * @return the position of the key, or of the empty bucket where it would be
+     */
+    size_t probe(const char* key, size_t length, size_t uHash) const {
+        size_t mask = m_buckets.size() - 1;
+        size_t i = uHash & mask;
+        while (m_buckets[i].uValue != NONE) {
+            const SBucket& bucket = m_buckets[i];
+            if (bucket.uHash == uHash && bucket.sKey.size() == length
+                    && bucket.sKey.compare(0, length, key, length) == 0) {
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+    
+public:
+    
+    CStringIndex() : m_uSize(0) {
+        
+    }
+    
+    /**
+     * FNV-1a hash of a string.
+     */
+    static size_t hash(const char* key, size_t length) {
+        size_t uHash = 2166136261u;
+        for (size_t i = 0; i < length; i++) {
+            uHash = (uHash ^ (unsigned char) key[i]) * 16777619u;
+        }
+        return uHash;
+    }
+    
+    size_t size() const {
+        return m_uSize;
+    }
+    
+    unsigned int find(const char* key, size_t length) const {
+        return find(key, length, hash(key, length));
+    }
+    
+    /**
+     * Find a key whose hash is already known, so it's not computed twice.
+     */
+    unsigned int find(const char* key, size_t length, size_t uHash) const {
+        if (m_uSize == 0) {
+            return NONE;
+        }
+        return m_buckets[probe(key, length, uHash)].uValue;
+    }
+    
+    unsigned int find(const CString& sKey) const {
+        return find(sKey.data(), sKey.size());
+    }
+    
+    /**
+     * Add a key, or do nothing if it already exists.
+     * @return false if the key already exists
+     */
+    bool insert(const CString& sKey, unsigned int value) {
+        if ((m_uSize + 1) * 4 > m_buckets.size() * 3) {
+            grow();
+        }
+        size_t uHash = hash(sKey.data(), sKey.size());
+        SBucket& bucket = m_buckets[probe(sKey.data(), sKey.size(), uHash)];
+        if (bucket.uValue != NONE) {
+            return false;
+        }
+        bucket.sKey = sKey;
+        bucket.uHash = uHash;
+        bucket.uValue = value;
+        m_uSize++;
+        return true;
+    }
+    
+    /**
+     * Change the value of an existing key.
+     */
+    void update(const CString& sKey, unsigned int value) {
+        if (m_uSize) {
+            SBucket& bucket = m_buckets[probe(sKey.data(), sKey.size(), hash(sKey.data(), sKey.size()))];
+            if (bucket.uValue != NONE) {
+                bucket.uValue = value;
+            }
+        }
+    }
+    
+    /**
+     * Remove a key, following buckets are shifted back so no tombstone is needed.
+     * @return the value of the removed key, NONE if not found
+     */
+    unsigned int erase(const CString& sKey) {
+        if (m_uSize == 0) {
+            return NONE;
+        }
+        size_t mask = m_buckets.size() - 1;
+        size_t i = probe(sKey.data(), sKey.size(), hash(sKey.data(), sKey.size()));
+        unsigned int value = m_buckets[i].uValue;
+        if (value == NONE) {
+            return NONE;
+        }
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (m_buckets[j].uValue == NONE) {
+                break;
+            }
+            size_t home = m_buckets[j].uHash & mask;
+            //move j back to i only if its home is not in ]i, j]
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                std::swap(m_buckets[i], m_buckets[j]);
+                i = j;
+            }
+        }
+        m_buckets[i].sKey.clear();
+        m_buckets[i].uValue = NONE;
+        m_uSize--;
+        return value;
+    }
+    
+};
+
+
+/**
+ * Counters of a network in an array of slots, with a hash index of their names.
+ * Slots are in a deque, so counters never move and are walked in order
+ * without following the nodes of a tree. The slots of erased counters are
+ * reused by the next counters. The values changed by operations are in a
+ * contiguous array indexed by slot, the strings and settings stay in the
+ * slot. A copy of a counter of the table carries its own copy of the values.
+ */
+class CCounterTable {
+public:
+    static const unsigned int NONE = ~0u;
+    
+    struct SSlot {
+        CCounter counter;
+        unsigned int uGeneration;
+        bool bUsed;
+    };
+    
+protected:
+    std::deque<SSlot> m_slots;
+    std::vector<SCounterHotState> m_hotStates; /**< Values of the counter of each slot. */
+    std::vector<unsigned int> m_freeSlots;
+    CStringIndex m_index; /**< Name of counter to slot. */
+    
+    /**
+     * Point the counters to their entries, after the array was copied or moved.
+     */
+    void attachHotStates() {
+        for (size_t i = 0; i < m_slots.size(); i++) {
+            m_slots[i].counter.attachHotState(&m_hotStates[i]);
+        }
+    }
+    
+public:
+    
+    CCounterTable() {
+        
+    }
+    
+    CCounterTable(const CCounterTable& other) : m_slots(other.m_slots), m_hotStates(other.m_hotStates),
+            m_freeSlots(other.m_freeSlots), m_index(other.m_index) {
+        attachHotStates();
+    }
+    
+    CCounterTable& operator=(const CCounterTable& other) {
+        if (this != &other) {
+            m_slots = other.m_slots;
+            m_hotStates = other.m_hotStates;
+            m_freeSlots = other.m_freeSlots;
+            m_index = other.m_index;
+            attachHotStates();
+        }
+        return *this;
+    }
+    
+    size_t size() const {
+        return m_index.size();
+    }
+    
+    /**
+     * @return the slots to walk the counters, slots not used have to be skipped
+     */
+    std::deque<SSlot>& getSlots() {
+        return m_slots;
+    }
+    
+    CCounter* find(const CString& sName) {
+        unsigned int uSlot = m_index.find(sName);
+        return uSlot == NONE ? nullptr : &m_slots[uSlot].counter;
+    }
+    
+    /**
+     * @return the handle of a counter, with the slot NONE if it doesn't exist
+     */
+    SCounterHandle getHandle(const CString& sName) const {
+        unsigned int uSlot = m_index.find(sName);
+        return SCounterHandle{uSlot, uSlot == NONE ? 0 : m_slots[uSlot].uGeneration};
+    }
+    
+    /**
+     * @return the counter of a handle, nullptr if it was erased
+     */
+    CCounter* get(const SCounterHandle& handle) {
+        if (handle.uSlot >= m_slots.size()) {
+            return nullptr;
+        }
+        SSlot& slot = m_slots[handle.uSlot];
+        return slot.bUsed && slot.uGeneration == handle.uGeneration ? &slot.counter : nullptr;
+    }
+    
+    /**
+     * Add a counter named sName.
+     * @return the added counter, nullptr if a counter already has this name
+     */
+    CCounter* insert(const CString& sName, const CCounter& counter) {
+        if (m_index.find(sName) != NONE) {
+            return nullptr;
+        }
+        unsigned int uSlot;
+        if (!m_freeSlots.empty()) {
+            uSlot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+            m_slots[uSlot].counter = counter;
+            m_slots[uSlot].bUsed = true;
+        }
+        else {
+            uSlot = (unsigned int) m_slots.size();
+            m_slots.push_back(SSlot{counter, 0, true});
+            const SCounterHotState* pOldStates = m_hotStates.data();
+            m_hotStates.push_back(counter.getHotState());
+            if (m_hotStates.data() != pOldStates) {
+                attachHotStates();
+            }
+            else {
+                m_slots[uSlot].counter.attachHotState(&m_hotStates[uSlot]);
+            }
+        }
+        m_index.insert(sName, uSlot);
+        return &m_slots[uSlot].counter;
+    }
+    
+    /**
+     * Move a counter to a new name, it stays in its slot so its handles stay valid.
+     * @return false if the counter doesn't exist or the new name is used
+     */
+    bool rename(const CString& sName, const CString& sNewName) {
+        unsigned int uSlot = m_index.find(sName);
+        if (uSlot == NONE || m_index.find(sNewName) != NONE) {
+            return false;
+        }
+        m_index.erase(sName);
+        m_index.insert(sNewName, uSlot);
+        m_slots[uSlot].counter.setName(sNewName);
+        return true;
+    }
+    
+    /**
+     * Remove a counter, its strings are freed and its slot gets a new generation.
+     * @return false if the counter doesn't exist
+     */
+    bool erase(const CString& sName) {
+        unsigned int uSlot = m_index.erase(sName);
+        if (uSlot == NONE) {
+            return false;
+        }
+        SSlot& slot = m_slots[uSlot];
+        slot.counter = CCounter("");
+        slot.bUsed = false;
+        slot.uGeneration++;
+        m_freeSlots.push_back(uSlot);
+        return true;
+    }
+    
+};
+
+
+/**
+ * A word of a command, pointing into the line of the command.
+ */
+struct SToken {
+    const char* data;
+    size_t length;
+    
+    CString toString() const {
+        return CString(data, length);
+    }
+    
+    /**
+     * Case insensitive comparison with a word.
+     */
+    bool equals(const char* word) const {
+        return strlen(word) == length && strncasecmp(word, data, length) == 0;
+    }
+    
+};
+
+
+/**
+ * Single pass parser of the module's commands. It splits the line into
+ * words without copying it, a word in double quotes can contain spaces, and
+ * converts the numbers in place with precise errors.
+ */
+class CCommandParser {
+protected:
+    const char* m_position;
+    CString m_sError;
+    
+public:
+    
+    /**
+     * @param sLine the line of the command, must outlive the parser
+     */
+    CCommandParser(const CString& sLine) : m_position(sLine.c_str()) {
+        
+    }
+    
+    CCommandParser(const char* line) : m_position(line) {
+        
+    }
+    
+    /**
+     * Read the next word of the line.
+     * @return false at the end of the line or if a quote is not closed
+     */
+    bool next(SToken& token) {
+        while (*m_position == ' ') {
+            m_position++;
+        }
+        if (*m_position == '\0') {
+            return false;
+        }
+        if (*m_position == '"') {
+            const char* end = strchr(m_position + 1, '"');
+            if (!end) {
+                m_sError = "Missing closing quote after '" + CString(m_position) + "'.";
+                return false;
+            }
+            token = SToken{m_position + 1, (size_t) (end - m_position - 1)};
+            m_position = end + 1;
+            return true;
+        }
+        const char* end = m_position;
+        while (*end && *end != ' ') {
+            end++;
+        }
+        token = SToken{m_position, (size_t) (end - m_position)};
+        m_position = end;
+        return true;
+    }
+    
+    /**
+     * Skip the first word, the name of the command.
+     */
+    CCommandParser& skip() {
+        SToken token;
+        next(token);
+        return *this;
+    }
+    
+    /**
+     * Check that the line has no more words.
+     * @return false, with an error, if it has
+     */
+    bool atEnd() {
+        SToken token;
+        if (next(token)) {
+            m_sError = "Too many arguments, unexpected '" + token.toString() + "'.";
+            return false;
+        }
+        return !hasError();
+    }
+    
+    bool hasError() const {
+        return !m_sError.empty();
+    }
+    
+    /**
+     * Set the error of the command.
+     * @return false
+     */
+    bool fail(const CString& sError) {
+        m_sError = sError;
+        return false;
+    }
+    
+    /**
+     * Read the next word, which is required.
+     * @param sWhat what the word is, used in the error
+     * @return false, with an error, if there is no more word
+     */
+    bool expect(SToken& token, const CString& sWhat) {
+        return next(token) || (!hasError() && fail("Missing " + sWhat + "."));
+    }
+    
+    /**
+     * @return the description of the last error, empty if none
+     */
+    const CString& getError() const {
+        return m_sError;
+    }
+    
+    /**
+     * Convert a whole word to an integer, with an optional sign.
+     * @param sWhat what the word is, used in the error
+     * @return false, with an error, if the word is not an integer or is out of
+     * [minimum, maximum]
+     */
+    bool parseInt(const SToken& token, long long& value, const CString& sWhat,
+            long long minimum = LLONG_MIN, long long maximum = LLONG_MAX) {
+        const char* current = token.data;
+        const char* end = token.data + token.length;
+        bool bNegative = current != end && *current == '-';
+        if (current != end && (*current == '-' || *current == '+')) {
+            current++;
+        }
+        if (current == end) {
+            return fail("Invalid " + sWhat + " : '" + token.toString() + "' is not an integer.");
+        }
+        //accumulate negatively, the minimum has no positive counterpart
+        long long result = 0;
+        bool bOverflow = false;
+        for (; current != end; current++) {
+            unsigned int digit = (unsigned char) *current - '0';
+            if (digit > 9) {
+                return fail("Invalid " + sWhat + " : '" + token.toString() + "' is not an integer.");
+            }
+            bOverflow |= __builtin_mul_overflow(result, 10, &result);
+            bOverflow |= __builtin_sub_overflow(result, (long long) digit, &result);
+        }
+        if (!bNegative && !bOverflow) {
+            bOverflow = __builtin_sub_overflow(0, result, &result);
+        }
+        if (bOverflow || result < minimum || result > maximum) {
+            return fail("Invalid " + sWhat + " : '" + token.toString() + "' is out of range.");
+        }
+        value = result;
+        return true;
+    }
+    
+    bool parseInt(const SToken& token, int& value, const CString& sWhat) {
+        long long result;
+        if (!parseInt(token, result, sWhat, INT_MIN, INT_MAX)) {
+            return false;
+        }
+        value = (int) result;
+        return true;
+    }
+    
+    /**
+     * Convert a whole word to a duration : a number of seconds, or of
+     * milliseconds with the suffix "ms" ("s" is accepted for seconds).
+     * @return false, with an error, if the word is not a duration or is out of
+     * [0, INT_MAX] milliseconds
+     */
+    bool parseDuration(const SToken& token, int& milliseconds, const CString& sWhat) {
+        SToken number = token;
+        long long scale = 1000;
+        if (number.length > 2 && strncasecmp(number.data + number.length - 2, "ms", 2) == 0) {
+            number.length -= 2;
+            scale = 1;
+        }
+        else if (number.length > 1 && (number.data[number.length - 1] | 0x20) == 's') {
+            number.length--;
+        }
+        long long value;
+        if (!parseInt(number, value, sWhat, 0, INT_MAX / scale)) {
+            return false;
+        }
+        milliseconds = (int) (value * scale);
+        return true;
+    }
+    
+    /**
+     * Convert a whole word to a decimal number.
+     * @return false, with an error, if the word is not a number
+     */
+    bool parseDouble(const SToken& token, double& value, const CString& sWhat) {
+        CString sNumber = token.toString();
+        char* end;
+        errno = 0;
+        value = strtod(sNumber.c_str(), &end);
+        if (sNumber.empty() || *end != '\0' || errno == ERANGE || !std::isfinite(value)) {
+            m_sError = "Invalid " + sWhat + " : '" + sNumber + "' is not a number.";
+            return false;
+        }
+        return true;
+    }
+    
+};
+
+
+/**
+ * Operations on a counter that a listener can execute directly.
+ */
+enum ECounterOperation {
+    OPERATION_NONE,
+    OPERATION_RESET,
+    OPERATION_INCREMENT,
+    OPERATION_DECREMENT,
+    OPERATION_PRINT
+};
+
+
+/**
+ * Commands of the counter that a listener can use, as bits.
+ */
+enum EPermission {
+    PERMISSION_INCR = 1 << 0,
+    PERMISSION_DECR = 1 << 1,
+    PERMISSION_RESET = 1 << 2,
+    PERMISSION_PRINT = 1 << 3,
+    PERMISSION_INFO = 1 << 4,
+    PERMISSION_HISTORY = 1 << 5,
+    PERMISSION_SET = 1 << 6,
+    PERMISSION_DELETE = 1 << 7,
+    PERMISSION_DEFAULT = PERMISSION_INCR | PERMISSION_DECR | PERMISSION_RESET | PERMISSION_PRINT,
+    PERMISSION_ALL = (1 << 8) - 1
+};
+
+
+/**
+ * A test of a compiled listener on a line.
+ */
+enum EPredicate {
+    PREDICATE_NICKNAME, /**< The nickname is sArgument, compared with the case of IRC. */
+    PREDICATE_NICKNAME_MASK, /**< The nickname matches the wildcards of sArgument. */
+    PREDICATE_IDENT_MASK, /**< The ident matches the wildcards of sArgument. */
+    PREDICATE_HOST_MASK, /**< The host matches the wildcards of sArgument. */
+    PREDICATE_MODE /**< The nickname has one of the prefixes of sArgument on the channel. */
+};
+
+
+struct SPredicate {
+    EPredicate predicate;
+    CString sArgument; /**< Lowercase for the case insensitive predicates. */
+};
+
+
+/**
+ * A counter used by a listener.
+ */
+struct SListenerCounter {
+    CString sName;
+    SCounterHandle handle; /**< The counter named sName in the counters of the network, if it is one of them. */
+};
+
+
+/**
+ * A listener : the users matching sNickname can use its counters with a trigger word.
+ */
+class CCounterListener {
+public:
+    CString sNickname; /**< A nickname, or a mask of nickname or of nick!ident@host with wildcards * and ?. */
+    std::vector<SListenerCounter> counters; /**< The counters changed together by the listener. */
+    unsigned int uPermissions; /**< EPermission bits of the commands allowed. */
+    long long maxStep; /**< Maximum magnitude of the value of incr and decr, and of the change of reset, LLONG_MAX if none. */
+    CString sChannel; /**< The only channel where it can be used, empty for all channels. */
+    CString sModes; /**< Mode letters (q, a, o, h, v) the user needs one of, empty for everyone. */
+    std::vector<SPredicate> program; /**< Tests of a line, filled by compile(). */
+    
+    static bool isMask(const CString& sNickname) {
+        return sNickname.find_first_of("*?!@") != CString::npos;
+    }
+    
+    /**
+     * Fold the case of a character of a nickname with the rules of IRC
+     * (rfc1459), where [, ], \ and ~ are the uppercase of {, }, | and ^ :
+     * A-Z, [, \ and ] become a-z, {, | and }, and ^ becomes ~. Nicknames and
+     * masks are both compared with it.
+     */
+    static char foldCase(char c) {
+        if (c >= 'A' && c <= '^') {
+            return (char) (c + ('a' - 'A'));
+        }
+        return c;
+    }
+    
+    static CString foldNick(const CString& sNickname) {
+        CString sFolded(sNickname);
+        for (char& c : sFolded) {
+            c = foldCase(c);
+        }
+        return sFolded;
+    }
+    
+    /**
+     * @return true if the nickname is sFolded, which is already folded
+     */
+    static bool equalsFolded(const CString& sNickname, const CString& sFolded) {
+        if (sNickname.size() != sFolded.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < sNickname.size(); i++) {
+            if (foldCase(sNickname[i]) != sFolded[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    /**
+     * @return true if the listener only depends on the nickname, so it is found by a hash lookup
+     */
+    bool isExact() const {
+        return !isMask(sNickname) && sModes.empty();
+    }
+    
+    /**
+     * A reset with a value may change the counter by more than the maximum
+     * step, so its value must be within the maximum step of the initial value.
+     * @return false if the value of the operation is over the maximum step
+     */
+    bool allowsValue(ECounterOperation operation, long long value, long long initial) const {
+        if (operation != OPERATION_RESET) {
+            return value <= maxStep && value >= -maxStep;
+        }
+        unsigned long long change = value >= initial ? (unsigned long long) value - (unsigned long long) initial
+                : (unsigned long long) initial - (unsigned long long) value;
+        return change <= (unsigned long long) maxStep;
+    }
+    
+    /**
+     * @return the names of the counters separated by commas, as saved
+     */
+    CString getCounterNames() const {
+        CString sNames;
+        for (const SListenerCounter& counter : counters) {
+            sNames += (sNames.empty() ? "" : ",") + counter.sName;
+        }
+        return sNames;
+    }
+    
+    /**
+     * Translate mode letters to the prefixes of nicknames on a channel.
+     * @return false if a letter is unknown
+     */
+    static bool parseModes(const CString& sModes, CString& sPrefixes) {
+        static const char* const letters = "qaohv";
+        static const char* const prefixes = "~&@%+";
+        sPrefixes.clear();
+        for (char c : sModes) {
+            const char* letter = strchr(letters, c);
+            if (!c || !letter) {
+                return false;
+            }
+            sPrefixes += prefixes[letter - letters];
+        }
+        return true;
+    }
+    
+    /**
+     * Compile the conditions of the listener to the tests of program, cheapest first.
+     * A mask nick!ident@host is split in its 3 parts, so the mask of the user
+     * is never built, and the parts which are only * are not tested. The
+     * channel is not tested, listeners are indexed by channel.
+     */
+    void compile() {
+        program.clear();
+        if (!isMask(sNickname)) {
+            program.push_back(SPredicate{PREDICATE_NICKNAME, foldNick(sNickname)});
+        }
+        else {
+            CString sMask = foldNick(sNickname);
+            size_t uExclamation = sMask.find('!');
+            size_t uAt = sMask.find('@', uExclamation == CString::npos ? 0 : uExclamation);
+            //*@host is *!*@host and nick!ident is nick!ident@*
+            CString sNick = uExclamation != CString::npos ? sMask.substr(0, uExclamation)
+                    : uAt != CString::npos ? CString("*") : sMask;
+            size_t uIdent = uExclamation != CString::npos ? uExclamation + 1 : 0;
+            CString sIdent = uExclamation == CString::npos && uAt == CString::npos ? CString("*")
+                    : sMask.substr(uIdent, uAt == CString::npos ? CString::npos : uAt - uIdent);
+            CString sHost = uAt != CString::npos ? sMask.substr(uAt + 1) : CString("*");
+            if (sNick != "*") {
+                program.push_back(SPredicate{PREDICATE_NICKNAME_MASK, sNick});
+            }
+            if (sIdent != "*") {
+                program.push_back(SPredicate{PREDICATE_IDENT_MASK, sIdent});
+            }
+            if (sHost != "*") {
+                program.push_back(SPredicate{PREDICATE_HOST_MASK, sHost});
+            }
+        }
+        CString sPrefixes;
+        if (!sModes.empty() && parseModes(sModes, sPrefixes)) {
+            program.push_back(SPredicate{PREDICATE_MODE, sPrefixes});
+        }
+    }
+    
+    /**
+     * Match a text with a mask folded by foldNick(), * matches any characters and ? one character.
+     */
+    static bool matchMask(const char* mask, const char* text) {
+        const char* star = nullptr;
+        const char* retry = nullptr;
+        while (*text) {
+            if (*mask == '*') {
+                star = ++mask;
+                retry = text;
+            }
+            else if (*mask && (*mask == '?' || *mask == foldCase(*text))) {
+                mask++;
+                text++;
+            }
+            else if (star) {
+                //the last star takes one more character
+                mask = star;
+                text = ++retry;
+            }
+            else {
+                return false;
+            }
+        }
+        while (*mask == '*') {
+            mask++;
+        }
+        return !*mask;
+    }
+    
+    /**
+     * Run the program of the listener on a line.
+     */
+    bool matches(const CNick& Nick) const {
+        for (const SPredicate& test : program) {
+            switch (test.predicate) {
+                case PREDICATE_NICKNAME:
+                    if (!equalsFolded(Nick.GetNick(), test.sArgument)) {
+                        return false;
+                    }
+                    break;
+                case PREDICATE_NICKNAME_MASK:
+                    if (!matchMask(test.sArgument.c_str(), Nick.GetNick().c_str())) {
+                        return false;
+                    }
+                    break;
+                case PREDICATE_IDENT_MASK:
+                    if (!matchMask(test.sArgument.c_str(), Nick.GetIdent().c_str())) {
+                        return false;
+                    }
+                    break;
+                case PREDICATE_HOST_MASK:
+                    if (!matchMask(test.sArgument.c_str(), Nick.GetHost().c_str())) {
+                        return false;
+                    }
+                    break;
+                case PREDICATE_MODE: {
+                    bool bHasMode = false;
+                    for (char cPrefix : test.sArgument) {
+                        bHasMode = bHasMode || Nick.HasPerm(cPrefix);
+                    }
+                    if (!bHasMode) {
+                        return false;
+                    }
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+    
+    /**
+     * Find the permission of a command, case insensitive.
+     * @return 0 if the word is not a command usable by listeners
+     */
+    static unsigned int parsePermission(const char* word, size_t length) {
+        static const char* const names[] = {"incr", "decr", "reset", "print", "info", "history", "set", "delete"};
+        for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if (strlen(names[i]) == length && strncasecmp(names[i], word, length) == 0) {
+                return 1u << i;
+            }
+        }
+        return 0;
+    }
+    
+    /**
+     * @param sPermissions commands separated by commas, "all" or "none"
+     * @return false if a command is unknown
+     */
+    static bool parsePermissions(const CString& sPermissions, unsigned int& uPermissions) {
+        if (sPermissions.Equals("all")) {
+            uPermissions = PERMISSION_ALL;
+            return true;
+        }
+        uPermissions = 0;
+        if (sPermissions.Equals("none")) {
+            return true;
+        }
+        VCString vsCommands;
+        sPermissions.Split(",", vsCommands, false);
+        for (const CString& sCommand : vsCommands) {
+            unsigned int permission = parsePermission(sCommand.data(), sCommand.size());
+            if (!permission) {
+                return false;
+            }
+            uPermissions |= permission;
+        }
+        return true;
+    }
+    
+    static CString getPermissionsString(unsigned int uPermissions) {
+        static const char* const names[] = {"incr", "decr", "reset", "print", "info", "history", "set", "delete"};
+        if (uPermissions == PERMISSION_ALL) {
+            return "all";
+        }
+        CString sPermissions;
+        for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if (uPermissions & (1u << i)) {
+                sPermissions += (sPermissions.empty() ? "" : ",") + CString(names[i]);
+            }
+        }
+        return sPermissions.empty() ? CString("none") : sPermissions;
+    }
+    
+    /**
+     * Find the operation named by a word of a line, case insensitive.
+     * @return OPERATION_NONE if the word is not a direct operation
+     */
+    static ECounterOperation parseOperation(const char* word, size_t length) {
+        static const struct {
+            const char* name;
+            ECounterOperation operation;
+        } operations[] = {{"incr", OPERATION_INCREMENT}, {"decr", OPERATION_DECREMENT},
+                {"reset", OPERATION_RESET}, {"print", OPERATION_PRINT}};
+        for (const auto& operation : operations) {
+            if (strlen(operation.name) == length && strncasecmp(operation.name, word, length) == 0) {
+                return operation.operation;
+            }
+        }
+        return OPERATION_NONE;
+    }
+    
+};
+
+
+/**
+ * Listeners indexed by channel and trigger word, then by nickname.
+ * A line is first checked against the set of first bytes of all triggers so
+ * most of the lines of a channel are rejected without hashing. The listeners
+ * of the channel of a line are looked up first, then the listeners of all
+ * channels, with one hash lookup each. In a group, the listeners with only
+ * a nickname are found by hash, the others (masks or modes) run their
+ * compiled program in order of creation.
+ */
+class CListenerIndex {
+public:
+    struct STrigger {
+        CString sTrigger;
+        CString sChannel; /**< Channel of the listeners, empty for all channels. */
+        std::vector<CCounterListener> listeners;
+        CStringIndex nicknames; /**< Nickname to position in listeners, for the exact listeners. */
+        std::vector<unsigned int> rules; /**< Positions in listeners of the other listeners. */
+    };
+    
+protected:
+    std::vector<STrigger> m_triggers;
+    CStringIndex m_index; /**< Key of channel and trigger word to position in m_triggers. */
+    unsigned long long m_firstBytes[4]; /**< Bitmap of the first bytes of triggers. */
+    unsigned long long m_channelWords[4]; /**< Bitmap of the hashes of the trigger words of channels. */
+    size_t m_uSize;
+    mutable CString m_sKey; /**< Buffer of the key of a line, so its lookup doesn't allocate. */
+    
+
+    void addFirstByte(const CString& sTrigger) {
+        unsigned char c = sTrigger.empty() ? 0 : (unsigned char) sTrigger[0];
+        m_firstBytes[c >> 6] |= 1ull << (c & 63);
+    }
+    
+    void addChannelWord(const CString& sTrigger) {
+        unsigned char c = (unsigned char) CStringIndex::hash(sTrigger.data(), sTrigger.size());
+        m_channelWords[c >> 6] |= 1ull << (c & 63);
+    }
+    
+    /**
+     * @return false if no listener of a channel uses a word of this hash, so
+     * the key of the channel doesn't need to be built
+     */
+    bool mayMatchChannel(size_t uHash) const {
+        unsigned char c = (unsigned char) uHash;
+        return (m_channelWords[c >> 6] >> (c & 63)) & 1;
+    }
+    
+    /**
+     * Write the key of a trigger word on a channel : the word alone for all
+     * channels, otherwise the lowercase channel, a space and the word. Both
+     * have no space, so keys can't collide.
+     */
+    static void buildKey(CString& sKey, const CString& sChannel, const char* trigger, size_t length) {
+        size_t uPrefix = sChannel.empty() ? 0 : sChannel.size() + 1;
+        sKey.resize(uPrefix + length);
+        for (size_t i = 0; i < sChannel.size(); i++) {
+            sKey[i] = (char) tolower((unsigned char) sChannel[i]);
+        }
+        if (uPrefix) {
+            sKey[uPrefix - 1] = ' ';
+        }
+        memcpy(&sKey[uPrefix], trigger, length);
+    }
+    
+    static CString getKey(const CString& sChannel, const CString& sTrigger) {
+        CString sKey;
+        buildKey(sKey, sChannel, sTrigger.data(), sTrigger.size());
+        return sKey;
+    }
+    
+    static void indexListener(STrigger& trigger, unsigned int position) {
+        if (trigger.listeners[position].isExact()) {
+            trigger.nicknames.insert(CCounterListener::foldNick(trigger.listeners[position].sNickname), position);
+        }
+        else {
+            trigger.rules.push_back(position);
+        }
+    }
+    
+    /**
+     * Rebuild the indexes of a trigger after its listeners moved or changed.
+     */
+    static void reindex(STrigger& trigger) {
+        trigger.nicknames = CStringIndex();
+        trigger.rules.clear();
+        for (unsigned int position = 0; position < trigger.listeners.size(); position++) {
+            indexListener(trigger, position);
+        }
+    }
+    
+public:
+    
+    CListenerIndex() : m_uSize(0) {
+        m_firstBytes[0] = m_firstBytes[1] = m_firstBytes[2] = m_firstBytes[3] = 0;
+        m_channelWords[0] = m_channelWords[1] = m_channelWords[2] = m_channelWords[3] = 0;
+    }
+    
+    size_t size() const {
+        return m_uSize;
+    }
+    
+    const std::vector<STrigger>& getTriggers() const {
+        return m_triggers;
+    }
+    
+    bool mayMatch(unsigned char firstByte) const {
+        return (m_firstBytes[firstByte >> 6] >> (firstByte & 63)) & 1;
+    }
+    
+    /**
+     * Find the listeners of a trigger word on a channel.
+     * @param sChannel the channel, empty for the listeners of all channels
+     * @return nullptr if no listener use this word
+     */
+    const STrigger* findTrigger(const CString& sChannel, const char* trigger, size_t length) const {
+        unsigned int position;
+        if (sChannel.empty()) {
+            position = m_index.find(trigger, length);
+        }
+        else {
+            buildKey(m_sKey, sChannel, trigger, length);
+            position = m_index.find(m_sKey);
+        }
+        return position == CStringIndex::NONE ? nullptr : &m_triggers[position];
+    }
+    
+    /**
+     * Find the listener of a user in a group, an exact listener of its nickname first.
+     * @return nullptr if no listener matches
+     */
+    static const CCounterListener* match(const STrigger& trigger, const CNick& Nick) {
+        //nicknames are short, they are folded without allocation
+        const CString& sNick = Nick.GetNick();
+        char folded[64];
+        unsigned int position;
+        if (sNick.size() <= sizeof(folded)) {
+            for (size_t i = 0; i < sNick.size(); i++) {
+                folded[i] = CCounterListener::foldCase(sNick[i]);
+            }
+            position = trigger.nicknames.find(folded, sNick.size());
+        }
+        else {
+            position = trigger.nicknames.find(CCounterListener::foldNick(sNick));
+        }
+        if (position != CStringIndex::NONE) {
+            return &trigger.listeners[position];
+        }
+        for (unsigned int rule : trigger.rules) {
+            if (trigger.listeners[rule].matches(Nick)) {
+                return &trigger.listeners[rule];
+            }
+        }
+        return nullptr;
+    }
+    
+    /**
+     * Find the listener of a trigger word for a user on a channel, the
+     * listeners of the channel first. The word is hashed once, and the key of
+     * the channel is only built if a channel may have listeners of this word.
+     * @return nullptr if no listener matches
+     */
+    const CCounterListener* match(const CChan& Channel, const CNick& Nick, const char* trigger, size_t length) const {
+        size_t uHash = CStringIndex::hash(trigger, length);
+        const STrigger* channelTrigger = mayMatchChannel(uHash) ? findTrigger(Channel.GetName(), trigger, length) : nullptr;
+        const CCounterListener* listener = channelTrigger ? match(*channelTrigger, Nick) : nullptr;
+        if (!listener) {
+            unsigned int position = m_index.find(trigger, length, uHash);
+            listener = position != CStringIndex::NONE ? match(m_triggers[position], Nick) : nullptr;
+        }
+        return listener;
+    }
+    
+    /**
+     * Find a listener by its nickname or its mask, in any case.
+     */
+    static const CCounterListener* findListener(const STrigger& trigger, const CString& sNickname) {
+        CString sFolded = CCounterListener::foldNick(sNickname);
+        unsigned int position = trigger.nicknames.find(sFolded);
+        if (position != CStringIndex::NONE) {
+            return &trigger.listeners[position];
+        }
+        for (unsigned int rule : trigger.rules) {
+            if (CCounterListener::equalsFolded(trigger.listeners[rule].sNickname, sFolded)) {
+                return &trigger.listeners[rule];
+            }
+        }
+        return nullptr;
+    }
+    
+    const CCounterListener* findListener(const CString& sTrigger, const CString& sChannel,
+            const CString& sNickname) const {
+        const STrigger* trigger = findTrigger(sChannel, sTrigger.data(), sTrigger.size());
+        return trigger ? findListener(*trigger, sNickname) : nullptr;
+    }
+    
+    /**
+     * Add a listener to the group of its channel, its program is compiled here.
+     * @param bReplace if true, an existing listener with the same nickname is replaced
+     * @return false if the listener already exists and is not replaced
+     */
+    bool insert(const CString& sTrigger, const CCounterListener& listener, bool bReplace = false) {
+        CString sKey = getKey(listener.sChannel, sTrigger);
+        unsigned int position = m_index.find(sKey);
+        if (position == CStringIndex::NONE) {
+            position = (unsigned int) m_triggers.size();
+            m_triggers.push_back(STrigger{sTrigger, listener.sChannel, {}, CStringIndex(), {}});
+            m_index.insert(sKey, position);
+            addFirstByte(sTrigger);
+            if (!listener.sChannel.empty()) {
+                addChannelWord(sTrigger);
+            }
+        }
+        STrigger& trigger = m_triggers[position];
+        const CCounterListener* existing = findListener(trigger, listener.sNickname);
+        if (existing && !bReplace) {
+            return false;
+        }
+        if (existing) {
+            CCounterListener& replaced = trigger.listeners[existing - trigger.listeners.data()];
+            replaced = listener;
+            replaced.compile();
+            reindex(trigger);
+            return true;
+        }
+        trigger.listeners.push_back(listener);
+        trigger.listeners.back().compile();
+        indexListener(trigger, (unsigned int) trigger.listeners.size() - 1);
+        m_uSize++;
+        return true;
+    }
+    
+    /**
+     * @return false if the listener doesn't exist
+     */
+    bool erase(const CString& sTrigger, const CString& sChannel, const CString& sNickname) {
+        unsigned int position = m_index.find(getKey(sChannel, sTrigger));
+        if (position == CStringIndex::NONE) {
+            return false;
+        }
+        std::vector<CCounterListener>& listeners = m_triggers[position].listeners;
+        CString sFolded = CCounterListener::foldNick(sNickname);
+        for (auto it = listeners.begin(); it != listeners.end(); ++it) {
+            if (CCounterListener::equalsFolded(it->sNickname, sFolded)) {
+                listeners.erase(it);
+                m_uSize--;
+                if (listeners.empty()) {
+                    removeTrigger(position);
+                }
+                else {
+                    reindex(m_triggers[position]);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    /**
+     * Set the handle used by all listeners of the counter sCounterName, called
+     * when this counter is added to the counters of the network. A deleted
+     * counter needs no call, its handle finds nothing.
+     */
+    void bindCounter(const CString& sCounterName, const SCounterHandle& handle) {
+        for (STrigger& trigger : m_triggers) {
+            for (CCounterListener& listener : trigger.listeners) {
+                for (SListenerCounter& counter : listener.counters) {
+                    if (counter.sName == sCounterName) {
+                        counter.handle = handle;
+                    }
+                }
+            }
+        }
+    }
+    
+    /**
+     * Give the new name of a counter to the listeners using it, their handles don't change.
+     */
+    void renameCounter(const CString& sCounterName, const CString& sNewName) {
+        for (STrigger& trigger : m_triggers) {
+            for (CCounterListener& listener : trigger.listeners) {
+                for (SListenerCounter& counter : listener.counters) {
+                    if (counter.sName == sCounterName) {
+                        counter.sName = sNewName;
+                    }
+                }
+            }
+        }
+    }
+    
+    /**
+     * Remove a group of listeners with all its listeners, the last group takes its place.
+     */
+    void removeTrigger(unsigned int position) {
+        m_uSize -= m_triggers[position].listeners.size();
+        m_index.erase(getKey(m_triggers[position].sChannel, m_triggers[position].sTrigger));
+        if (position + 1 != m_triggers.size()) {
+            std::swap(m_triggers[position], m_triggers.back());
+            m_index.update(getKey(m_triggers[position].sChannel, m_triggers[position].sTrigger), position);
+        }
+        m_triggers.pop_back();
+        m_firstBytes[0] = m_firstBytes[1] = m_firstBytes[2] = m_firstBytes[3] = 0;
+        m_channelWords[0] = m_channelWords[1] = m_channelWords[2] = m_channelWords[3] = 0;
+        for (const STrigger& trigger : m_triggers) {
+            addFirstByte(trigger.sTrigger);
+            if (!trigger.sChannel.empty()) {
+                addChannelWord(trigger.sTrigger);
+            }
+        }
+    }
+    
+};
+
+/**
+ * Priority of a line in the outbound queue.
+ */
+enum EPriority {
+    PRIORITY_PRINT, /**< Asked with the "print" command. */
+    PRIORITY_AUTOMATIC, /**< Sent after a change of value. */
+    PRIORITY_COUNT
+};
+
+
+/**
+ * A PRIVMSG line waiting in the outbound queue.
+ */
+struct SOutboundLine {
+    VCString vsTargets;
+    CString sMessage;
+    CString sCounterName; /**< Counter which produced the message, empty if unknown. */
+    double queued; /**< Time when the line was queued, in seconds. */
+};
+
+
+/**
+ * Queue of PRIVMSG lines limited by token buckets : one for the network and
+ * one per target. A line is sent when the network and all its targets have a
+ * token, "print" lines first.\n
+ * An automatic line of a counter replaces the queued line of the same counter
+ * to the same targets, since only its latest value matters. When the queue is
+ * full the oldest automatic line is dropped, and lines older than the maximum
+ * age are dropped.
+ */
+class COutboundQueue {
+public:
+    //settings
+    double dBurst; /**< Lines that can be sent at once on the network. */
+    double dRate; /**< Lines per second on the network. */
+    double dTargetBurst;
+    double dTargetRate;
+    size_t uMaxDepth;
+    double dMaxAge; /**< Seconds before a queued line is dropped. */
+    
+    //metrics
+    unsigned long long uSent;
+    unsigned long long uMerged;
+    unsigned long long uDroppedFull;
+    unsigned long long uDroppedStale;
+    size_t uMaxDepthReached;
+    
+protected:
+    struct SBucket {
+        double tokens;
+        double last; /**< Time of the last refill. */
+    };
+    
+    std::deque<SOutboundLine> m_lines[PRIORITY_COUNT];
+    SBucket m_network;
+    std::map<CString, SBucket> m_targets;
+    
+    
+    static void refill(SBucket& bucket, double now, double burst, double rate) {
+        bucket.tokens = std::min(burst, bucket.tokens + (now - bucket.last) * rate);
+        bucket.last = now;
+    }
+    
+    SBucket& getTarget(const CString& sTarget, double now) {
+        auto it = m_targets.find(sTarget);
+        if (it == m_targets.end()) {
+            it = m_targets.insert(std::make_pair(sTarget, SBucket{dTargetBurst, now})).first;
+        }
+        refill(it->second, now, dTargetBurst, dTargetRate);
+        return it->second;
+    }
+    
+    bool canSend(const SOutboundLine& line, double now) {
+        for (const CString& sTarget : line.vsTargets) {
+            if (getTarget(sTarget, now).tokens < 1) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+public:
+    
+    COutboundQueue() : dBurst(5), dRate(1), dTargetBurst(3), dTargetRate(0.5), uMaxDepth(200),
+            dMaxAge(120), uSent(0), uMerged(0), uDroppedFull(0), uDroppedStale(0),
+            uMaxDepthReached(0), m_network{5, 0} {
+        
+    }
+    
+    size_t size() const {
+        return m_lines[PRIORITY_PRINT].size() + m_lines[PRIORITY_AUTOMATIC].size();
+    }
+    
+    /**
+     * Queue a line, merged with a queued line of the same counter if it's automatic.
+     */
+    void push(SOutboundLine&& line, EPriority priority) {
+        std::deque<SOutboundLine>& lines = m_lines[priority];
+        if (priority == PRIORITY_AUTOMATIC && !line.sCounterName.empty()) {
+            for (SOutboundLine& queued : lines) {
+                if (queued.sCounterName == line.sCounterName && queued.vsTargets == line.vsTargets) {
+                    queued.sMessage.swap(line.sMessage);
+                    uMerged++;
+                    return;
+                }
+            }
+        }
+        if (size() >= uMaxDepth) {
+            if (!m_lines[PRIORITY_AUTOMATIC].empty()) {
+                m_lines[PRIORITY_AUTOMATIC].pop_front();
+            }
+            else if (priority == PRIORITY_AUTOMATIC) {
+                uDroppedFull++;
+                return;
+            }
+            else {
+                m_lines[PRIORITY_PRINT].pop_front();
+            }
+            uDroppedFull++;
+        }
+        lines.push_back(std::move(line));
+        uMaxDepthReached = std::max(uMaxDepthReached, size());
+    }
+    
+    /**
+     * Send the lines allowed by the buckets.
+     * @param now current time in seconds
+     * @param send function sending a line
+     */
+    void drain(double now, std::function<void(const SOutboundLine&)> send) {
+        refill(m_network, now, dBurst, dRate);
+        for (std::deque<SOutboundLine>& lines : m_lines) {
+            for (auto it = lines.begin(); it != lines.end() && m_network.tokens >= 1;) {
+                if (now - it->queued > dMaxAge) {
+                    it = lines.erase(it);
+                    uDroppedStale++;
+                }
+                else if (canSend(*it, now)) {
+                    m_network.tokens -= 1;
+                    for (const CString& sTarget : it->vsTargets) {
+                        m_targets[sTarget].tokens -= 1;
+                    }
+                    send(*it);
+                    uSent++;
+                    it = lines.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+        //full buckets are the default, no need to keep them
+        for (auto it = m_targets.begin(); it != m_targets.end();) {
+            refill(it->second, now, dTargetBurst, dTargetRate);
+            if (it->second.tokens >= dTargetBurst)
+                it = m_targets.erase(it);
+            else
+                ++it;
+        }
+    }
+    
+};
+
+
+/**
+ * Token buckets of the nicknames using listeners, so a nickname can't use
+ * them faster than rate lines per second after a burst. The buckets are in a
+ * hash index of fixed capacity : when it is full the least recently used
+ * nickname is evicted, which only gives it a full bucket again.
+ */
+class CNickLimiter {
+public:
+    static const unsigned int CAPACITY = 4096;
+    
+    //settings
+    double dBurst;
+    double dRate; /**< Lines per second of a nickname. */
+    
+    //metrics
+    unsigned long long uLimited;
+    unsigned long long uEvicted;
+    
+protected:
+    static const unsigned int NONE = ~0u;
+    
+    struct SEntry {
+        CString sNickname;
+        double tokens;
+        double last; /**< Time of the last refill. */
+        unsigned int uPrev; /**< More recently used entry. */
+        unsigned int uNext; /**< Less recently used entry. */
+    };
+    
+    std::vector<SEntry> m_entries;
+    CStringIndex m_index; /**< Nickname to position in m_entries. */
+    unsigned int m_uHead; /**< Most recently used entry. */
+    unsigned int m_uTail; /**< Least recently used entry, evicted first. */
+    
+    
+    void unlink(unsigned int index) {
+        SEntry& entry = m_entries[index];
+        (entry.uPrev != NONE ? m_entries[entry.uPrev].uNext : m_uHead) = entry.uNext;
+        (entry.uNext != NONE ? m_entries[entry.uNext].uPrev : m_uTail) = entry.uPrev;
+    }
+    
+    void pushFront(unsigned int index) {
+        SEntry& entry = m_entries[index];
+        entry.uPrev = NONE;
+        entry.uNext = m_uHead;
+        (m_uHead != NONE ? m_entries[m_uHead].uPrev : m_uTail) = index;
+        m_uHead = index;
+    }
+    
+public:
+    
+    CNickLimiter() : dBurst(5), dRate(1), uLimited(0), uEvicted(0), m_uHead(NONE), m_uTail(NONE) {
+        
+    }
+    
+    size_t size() const {
+        return m_entries.size();
+    }
+    
+    /**
+     * Take a token of the bucket of a nickname.
+     * @return false if the nickname has no token left
+     */
+    bool allow(const CString& sNickname, double now) {
+        unsigned int index = m_index.find(sNickname);
+        if (index != NONE) {
+            unlink(index);
+        }
+        else if (m_entries.size() < CAPACITY) {
+            index = (unsigned int) m_entries.size();
+            m_entries.push_back(SEntry{sNickname, dBurst, now, NONE, NONE});
+            m_index.insert(sNickname, index);
+        }
+        else {
+            index = m_uTail;
+            unlink(index);
+            m_index.erase(m_entries[index].sNickname);
+            m_entries[index].sNickname = sNickname;
+            m_entries[index].tokens = dBurst;
+            m_entries[index].last = now;
+            m_index.insert(sNickname, index);
+            uEvicted++;
+        }
+        pushFront(index);
+        SEntry& entry = m_entries[index];
+        entry.tokens = std::min(dBurst, entry.tokens + (now - entry.last) * dRate);
+        entry.last = now;
+        if (entry.tokens < 1) {
+            uLimited++;
+            return false;
+        }
+        entry.tokens--;
+        return true;
+    }
+    
+};
+
+
+class CQueueTimer : public CTimer {
+public:
+    
+    CQueueTimer(CModule* pModule) : CTimer(pModule, 1, 0, "queue",
+    "Send the queued messages of counters") {
+        
+    }
+    
+    virtual ~CQueueTimer() override {
+        
+    }
+    
+protected:
+    
+    virtual void RunJob() override;
+    
+};
+
+
+/**
+ * Append only journal of the changes of counters and listeners, compacted in
+ * a snapshot of the whole state (see CCounterSnapshot).\n
+ * Records are appended to a buffer, written and synced to disk by flush().
+ * The journal and the snapshot start with a generation number : a journal
+ * with another generation than the snapshot is already in the snapshot.
+ */
+class CCountersJournal {
+public:
+    static const size_t COMPACT_SIZE = 1 << 20; /**< Journal size which triggers a snapshot. */
+    
+protected:
+    static const size_t HEADER_SIZE = 16;
+    
+    CString m_sJournalPath;
+    CString m_sSnapshotPath;
+    int m_fd;
+    CString m_sBuffer; /**< Records not written yet. */
+    size_t m_uFileSize;
+    unsigned long long m_uGeneration;
+    bool m_bUnsynced;
+    bool m_bCurrent; /**< The file is a journal of the generation of the snapshot, as read by load(). */
+    
+    
+public:
+    
+    static CString header(const char* magic, unsigned long long uGeneration) {
+        CString sHeader(magic, 8);
+        for (int i = 0; i < 8; i++) {
+            sHeader += (char) (uGeneration >> (8 * i));
+        }
+        return sHeader;
+    }
+    
+    /**
+     * Read a whole file and check its header.
+     * @param sData receives the records following the header
+     * @param uGeneration receives the generation of the file
+     * @return false if the file doesn't exist or has no valid header
+     */
+    static bool readFile(const CString& sPath, const char* magic, CString& sData, unsigned long long& uGeneration) {
+        int fd = ::open(sPath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        sData.clear();
+        char buffer[65536];
+        ssize_t length;
+        while ((length = ::read(fd, buffer, sizeof(buffer))) > 0) {
+            sData.append(buffer, length);
+        }
+        ::close(fd);
+        if (sData.size() < HEADER_SIZE || sData.compare(0, 8, magic, 8) != 0) {
+            return false;
+        }
+        CRecordReader reader(sData.data() + 8, 8);
+        uGeneration = (unsigned long long) reader.readInt();
+        sData.erase(0, HEADER_SIZE);
+        return true;
+    }
+    
+    static bool writeAll(int fd, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t written = ::write(fd, data, length);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+    
+    /**
+     * Replace a file atomically : the data is written to a temporary file,
+     * synced, then renamed over the file.
+     */
+    static bool replaceFile(const CString& sPath, const CString& sData) {
+        CString sTemporaryPath = sPath + ".tmp";
+        int fd = ::open(sTemporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            return false;
+        }
+        bool bWritten = writeAll(fd, sData.data(), sData.size()) && ::fsync(fd) == 0;
+        ::close(fd);
+        if (!bWritten || ::rename(sTemporaryPath.c_str(), sPath.c_str()) != 0) {
+            ::unlink(sTemporaryPath.c_str());
+            return false;
+        }
+        return true;
+    }
+    
+    CCountersJournal() : m_fd(-1), m_uFileSize(0), m_uGeneration(0), m_bUnsynced(false), m_bCurrent(false) {
+        
+    }
+    
+    ~CCountersJournal() {
+        close();
+    }
+    
+    /**
+     * Buffer where the records of the journal are written with CRecordWriter.
+     */
+    CString& getBuffer() {
+        return m_sBuffer;
+    }
+    
+    bool isOpen() const {
+        return m_fd >= 0;
+    }
+    
+    /**
+     * @return size of the journal, with records not written yet
+     */
+    size_t size() const {
+        return m_uFileSize + m_sBuffer.size();
+    }
+    
+    unsigned long long getGeneration() const {
+        return m_uGeneration;
+    }
+    
+    /**
+     * Read the journal of a directory.
+     * @param uGeneration generation of the snapshot loaded from the same directory
+     * @param sJournal receives the records of the journal, empty if it belongs to an old snapshot
+     */
+    void load(const CString& sDirectory, unsigned long long uGeneration, CString& sJournal) {
+        m_sJournalPath = sDirectory + "/counters.journal";
+        m_sSnapshotPath = sDirectory + "/counters.snapshot";
+        m_uGeneration = uGeneration;
+        unsigned long long uJournalGeneration = 0;
+        m_bCurrent = readFile(m_sJournalPath, "ZCNTJRN1", sJournal, uJournalGeneration)
+                && uJournalGeneration == m_uGeneration;
+        if (!m_bCurrent) {
+            sJournal.clear();
+        }
+    }
+    
+    /**
+     * Open the journal to append records, after load().
+     * @param sJournal the records of the journal returned by load(), without a truncated last record
+     */
+    bool open(const CString& sJournal) {
+        m_fd = ::open(m_sJournalPath.c_str(), O_WRONLY | O_CREAT, 0600);
+        if (m_fd < 0) {
+            return false;
+        }
+        bool bOpened;
+        if (m_bCurrent) {
+            //the records kept are never rewritten, only a truncated last record is cut
+            bOpened = ::ftruncate(m_fd, HEADER_SIZE + sJournal.size()) == 0 && ::lseek(m_fd, 0, SEEK_END) >= 0;
+        }
+        else {
+            //a new journal, or the journal of an older snapshot whose changes are all in the snapshot
+            CString sHeader = header("ZCNTJRN1", m_uGeneration);
+            bOpened = ::ftruncate(m_fd, 0) == 0 && writeAll(m_fd, sHeader.data(), sHeader.size());
+        }
+        if (!bOpened || ::fsync(m_fd) != 0) {
+            close();
+            return false;
+        }
+        m_uFileSize = sJournal.size();
+        return true;
+    }
+    
+    void close() {
+        if (m_fd >= 0) {
+            flush();
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+    
+    /**
+     * Write the buffered records and sync the journal.
+     */
+    bool flush() {
+        if (m_fd < 0) {
+            m_sBuffer.clear();
+            return false;
+        }
+        if (!m_sBuffer.empty()) {
+            if (!writeAll(m_fd, m_sBuffer.data(), m_sBuffer.size())) {
+                return false;
+            }
+            m_uFileSize += m_sBuffer.size();
+            m_sBuffer.clear();
+            m_bUnsynced = true;
+        }
+        if (m_bUnsynced) {
+            m_bUnsynced = ::fsync(m_fd) != 0;
+        }
+        return !m_bUnsynced;
+    }
+    
+    /**
+     * Replace the snapshot by sSnapshot and empty the journal.
+     * @param sSnapshot the new snapshot file, of generation getGeneration() + 1
+     */
+    bool writeSnapshot(const CString& sSnapshot) {
+        if (m_fd < 0 || !replaceFile(m_sSnapshotPath, sSnapshot)) {
+            return false;
+        }
+        m_uGeneration++;
+        m_sBuffer.clear();
+        m_uFileSize = 0;
+        CString sHeader = header("ZCNTJRN1", m_uGeneration);
+        m_bUnsynced = true;
+        if (::ftruncate(m_fd, 0) == 0 && ::lseek(m_fd, 0, SEEK_SET) == 0) {
+            writeAll(m_fd, sHeader.data(), sHeader.size());
+        }
+        return flush();
+    }
+    
+};
+
+
+/**
+ * Snapshot of counters with a fixed layout, read through mmap.\n
+ * Counters are materialized one by one when they are used, so loading the
+ * module doesn't depend on the number of counters. Layout (little endian) :
+ * - header of HEADER_SIZE bytes : magic "ZCNTSNAP", version, size of a counter,
+ *   generation, number of counters, offsets and sizes of the sections ;
+ * - counters : RECORD_SIZE bytes each, sorted by name : offsets and lengths of
+ *   the name, the message and the targets in the strings, then the values of
+ *   CCounter::getState() ;
+ * - strings : names and messages ;
+ * - listeners : RECORD_LISTENER records.
+ */
+class CCounterSnapshot {
+public:
+    static const unsigned int VERSION = 1;
+    static const unsigned int NONE = ~0u;
+    
+protected:
+    static const size_t HEADER_SIZE = 72;
+    static const size_t RECORD_SIZE = 24 + 8 * CCounter::STATE_SIZE;
+    
+    void* m_pMap;
+    size_t m_uMapSize;
+    unsigned long long m_uGeneration;
+    unsigned int m_uCount;
+    const unsigned char* m_pRecords;
+    const char* m_pStrings;
+    size_t m_uStringsSize;
+    const char* m_pListeners; /**< Records to replay after the load. */
+    size_t m_uListenersSize;
+    std::vector<bool> m_taken; /**< Counters materialized or deleted since the load. */
+    size_t m_uTaken;
+    
+    
+    static unsigned long long readUInt(const unsigned char* data, int size) {
+        unsigned long long value = 0;
+        for (int i = 0; i < size; i++) {
+            value |= (unsigned long long) data[i] << (8 * i);
+        }
+        return value;
+    }
+    
+    static void appendUInt(CString& sBuffer, unsigned long long value, int size) {
+        for (int i = 0; i < size; i++) {
+            sBuffer += (char) (value >> (8 * i));
+        }
+    }
+    
+    bool validString(unsigned long long offset, unsigned long long length) const {
+        return offset <= m_uStringsSize && length <= m_uStringsSize - offset;
+    }
+    
+    /**
+     * Compare the name of a record to a name. A name outside of the strings
+     * is compared as an empty name, as getName() returns it.
+     */
+    int compareName(unsigned int index, const char* name, size_t length) const {
+        const unsigned char* record = m_pRecords + index * RECORD_SIZE;
+        unsigned long long offset = readUInt(record, 4);
+        size_t nameLength = readUInt(record + 4, 4);
+        if (!validString(offset, nameLength)) {
+            offset = nameLength = 0;
+        }
+        int result = nameLength == 0 ? 0 : memcmp(m_pStrings + offset, name, std::min(nameLength, length));
+        if (result == 0 && nameLength != length) {
+            result = nameLength < length ? -1 : 1;
+        }
+        return result;
+    }
+    
+public:
+    
+    CCounterSnapshot() : m_pMap(nullptr), m_uMapSize(0), m_uGeneration(0), m_uCount(0),
+            m_pRecords(nullptr), m_pStrings(nullptr), m_uStringsSize(0), m_pListeners(nullptr),
+            m_uListenersSize(0), m_uTaken(0) {
+        
+    }
+    
+    ~CCounterSnapshot() {
+        close();
+    }
+    
+    CCounterSnapshot(const CCounterSnapshot&) = delete;
+    void operator=(const CCounterSnapshot&) = delete;
+    
+    /**
+     * Map a snapshot file.
+     * @return false if the file doesn't exist or is invalid
+     */
+    bool open(const CString& sPath) {
+        close();
+        int fd = ::open(sPath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0 || (size_t) status.st_size < HEADER_SIZE) {
+            ::close(fd);
+            return false;
+        }
+        m_uMapSize = status.st_size;
+        m_pMap = mmap(nullptr, m_uMapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m_pMap == MAP_FAILED) {
+            m_pMap = nullptr;
+            return false;
+        }
+        const unsigned char* data = (const unsigned char*) m_pMap;
+        if (memcmp(data, "ZCNTSNAP", 8) != 0 || readUInt(data + 8, 4) != VERSION
+                || readUInt(data + 12, 4) != RECORD_SIZE) {
+            close();
+            return false;
+        }
+        m_uGeneration = readUInt(data + 16, 8);
+        unsigned long long count = readUInt(data + 24, 4);
+        unsigned long long recordsOffset = readUInt(data + 32, 8);
+        unsigned long long stringsOffset = readUInt(data + 40, 8);
+        unsigned long long stringsSize = readUInt(data + 48, 8);
+        unsigned long long listenersOffset = readUInt(data + 56, 8);
+        unsigned long long listenersSize = readUInt(data + 64, 8);
+        if (recordsOffset > m_uMapSize || count > (m_uMapSize - recordsOffset) / RECORD_SIZE
+                || stringsOffset > m_uMapSize || stringsSize > m_uMapSize - stringsOffset
+                || listenersOffset > m_uMapSize || listenersSize > m_uMapSize - listenersOffset) {
+            close();
+            return false;
+        }
+        m_uCount = (unsigned int) count;
+        m_pRecords = data + recordsOffset;
+        m_pStrings = (const char*) data + stringsOffset;
+        m_uStringsSize = stringsSize;
+        m_pListeners = (const char*) data + listenersOffset;
+        m_uListenersSize = listenersSize;
+        m_taken.assign(m_uCount, false);
+        m_uTaken = 0;
+        return true;
+    }
+    
+    void close() {
+        if (m_pMap) {
+            munmap(m_pMap, m_uMapSize);
+        }
+        m_pMap = nullptr;
+        m_uMapSize = 0;
+        m_uCount = 0;
+        m_pListeners = nullptr;
+        m_uListenersSize = 0;
+        m_taken.clear();
+        m_uTaken = 0;
+    }
+    
+    unsigned long long getGeneration() const {
+        return m_uGeneration;
+    }
+    
+    /**
+     * Records to replay after the load : the listeners.
+     */
+    CString getRecords() const {
+        return m_pListeners ? CString(m_pListeners, m_uListenersSize) : CString();
+    }
+    
+    /**
+     * @return number of counters not materialized nor deleted
+     */
+    size_t size() const {
+        return m_uCount - m_uTaken;
+    }
+    
+    /**
+     * Find a counter not materialized nor deleted, by binary search on its name.
+     * @return its index, NONE if not found
+     */
+    unsigned int find(const CString& sName) const {
+        unsigned int low = 0;
+        unsigned int high = m_uCount;
+        while (low < high) {
+            unsigned int middle = low + (high - low) / 2;
+            int result = compareName(middle, sName.data(), sName.size());
+            if (result == 0) {
+                return m_taken[middle] ? NONE : middle;
+            }
+            if (result < 0)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return NONE;
+    }
+    
+    /**
+     * @return number of counters of the file, with the counters taken
+     */
+    unsigned int getCount() const {
+        return m_uCount;
+    }
+    
+    bool isTaken(unsigned int index) const {
+        return m_taken[index];
+    }
+    
+    /**
+     * Read the shared flag of a counter without building it.
+     */
+    bool isShared(unsigned int index) const {
+        return readUInt(m_pRecords + index * RECORD_SIZE + 24 + 8 * CCounter::STATE_SHARED, 8) != 0;
+    }
+    
+    CString getName(unsigned int index) const {
+        return getString(index, 0);
+    }
+    
+    /**
+     * @param field 0 for the name, 1 for the message, 2 for the targets
+     */
+    CString getString(unsigned int index, unsigned int field) const {
+        const unsigned char* record = m_pRecords + index * RECORD_SIZE + field * 8;
+        unsigned long long offset = readUInt(record, 4);
+        unsigned long long length = readUInt(record + 4, 4);
+        return validString(offset, length) ? CString(m_pStrings + offset, length) : CString();
+    }
+    
+    /**
+     * Build the counter of a record, which is then taken : it will not be found again.
+     */
+    CCounter take(unsigned int index) {
+        CCounter counter = read(index);
+        remove(index);
+        return counter;
+    }
+    
+    /**
+     * Build the counter of a record, without taking it.
+     */
+    CCounter read(unsigned int index) const {
+        const unsigned char* stateValues = m_pRecords + index * RECORD_SIZE + 24;
+        CCounter counter(getName(index));
+        counter.setMessage(getString(index, 1));
+        counter.setTargets(getString(index, 2));
+        long long state[CCounter::STATE_SIZE];
+        for (int i = 0; i < CCounter::STATE_SIZE; i++) {
+            state[i] = (long long) readUInt(stateValues + 8 * i, 8);
+        }
+        counter.setState(state);
+        return counter;
+    }
+    
+    /**
+     * Mark a counter as taken, when it is materialized or deleted.
+     */
+    void remove(unsigned int index) {
+        if (!m_taken[index]) {
+            m_taken[index] = true;
+            m_uTaken++;
+        }
+    }
+    
+    /**
+     * Build a snapshot file.
+     * @param uGeneration generation of the snapshot
+     * @param counters the counters, sorted by name
+     * @param sListeners RECORD_LISTENER records of all listeners
+     */
+    static CString build(unsigned long long uGeneration, const std::vector<CCounter*>& counters,
+            const CString& sListeners) {
+        CString sRecords;
+        CString sStrings;
+        long long state[CCounter::STATE_SIZE];
+        for (CCounter* counter : counters) {
+            appendUInt(sRecords, sStrings.size(), 4);
+            appendUInt(sRecords, counter->getName().size(), 4);
+            sStrings.append(counter->getName());
+            appendUInt(sRecords, sStrings.size(), 4);
+            appendUInt(sRecords, counter->getMessage().size(), 4);
+            sStrings.append(counter->getMessage());
+            CString sTargets = counter->getTargetsString();
+            appendUInt(sRecords, sStrings.size(), 4);
+            appendUInt(sRecords, sTargets.size(), 4);
+            sStrings.append(sTargets);
+            counter->getState(state);
+            for (int i = 0; i < CCounter::STATE_SIZE; i++) {
+                appendUInt(sRecords, (unsigned long long) state[i], 8);
+            }
+        }
+        CString sSnapshot("ZCNTSNAP");
+        appendUInt(sSnapshot, VERSION, 4);
+        appendUInt(sSnapshot, RECORD_SIZE, 4);
+        appendUInt(sSnapshot, uGeneration, 8);
+        appendUInt(sSnapshot, counters.size(), 4);
+        appendUInt(sSnapshot, 0, 4);
+        appendUInt(sSnapshot, HEADER_SIZE, 8);
+        appendUInt(sSnapshot, HEADER_SIZE + sRecords.size(), 8);
+        appendUInt(sSnapshot, sStrings.size(), 8);
+        appendUInt(sSnapshot, HEADER_SIZE + sRecords.size() + sStrings.size(), 8);
+        appendUInt(sSnapshot, sListeners.size(), 8);
+        sSnapshot.reserve(sSnapshot.size() + sRecords.size() + sStrings.size() + sListeners.size());
+        sSnapshot.append(sRecords);
+        sSnapshot.append(sStrings);
+        sSnapshot.append(sListeners);
+        return sSnapshot;
+    }
+    
+};
+
+
+/**
+ * Counters of the user and global scopes, shared by all the modules of the
+ * process. A scope is loaded by the first module using it, its counters are
+ * found by the modules through a pointer to it, and it is saved and removed
+ * when its last module is unloaded.\n
+ * A scope is saved as a whole file of RECORD_COUNTER records, rewritten when
+ * it is dirty at each journal timer of a module.
+ */
+class CCounterRegistry {
+public:
+    struct SScope {
+        EScope scope;
+        CString sPath;
+        CCounterTable counters;
+        bool bDirty; /**< Changed since the last save. */
+        unsigned int uReferences; /**< Modules using the scope. */
+    };
+    
+protected:
+    static constexpr const char* MAGIC = "ZCNTSCP1";
+    
+    std::map<CString, SScope> m_scopes; /**< Scopes by key, "user:<name>" or "global". */
+    
+    static void load(SScope& scope) {
+        CString sData;
+        unsigned long long uGeneration;
+        if (!CCountersJournal::readFile(scope.sPath, MAGIC, sData, uGeneration)) {
+            return;
+        }
+        CRecordReader reader(sData.data(), sData.size());
+        while (!reader.atEnd()) {
+            ERecordType type;
+            CRecordReader record = reader.readRecord(type);
+            if (!reader.isValid()) {
+                break;
+            }
+            CCounter counter("");
+            if (type == RECORD_COUNTER && counter.readState(record)) {
+                counter.setScope(scope.scope);
+                scope.counters.insert(counter.getName(), counter);
+            }
+        }
+    }
+    
+    static void save(SScope& scope) {
+        CString sData = CCountersJournal::header(MAGIC, 0);
+        for (CCounterTable::SSlot& slot : scope.counters.getSlots()) {
+            if (slot.bUsed) {
+                slot.counter.writeState(sData);
+            }
+        }
+        if (CCountersJournal::replaceFile(scope.sPath, sData)) {
+            scope.bDirty = false;
+        }
+    }
+    
+public:
+    
+    static CCounterRegistry& get() {
+        static CCounterRegistry registry;
+        return registry;
+    }
+    
+    /**
+     * Use a scope, loading it from sPath if no module uses it yet.
+     * @return the scope, which stays at the same address until it is released by all modules
+     */
+    SScope* acquire(const CString& sKey, EScope scope, const CString& sPath) {
+        auto it = m_scopes.find(sKey);
+        if (it == m_scopes.end()) {
+            it = m_scopes.insert(std::make_pair(sKey, SScope{scope, sPath, CCounterTable(), false, 0})).first;
+            load(it->second);
+        }
+        it->second.uReferences++;
+        return &it->second;
+    }
+    
+    /**
+     * Stop using a scope, which is saved and removed if no module uses it anymore.
+     */
+    void release(const CString& sKey) {
+        auto it = m_scopes.find(sKey);
+        if (it == m_scopes.end()) {
+            return;
+        }
+        if (it->second.bDirty) {
+            save(it->second);
+        }
+        if (--it->second.uReferences == 0) {
+            m_scopes.erase(it);
+        }
+    }
+    
+    /**
+     * Save the scopes changed since their last save.
+     */
+    void save() {
+        for (auto& it : m_scopes) {
+            if (it.second.bDirty) {
+                save(it.second);
+            }
+        }
+    }
+    
+};
+
+
+/**
+ * Writer of metrics in the OpenMetrics text format to a web socket : the text
+ * is passed to the socket by blocks of about FLUSH_SIZE bytes, so the writer
+ * never holds the whole page in one string. The socket still buffers all the
+ * blocks until they are sent, so the whole page is in memory once.
+ */
+class CMetricsWriter {
+protected:
+    static const size_t FLUSH_SIZE = 16384;
+    
+    CWebSock& m_socket;
+    CString m_sBuffer;
+    bool m_bLabels; /**< The current sample has labels. */
+    
+    
+    void appendEscaped(const CString& sValue) {
+        for (char c : sValue) {
+            if (c == '\\' || c == '"') {
+                m_sBuffer += '\\';
+                m_sBuffer += c;
+            }
+            else if (c == '\n') {
+                m_sBuffer.append("\\n");
+            }
+            else {
+                m_sBuffer += c;
+            }
+        }
+    }
+    
+public:
+    
+    CMetricsWriter(CWebSock& socket) : m_socket(socket), m_bLabels(false) {
+        m_sBuffer.reserve(FLUSH_SIZE + 256);
+    }
+    
+    /**
+     * Start a family of metrics, all its samples have to follow.
+     * @param name the name of the family, without the suffix _total of the counters
+     * @param type "gauge" or "counter"
+     */
+    void family(const char* name, const char* type, const char* help) {
+        m_sBuffer.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+        m_sBuffer.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    }
+    
+    /**
+     * Start a sample, followed by its labels and ended by its value.
+     */
+    CMetricsWriter& sample(const char* name) {
+        m_sBuffer.append(name);
+        m_bLabels = false;
+        return *this;
+    }
+    
+    CMetricsWriter& label(const char* name, const CString& sValue) {
+        m_sBuffer += m_bLabels ? ',' : '{';
+        m_sBuffer.append(name).append("=\"");
+        appendEscaped(sValue);
+        m_sBuffer += '"';
+        m_bLabels = true;
+        return *this;
+    }
+    
+    void value(long long value) {
+        m_sBuffer.append(m_bLabels ? "} " : " ");
+        CMessageTemplate::appendInt(m_sBuffer, value);
+        m_sBuffer += '\n';
+        if (m_sBuffer.size() >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+    
+    void flush() {
+        if (!m_sBuffer.empty()) {
+            m_socket.Write(m_sBuffer);
+            m_sBuffer.clear();
+        }
+    }
+    
+    /**
+     * End the metrics and write what is left.
+     */
+    void finish() {
+        m_sBuffer.append("# EOF\n");
+        flush();
+    }
+    
+};
+
+
+class CJournalTimer : public CTimer {
+public:
+    
+    CJournalTimer(CModule* pModule) : CTimer(pModule, 2, 0, "journal",
+    "Write the journal of counters to disk") {
+        
+    }
+    
+    virtual ~CJournalTimer() override {
+        
+    }
+    
+protected:
+    
+    virtual void RunJob() override;
+    
+};
+
+
+class CCountersMod : public CModule {
+protected:
+    //DATA MEMBERS
+    CCounterTable m_counters;
+    CListenerIndex m_listeners;
+    CAnnouncementWheel m_announcements; /**< Delayed messages of counters. */
+    long long m_wheelEpoch; /**< Time of the tick 0 of m_announcements, in milliseconds of steady_clock. */
+    CAnnouncementTimer* m_pAnnouncementTimer; /**< Owned by ZNC, armed for the next due tick of m_announcements. */
+    unsigned long long m_uArmedTick;
+    static const int IDLE_INTERVAL = 60; /**< Seconds between 2 runs of the announcement timer without announcement. */
+    CString m_sRenderBuffer; /**< Reused buffer to format messages of counters. */
+    CString m_sTargetsBuffer; /**< Reused buffer for the targets of a PRIVMSG. */
+    COutboundQueue m_queue;
+    VCString m_vsChannelsBuffer; /**< Reused list of the channels of the network. */
+    size_t m_uMaxTargets; /**< Targets allowed in one PRIVMSG, 0 if not known yet. */
+    static const size_t MAX_LINE_LENGTH = 510; /**< Maximum length of an IRC line without CRLF. */
+    CCountersJournal m_journal;
+    CCounterSnapshot m_snapshot; /**< Counters of the snapshot not materialized in m_counters yet. */
+    std::time_t m_lastSnapshot;
+    static const int SNAPSHOT_INTERVAL = 600; /**< Seconds between 2 snapshots if the journal is not empty. */
+    static const size_t MAX_IMPORT_SIZE = 1 << 20; /**< Maximum size of a file of the "import" command. */
+    
+    //statistics of OnChanMsg
+    unsigned long long m_uLinesPrefiltered; /**< Lines rejected by their first byte. */
+    unsigned long long m_uLinesMissed; /**< Lines rejected by the index of listeners. */
+    unsigned long long m_uLinesMatched;
+    unsigned long long m_uLinesRefused; /**< Lines using a command or a value not allowed to their listener. */
+    CNickLimiter m_nickLimiter;
+    //statistics of the counters
+    unsigned long long m_uOperations; /**< Operations executed on counters, by commands and listeners. */
+    unsigned long long m_uOperationsRejected; /**< Operations rejected by the limits of their counter. */
+    unsigned long long m_uAnnouncements; /**< Messages of changes, sent or scheduled after their delay. */
+    unsigned long long m_uChangesInCooldown; /**< Changes not announced at once because of a cooldown. */
+    
+    unsigned int m_uShard; /**< Shard of this network in the shared values. */
+    
+    CString m_sUserScope; /**< Key of the user scope in the registry. */
+    CCounterRegistry::SScope* m_pUserScope;
+    CCounterRegistry::SScope* m_pGlobalScope;
+    struct SScopedPending {
+        unsigned int uGeneration; /**< Generation of the handle of the counter. */
+        unsigned int uIndex; /**< Entry in m_announcements. */
+    };
+    /** Coalesced messages of counters of other scopes, by scope and slot of the counter. */
+    std::map<std::pair<EScope, unsigned int>, SScopedPending> m_scopedPending;
+    CString m_sScopeRecords; /**< Records of counters of other scopes, not written to the journal. */
+    
+    
+    //FUNCTIONS
+    /**
+     * Find a counter, materializing it from the snapshot if it's not used yet.
+     * @param sName the name of the counter
+     * @return the counter, nullptr if it doesn't exist
+     */
+    CCounter* findCounter(const CString& sName) {
+        CCounter* counter = m_counters.find(sName);
+        if (counter) {
+            return counter;
+        }
+        unsigned int index = m_snapshot.find(sName);
+        if (index == CCounterSnapshot::NONE) {
+            return findScopedCounter(sName);
+        }
+        return addCounter(sName, m_snapshot.take(index));
+    }
+    
+    /**
+     * Add a counter to the counters of the network and bind its listeners.
+     * @return the added counter, nullptr if it already exists
+     */
+    CCounter* addCounter(const CString& sName, const CCounter& counter) {
+        CCounter* added = m_counters.insert(sName, counter);
+        if (added) {
+            m_listeners.bindCounter(sName, m_counters.getHandle(sName));
+        }
+        return added;
+    }
+    
+    /**
+     * Find a counter of the user scope, or else of the global scope.
+     */
+    CCounter* findScopedCounter(const CString& sName) {
+        for (CCounterRegistry::SScope* pScope : {m_pUserScope, m_pGlobalScope}) {
+            CCounter* counter = pScope ? pScope->counters.find(sName) : nullptr;
+            if (counter) {
+                return counter;
+            }
+        }
+        return nullptr;
+    }
+    
+    CCounterRegistry::SScope* getScope(EScope scope) {
+        return scope == SCOPE_USER ? m_pUserScope : m_pGlobalScope;
+    }
+    
+    /**
+     * @return the table of the counters of a scope, nullptr if the scope is not used
+     */
+    CCounterTable* getTable(EScope scope) {
+        if (scope == SCOPE_NETWORK) {
+            return &m_counters;
+        }
+        CCounterRegistry::SScope* pScope = getScope(scope);
+        return pScope ? &pScope->counters : nullptr;
+    }
+    
+    /**
+     * @return the counter of a handle in the table of a scope, nullptr if it was deleted
+     */
+    CCounter* getCounter(EScope scope, const SCounterHandle& handle) {
+        CCounterTable* table = getTable(scope);
+        return table ? table->get(handle) : nullptr;
+    }
+    
+    /**
+     * Where the records of the changes of a counter are written : the
+     * journal for a counter of the network, otherwise a scratch buffer as the
+     * scope of the counter is saved as a whole.
+     */
+    CString& getRecords(CCounter& counter) {
+        if (counter.getScope() == SCOPE_NETWORK) {
+            return m_journal.getBuffer();
+        }
+        getScope(counter.getScope())->bDirty = true;
+        m_sScopeRecords.clear();
+        return m_sScopeRecords;
+    }
+    
+    /**
+     * Only admins change the global counters, except their values.
+     * @return false, after telling it to the user, if the counter can't be changed
+     */
+    bool checkScopeAccess(EScope scope) {
+        if (scope == SCOPE_GLOBAL && !GetUser()->IsAdmin()) {
+            PutModule("Only admins can create, delete or change global counters.");
+            return false;
+        }
+        return true;
+    }
+    
+    /**
+     * The coalesced message of a counter waiting in the timer wheel. The
+     * wheel belongs to the module, so the handles of counters of other
+     * scopes are kept by the module.
+     */
+    unsigned int getPendingAnnouncement(CCounter& counter) {
+        if (counter.getScope() == SCOPE_NETWORK) {
+            return counter.getPendingAnnouncement();
+        }
+        SCounterHandle handle = getTable(counter.getScope())->getHandle(counter.getName());
+        auto it = m_scopedPending.find(std::make_pair(counter.getScope(), handle.uSlot));
+        return it != m_scopedPending.end() && it->second.uGeneration == handle.uGeneration
+                ? it->second.uIndex : CAnnouncementWheel::NONE;
+    }
+    
+    void setPendingAnnouncement(CCounter& counter, unsigned int pending) {
+        if (counter.getScope() == SCOPE_NETWORK) {
+            counter.setPendingAnnouncement(pending);
+            return;
+        }
+        SCounterHandle handle = getTable(counter.getScope())->getHandle(counter.getName());
+        if (pending == CAnnouncementWheel::NONE)
+            m_scopedPending.erase(std::make_pair(counter.getScope(), handle.uSlot));
+        else
+            m_scopedPending[std::make_pair(counter.getScope(), handle.uSlot)] = SScopedPending{handle.uGeneration, pending};
+    }
+    
+    /**
+     * Remove a counter from m_counters and from the snapshot.
+     */
+    void eraseCounter(const CString& sName) {
+        unsigned int index = m_snapshot.find(sName);
+        if (index != CCounterSnapshot::NONE) {
+            m_snapshot.remove(index);
+        }
+        CCounter* counter = m_counters.find(sName);
+        if (counter) {
+            counter->detachShared();
+            m_counters.erase(sName);
+        }
+    }
+    
+    /**
+     * Rename a counter of the network : it keeps its slot, so its handles,
+     * and its listeners and pending messages follow the new name. Nothing
+     * is changed if the counter can't be renamed.
+     * @return an error message, empty if the counter is renamed
+     */
+    CString renameCounter(const CString& sName, const CString& sNewName) {
+        if (sNewName.empty()) {
+            return "The name of a counter can't be empty.";
+        }
+        if (findCounter(sNewName)) {
+            return "Counter '" + sNewName + "' already exists.";
+        }
+        CCounter* counter = findCounter(sName);
+        if (!counter) {
+            return "Counter '" + sName + "' not found.";
+        }
+        if (counter->getScope() != SCOPE_NETWORK) {
+            return "Counters of the user or global scope can't be renamed, other networks use them by their name.";
+        }
+        if (counter->isShared()) {
+            return "A shared counter can't be renamed, the other networks share it by its name. "
+                    "Stop sharing it first with : set " + sName + " shared off";
+        }
+        m_counters.rename(sName, sNewName);
+        m_listeners.renameCounter(sName, sNewName);
+        return "";
+    }
+    
+    /**
+     * Share or stop sharing the value of a counter with the counters of the
+     * same name of the other networks of the user. The shared flag is saved
+     * with the rest of the counter by the caller.
+     */
+    void shareCounter(const CString& sName, CCounter& counter, bool bShared) {
+        if (bShared)
+            counter.setShared(CSharedValues::get(GetUser()->GetUserName() + "/" + sName), m_uShard);
+        else
+            counter.unshare();
+    }
+    
+    /**
+     * Number of targets allowed in one PRIVMSG, from TARGMAX or MAXTARGETS
+     * of ISUPPORT. Cached until the next connection.
+     */
+    size_t getMaxTargets() {
+        if (m_uMaxTargets) {
+            return m_uMaxTargets;
+        }
+        CIRCSock* pIRCSock = GetNetwork()->GetIRCSock();
+        if (!pIRCSock) {
+            return 1;
+        }
+        m_uMaxTargets = 1;
+        VCString vsLimits;
+        pIRCSock->GetISupport("TARGMAX").Split(",", vsLimits, false);
+        for (const CString& sLimit : vsLimits) {
+            if (sLimit.Token(0, false, ":").Equals("PRIVMSG")) {
+                CString sValue = sLimit.Token(1, false, ":");
+                m_uMaxTargets = sValue.empty() ? MAX_LINE_LENGTH : std::max(sValue.ToUInt(), 1u);
+                return m_uMaxTargets;
+            }
+        }
+        CString sMaxTargets = pIRCSock->GetISupport("MAXTARGETS");
+        if (!sMaxTargets.empty()) {
+            m_uMaxTargets = std::max(sMaxTargets.ToUInt(), 1u);
+        }
+        return m_uMaxTargets;
+    }
+    
+    /**
+     * Send a message to targets, grouped in PRIVMSG with several targets as
+     * allowed by the server and the maximum length of a line.
+     * @param vsTargets channels or nicknames
+     * @param sMessage the message to send
+     */
+    void putPrivmsg(const VCString& vsTargets, const CString& sMessage, const CString& sCounterName,
+            EPriority priority) {
+        size_t uMaxTargets = getMaxTargets();
+        //"PRIVMSG " + targets + " :" + message
+        size_t uFixedLength = 10 + sMessage.size();
+        size_t uTargetsLength = 0;
+        double now = getMonotonicTime();
+        SOutboundLine line{VCString(), sMessage, sCounterName, now};
+        for (const CString& sTarget : vsTargets) {
+            if (!line.vsTargets.empty() && (line.vsTargets.size() == uMaxTargets
+                    || uFixedLength + uTargetsLength + 1 + sTarget.size() > MAX_LINE_LENGTH)) {
+                m_queue.push(std::move(line), priority);
+                line = SOutboundLine{VCString(), sMessage, sCounterName, now};
+                uTargetsLength = 0;
+            }
+            uTargetsLength += sTarget.size() + (line.vsTargets.empty() ? 0 : 1);
+            line.vsTargets.push_back(sTarget);
+        }
+        if (!line.vsTargets.empty()) {
+            m_queue.push(std::move(line), priority);
+        }
+        onQueueTimer();
+    }
+    
+    static double getMonotonicTime() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    static long long getMonotonicMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    /**
+     * Send a message to the targets of a counter, or to all channels of the
+     * network if the counter has no target.
+     * @param counter the counter, nullptr for all channels
+     * @param sMessage the message to send
+     * @param priority PRIORITY_PRINT for the "print" command
+     */
+    void putCounterMessage(CCounter* counter, const CString& sMessage, EPriority priority = PRIORITY_AUTOMATIC) {
+        CString sCounterName = counter ? counter->getName() : "";
+        if (counter && !counter->getTargets().empty()) {
+            putPrivmsg(counter->getTargets(), sMessage, sCounterName, priority);
+            return;
+        }
+        m_vsChannelsBuffer.clear();
+        for (CChan* channel : GetNetwork()->GetChans()) {
+            m_vsChannelsBuffer.push_back(channel->GetName());
+        }
+        putPrivmsg(m_vsChannelsBuffer, sMessage, sCounterName, priority);
+    }
+    
+    /**
+     * Send the message of a counter now, or schedule it in the timer wheel
+     * if the counter has a delay.
+     * @param counter the counter to announce
+     */
+    void announceCounter(CCounter& counter) {
+        m_uAnnouncements++;
+        if (counter.getDelay() <= 0) {
+            putCounterMessage(&counter, counter.getNamedFormat(m_sRenderBuffer));
+            return;
+        }
+        unsigned int pending = getPendingAnnouncement(counter);
+        switch (counter.getCoalesce()) {
+            case COALESCE_NONE:
+                scheduleAnnouncement(counter, counter.getDelay(), ANNOUNCEMENT_MESSAGE);
+                break;
+            case COALESCE_DEBOUNCE:
+                if (pending != CAnnouncementWheel::NONE) {
+                    m_announcements.cancel(pending);
+                }
+                setPendingAnnouncement(counter, scheduleAnnouncement(counter, counter.getDelay(), ANNOUNCEMENT_COALESCED));
+                break;
+            case COALESCE_THROTTLE:
+                if (pending == CAnnouncementWheel::NONE) {
+                    setPendingAnnouncement(counter, scheduleAnnouncement(counter, counter.getDelay(),
+                            ANNOUNCEMENT_COALESCED));
+                }
+                break;
+        }
+    }
+    
+    /**
+     * Announce a change of a counter, following its cooldown.
+     */
+    void announceChange(CCounter& counter) {
+        long long now = getMonotonicMs();
+        bool bScheduleEnd;
+        if (counter.onChangeCooldown(now, bScheduleEnd)) {
+            announceCounter(counter);
+        }
+        else {
+            m_uChangesInCooldown++;
+        }
+        if (bScheduleEnd) {
+            scheduleAnnouncement(counter, counter.getCooldownEnd() - now, ANNOUNCEMENT_COOLDOWN);
+        }
+    }
+    
+    /**
+     * Schedule an entry of a counter in the timer wheel, delay milliseconds
+     * from now. A message keeps the current values of the counter.
+     * @return the handle of the entry
+     */
+    unsigned int scheduleAnnouncement(CCounter& counter, long long delay, EAnnouncement kind) {
+        SPendingAnnouncement announcement;
+        announcement.counter = getTable(counter.getScope())->getHandle(counter.getName());
+        announcement.scope = counter.getScope();
+        announcement.kind = kind;
+        announcement.values = kind == ANNOUNCEMENT_MESSAGE ? counter.getValues() : SCounterValues{0, 0, 0, 0};
+        //the wheel may be late, the due tick is computed from now
+        unsigned long long uDue = (getMonotonicMs() - m_wheelEpoch + delay + CAnnouncementWheel::TICK_MS - 1)
+                / CAnnouncementWheel::TICK_MS;
+        unsigned long long uNow = m_announcements.getNow();
+        unsigned int index = m_announcements.schedule(announcement, uDue > uNow ? uDue - uNow : 1);
+        armAnnouncementTimer(false);
+        return index;
+    }
+    
+    /**
+     * Arm the announcement timer for the next due tick of the wheel.
+     * @param bForce arm it even if the next due tick didn't change, as in its run
+     */
+    void armAnnouncementTimer(bool bForce) {
+        unsigned long long uNext = m_announcements.nextDue();
+        if (!m_pAnnouncementTimer || (uNext == m_uArmedTick && !bForce)) {
+            return;
+        }
+        m_uArmedTick = uNext;
+        double interval = IDLE_INTERVAL;
+        if (uNext != CAnnouncementWheel::NEVER) {
+            long long wait = m_wheelEpoch + (long long) (uNext * CAnnouncementWheel::TICK_MS) - getMonotonicMs();
+            interval = std::max(wait, 1ll) / 1000.0;
+        }
+        m_pAnnouncementTimer->StartMaxCycles(interval, 0);
+    }
+    
+    /**
+     * Send a message taken from the timer wheel, formatted from the values
+     * kept when it was scheduled, or from the current state of its counter
+     * for a coalesced message. The message of a deleted counter is dropped.
+     * @param announcement the message to send
+     */
+    void sendAnnouncement(const SPendingAnnouncement& announcement) {
+        CCounter* counter = getCounter(announcement.scope, announcement.counter);
+        switch (announcement.kind) {
+            case ANNOUNCEMENT_MESSAGE:
+                if (counter) {
+                    putCounterMessage(counter, counter->getNamedFormat(m_sRenderBuffer, announcement.values));
+                }
+                break;
+            case ANNOUNCEMENT_COALESCED:
+                if (announcement.scope == SCOPE_NETWORK) {
+                    if (counter) {
+                        counter->setPendingAnnouncement(CAnnouncementWheel::NONE);
+                    }
+                }
+                else {
+                    //the counter of another scope may have been deleted by another network
+                    auto it = m_scopedPending.find(std::make_pair(announcement.scope, announcement.counter.uSlot));
+                    if (it != m_scopedPending.end() && it->second.uGeneration == announcement.counter.uGeneration) {
+                        m_scopedPending.erase(it);
+                    }
+                }
+                if (counter) {
+                    putCounterMessage(counter, counter->getNamedFormat(m_sRenderBuffer));
+                }
+                break;
+            case ANNOUNCEMENT_COOLDOWN:
+                if (counter && counter->onCooldownEnd(getMonotonicMs())) {
+                    announceCounter(*counter);
+                }
+                break;
+        }
+    }
+    
+    /**
+     * Create a counter.
+     * @param sName the name of the counter
+     * @param initial the initial value of counter
+     * @param step the step by default to increment of decrement
+     * @param cooldown the cooldown between 2 increment or decrement
+     * @param delay the delay to write message on channel
+     * @param sMessage the message to write on channel when current value change
+     * @param scope the scope of the counter
+     */
+    void createCounter(const CString& sName, const long long initial, const long long step,
+            const int cooldown, const int delay, const CString& sMessage, const EScope scope = SCOPE_NETWORK) {
+        if (!checkScopeAccess(scope)) {
+            return;
+        }
+        if (!findCounter(sName)) {
+            CCounter counter = CCounter(sName, initial, step, cooldown, delay, sMessage);
+            counter.setScope(scope);
+            if (scope != SCOPE_NETWORK) {
+                getScope(scope)->counters.insert(sName, counter);
+                getScope(scope)->bDirty = true;
+                PutModule("Counter '" + sName + "' created for " + (scope == SCOPE_USER ? "all your networks." : "all users."));
+                return;
+            }
+            CCounter* created = addCounter(sName, counter);
+            if (created) {
+                created->writeState(m_journal.getBuffer());
+                PutModule("Counter '" + counter.getName() + "' created.");
+            }
+        }
+        else {
+            PutModule("Counter '" + sName + "' already exists.");
+        }
+    }
+    
+    /**
+     * @param sNames the names of the counters separated by commas
+     * @return the counters of a listener, with the counters of the network already loaded
+     */
+    std::vector<SListenerCounter> getListenerCounters(const CString& sNames) {
+        VCString vsNames;
+        sNames.Split(",", vsNames, false);
+        std::vector<SListenerCounter> counters;
+        for (const CString& sName : vsNames) {
+            //counters of other scopes are found at each use, they can be deleted by other networks
+            counters.push_back(SListenerCounter{sName, m_counters.getHandle(sName)});
+        }
+        return counters;
+    }
+    
+    /**
+     * @param sNames the names of the counters changed by the listener, separated by commas
+     * @param sNickname the nickname or the mask of the users
+     * @param sChannel the only channel where the listener is used, empty for all
+     * @param sModes the mode letters the users need one of, empty for everyone
+     */
+    void createListener(const CString sNames, const CString sNickname, const CString sListenerName,
+            const CString& sChannel = "", const CString& sModes = "") {
+        CCounterListener listener = {sNickname, getListenerCounters(sNames), PERMISSION_DEFAULT, LLONG_MAX,
+                sChannel, sModes, {}};
+        CString sWhere = sChannel.empty() ? "" : " on " + sChannel;
+        if (m_listeners.insert(sListenerName, listener)) {
+            writeListener(m_journal.getBuffer(), sListenerName, listener);
+            PutModule("Listener '" + sListenerName + "' for user '" + sNickname + 
+                    "' and counter '" + sNames + "' created" + sWhere + ".");
+        }
+        else {
+            PutModule("Listener '" + sListenerName + "' for user '" + sNickname + "' already exists" + sWhere + ".");
+        }
+    }
+    
+    static void writeListener(CString& sBuffer, const CString& sTrigger, const CCounterListener& listener) {
+        CRecordWriter(sBuffer, RECORD_LISTENER).writeString(sTrigger).writeString(listener.sNickname)
+                .writeString(listener.getCounterNames()).writeUInt32(listener.uPermissions)
+                .writeInt(listener.maxStep).writeString(listener.sChannel).writeString(listener.sModes);
+    }
+    
+    void deleteListener(const CString sNickname, const CString sListenerName, const CString& sChannel = "") {
+        if (m_listeners.erase(sListenerName, sChannel, sNickname)) {
+            CRecordWriter(m_journal.getBuffer(), RECORD_DELETE_LISTENER).writeString(sListenerName)
+                    .writeString(sNickname).writeString(sChannel);
+            PutModule("Listener '" + sListenerName + "' for user '" + sNickname + "' deleted.");
+        }
+        else {
+            PutModule("Listener '" + sListenerName + "' for user '" + sNickname + "' not found.");
+        }
+    }
+    
+    //PERSISTENCE
+    /**
+     * Apply the records of the snapshot or of the journal, without sending
+     * any message. Stops at the first truncated record.
+     * @param sRecords the records
+     * @return the size of the valid records
+     */
+    size_t replayRecords(const CString& sRecords) {
+        CRecordReader reader(sRecords.data(), sRecords.size());
+        size_t uValid = 0;
+        while (!reader.atEnd()) {
+            ERecordType type;
+            CRecordReader record = reader.readRecord(type);
+            if (!reader.isValid()) {
+                break;
+            }
+            replayRecord(type, record);
+            uValid = reader.getPosition() - sRecords.data();
+        }
+        return uValid;
+    }
+    
+    void replayRecord(ERecordType type, CRecordReader& record) {
+        switch (type) {
+            case RECORD_COUNTER: {
+                CCounter counter("");
+                if (counter.readState(record)) {
+                    CString sName = counter.getName();
+                    eraseCounter(sName);
+                    addCounter(sName, counter);
+                }
+                break;
+            }
+            case RECORD_DELETE: {
+                eraseCounter(record.readString());
+                break;
+            }
+            case RECORD_RESET:
+            case RECORD_INCREMENT:
+            case RECORD_DECREMENT: {
+                CString sName = record.readString();
+                long long value = record.readInt();
+                std::time_t lastChange = (std::time_t) record.readInt();
+                CCounter* counter = record.isValid() ? findCounter(sName) : nullptr;
+                if (!counter) {
+                    break;
+                }
+                if (type == RECORD_RESET)
+                    counter->reset(value);
+                else if (type == RECORD_INCREMENT)
+                    counter->increment(value);
+                else
+                    counter->decrement(value);
+                counter->setLastChange(lastChange);
+                break;
+            }
+            case RECORD_SET: {
+                CString sName = record.readString();
+                CString sProperty = record.readString();
+                CString sValue = record.readString();
+                CCounter* counter = record.isValid() ? findCounter(sName) : nullptr;
+                if (counter) {
+                    setCounterProperty(*counter, sProperty, sValue);
+                }
+                break;
+            }
+            case RECORD_RENAME: {
+                CString sName = record.readString();
+                CString sNewName = record.readString();
+                if (record.isValid()) {
+                    renameCounter(sName, sNewName);
+                }
+                break;
+            }
+            case RECORD_LISTENER: {
+                CString sListenerName = record.readString();
+                CString sNickname = record.readString();
+                CString sNames = record.readString();
+                //counters of the snapshot are bound when they are materialized
+                CCounterListener listener = {sNickname, getListenerCounters(sNames), PERMISSION_DEFAULT, LLONG_MAX,
+                        "", "", {}};
+                listener.uPermissions = record.readUInt32();
+                listener.maxStep = record.readInt();
+                listener.sChannel = record.readString();
+                listener.sModes = record.readString();
+                if (record.isValid() && record.atEnd()) {
+                    //a listener written again has new properties
+                    m_listeners.insert(sListenerName, listener, true);
+                }
+                break;
+            }
+            case RECORD_DELETE_LISTENER: {
+                CString sListenerName = record.readString();
+                CString sNickname = record.readString();
+                CString sChannel = record.readString();
+                if (record.isValid()) {
+                    m_listeners.erase(sListenerName, sChannel, sNickname);
+                }
+                break;
+            }
+            case RECORD_BATCH: {
+                CString sRecords = record.readString();
+                if (record.isValid()) {
+                    replayRecords(sRecords);
+                }
+                break;
+            }
+        }
+    }
+    
+    /**
+     * Write the whole state in a new snapshot and empty the journal.
+     */
+    void writeSnapshot() {
+        //counters still in the mapped snapshot are copied without being materialized
+        std::vector<CCounter> unused;
+        unused.reserve(m_snapshot.size());
+        std::vector<CCounter*> counters;
+        counters.reserve(m_counters.size() + m_snapshot.size());
+        for (CCounterTable::SSlot& slot : m_counters.getSlots()) {
+            if (slot.bUsed) {
+                counters.push_back(&slot.counter);
+            }
+        }
+        for (unsigned int index = 0; unused.size() < m_snapshot.size(); index++) {
+            if (!m_snapshot.isTaken(index)) {
+                unused.push_back(m_snapshot.read(index));
+                counters.push_back(&unused.back());
+            }
+        }
+        std::sort(counters.begin(), counters.end(), [](CCounter* a, CCounter* b) {
+            return a->getName() < b->getName();
+        });
+        CString sListeners;
+        for (const CListenerIndex::STrigger& trigger : m_listeners.getTriggers()) {
+            for (const CCounterListener& listener : trigger.listeners) {
+                writeListener(sListeners, trigger.sTrigger, listener);
+            }
+        }
+        CString sSnapshot = CCounterSnapshot::build(m_journal.getGeneration() + 1, counters, sListeners);
+        if (!m_journal.writeSnapshot(sSnapshot)) {
+            PutModule("Unable to write the snapshot of counters.");
+        }
+        m_lastSnapshot = time(nullptr);
+    }
+    
+    
+    //MODULE'S HOOKS
+    virtual EModRet OnChanMsg(CNick& Nick, CChan& Channel, CString& sMessage) override {
+        //the trigger word is the first token, found without copying the line
+        const char* line = sMessage.c_str();
+        while (*line == ' ') {
+            line++;
+        }
+        if (!m_listeners.mayMatch((unsigned char) *line)) {
+            m_uLinesPrefiltered++;
+            return CONTINUE;
+        }
+        //most lines stop above, timing them would cost more than their filter
+        COUNTERS_LATENCY(PROBE_CHAN_MSG);
+        const char* end = line;
+        while (*end && *end != ' ') {
+            end++;
+        }
+        const CCounterListener* listener = m_listeners.match(Channel, Nick, line, end - line);
+        if (!listener) {
+            m_uLinesMissed++;
+            return CONTINUE;
+        }
+        m_uLinesMatched++;
+        //refused lines are only counted, without answer, so they can't be used to flood
+        if (!m_nickLimiter.allow(CCounterListener::foldNick(Nick.GetNick()), getMonotonicTime())) {
+            return CONTINUE;
+        }
+        const char* command = end;
+        while (*command == ' ') {
+            command++;
+        }
+        end = command;
+        while (*end && *end != ' ') {
+            end++;
+        }
+        if (!(CCounterListener::parsePermission(command, end - command) & listener->uPermissions)) {
+            m_uLinesRefused++;
+            return CONTINUE;
+        }
+        ECounterOperation operation = CCounterListener::parseOperation(command, end - command);
+        bool bHasValue = false;
+        long long step = 0;
+        if (operation != OPERATION_NONE) {
+            CCommandParser parser(end);
+            SToken value;
+            bHasValue = parser.next(value);
+            if (bHasValue && !parser.parseInt(value, step, "value")) {
+                m_uLinesRefused++;
+                return CONTINUE;
+            }
+        }
+        //a listener of several counters applies the command to each of them
+        for (const SListenerCounter& target : listener->counters) {
+            CCounter* pCounter = m_counters.get(target.handle);
+            if (!pCounter) {
+                pCounter = findCounter(target.sName);
+            }
+            if (!pCounter) {
+                continue;
+            }
+            if (operation == OPERATION_NONE) {
+                //other allowed commands go through the module's commands
+                OnModCommand(sMessage.Token(1) + " " + target.sName + " " + sMessage.Token(2, true));
+            }
+            else if (bHasValue && !listener->allowsValue(operation, step, pCounter->getInitial())) {
+                m_uLinesRefused++;
+            }
+            else {
+                executeOperation(target.sName, *pCounter, operation, bHasValue, step, true);
+            }
+        }
+        return CONTINUE;
+    }
+    
+    
+    //MODULE'S COMMANDS
+    //COUNTERS COMMANDS
+    /**
+     * Module command to create counter, parse sCommand.
+     * @param sCommand command written by user to parse
+     */
+    void createCounterCommand(const CString& sCommand) {
+        CCommandParser parser(sCommand);
+        parser.skip();
+        long long initial = DEFAULT_INITIAL;
+        long long step = DEFAULT_STEP;
+        int cooldown = DEFAULT_COOLDOWN;
+        int delay = DEFAULT_DELAY;
+        CString sMessage = DEFAULT_MESSAGE;
+        CString sName;
+        EScope scope = SCOPE_NETWORK;
+        struct SOption {
+            const char* sShort;
+            const char* sLong;
+            const char* sWhat;
+            long long* value; /**< nullptr for the message and the durations */
+            int* duration; /**< nullptr for the message and the numbers */
+        } options[] = {{"-i", "--initial", "initial", &initial, nullptr},
+                {"-s", "--step", "step", &step, nullptr},
+                {"-c", "--cooldown", "cooldown", nullptr, &cooldown},
+                {"-d", "--delay", "delay", nullptr, &delay},
+                {"-m", "--message", "message", nullptr, nullptr}};
+        SToken token;
+        while (parser.next(token)) {
+            const SOption* option = nullptr;
+            for (const SOption& candidate : options) {
+                if (token.equals(candidate.sShort) || token.equals(candidate.sLong)) {
+                    option = &candidate;
+                    break;
+                }
+            }
+            if (!option && token.equals("--scope")) {
+                SToken value;
+                if (!parser.expect(value, "scope after '--scope'")) {
+                    break;
+                }
+                if (!CCounter::parseScope(value.toString(), scope)) {
+                    parser.fail("Incorrect scope ! Possibles values are : network, user and global.");
+                    break;
+                }
+                continue;
+            }
+            if (!option) {
+                if (token.length > 1 && token.data[0] == '-') {
+                    parser.fail("Unknown option '" + token.toString() + "'.");
+                    break;
+                }
+                if (!sName.empty()) {
+                    parser.fail("Too many arguments, unexpected '" + token.toString() + "'.");
+                    break;
+                }
+                sName = token.toString();
+                continue;
+            }
+            SToken value;
+            if (!parser.next(value)) {
+                if (!parser.hasError()) {
+                    parser.fail("Missing " + CString(option->sWhat) + " after '" + token.toString() + "'.");
+                }
+                break;
+            }
+            if (option->value) {
+                if (!parser.parseInt(value, *option->value, option->sWhat)) {
+                    break;
+                }
+            }
+            else if (option->duration) {
+                if (!parser.parseDuration(value, *option->duration, option->sWhat)) {
+                    break;
+                }
+            }
+            else {
+                sMessage = value.length ? value.toString() : DEFAULT_MESSAGE;
+            }
+        }
+        if (parser.hasError()) {
+            PutModule("Error : " + parser.getError());
+            return;
+        }
+        createCounter(sName.empty() ? "counter" : sName, initial, step, cooldown, delay, sMessage, scope);
+    }
+    
+    void deleteCounterCommand(const CString& sCommand) {
+        CString sName;
+        if (!parseNameCommand(sCommand, sName)) {
+            return;
+        }
+        CCounter* counter = findCounter(sName);
+        if (counter) {
+            EScope scope = counter->getScope();
+            if (!checkScopeAccess(scope)) {
+                return;
+            }
+            if (getPendingAnnouncement(*counter) != CAnnouncementWheel::NONE) {
+                m_announcements.cancel(getPendingAnnouncement(*counter));
+                setPendingAnnouncement(*counter, CAnnouncementWheel::NONE);
+            }
+            if (scope != SCOPE_NETWORK) {
+                getScope(scope)->counters.erase(sName);
+                getScope(scope)->bDirty = true;
+            }
+            else {
+                eraseCounter(sName);
+                CRecordWriter(m_journal.getBuffer(), RECORD_DELETE).writeString(sName);
+            }
+            PutModule("Counter '" + sName + "' deleted.");
+        }
+        else {
+            PutModule("Counter " + sName + " not found.");
+        }
+    }
+    
+    /**
+     * Execute an operation on a counter and announce the change.\n
+     * If bHasValue, the operation uses value, otherwise it uses the default
+     * value from the counter for this operation.
+     * @param sName the name of the counter in m_counters
+     * @param counter the counter
+     * @param operation the operation to execute
+     * @param bHasValue if value is specified
+     * @param value the value for the operation
+     * @param bFromListener if the operation comes from a channel line, a rejected change is then not answered
+     */
+    void executeOperation(const CString& sName, CCounter& counter, ECounterOperation operation,
+            bool bHasValue, long long value, bool bFromListener = false) {
+        m_uOperations++;
+        if (operation == OPERATION_PRINT) {
+            putCounterMessage(&counter, counter.getNamedFormat(m_sRenderBuffer), PRIORITY_PRINT);
+            return;
+        }
+        if (!applyOperation(sName, counter, operation, bHasValue, value, getRecords(counter))) {
+            m_uOperationsRejected++;
+            //a refused change of a listener is only counted, so channel lines can't flood the owner
+            if (!bFromListener) {
+                PutModule("The value of counter '" + sName + "' would leave its limits, change rejected.");
+            }
+            return;
+        }
+        counter.publish();
+        announceChange(counter);
+    }
+    
+    /**
+     * Change the value of a counter and write the record of the change,
+     * without announcing it.
+     * @param sRecords where the record is written
+     * @return false if the change is rejected by the arithmetic mode of the counter
+     */
+    bool applyOperation(const CString& sName, CCounter& counter, ECounterOperation operation,
+            bool bHasValue, long long value, CString& sRecords) {
+        ERecordType type;
+        bool bApplied;
+        switch (operation) {
+            case OPERATION_RESET:
+                value = bHasValue ? value : counter.getInitial();
+                bApplied = counter.reset(value);
+                type = RECORD_RESET;
+                break;
+            case OPERATION_INCREMENT:
+                value = bHasValue ? value : counter.getStep();
+                bApplied = counter.increment(value);
+                type = RECORD_INCREMENT;
+                break;
+            case OPERATION_DECREMENT:
+                value = bHasValue ? value : counter.getStep();
+                bApplied = counter.decrement(value);
+                type = RECORD_DECREMENT;
+                break;
+            default:
+                return false;
+        }
+        if (!bApplied) {
+            return false;
+        }
+        //the history is kept in memory, so changes replayed at load are not added
+        if (type != RECORD_RESET) {
+            counter.recordHistory(type == RECORD_INCREMENT ? value : CCounter::subWrap(0, value));
+        }
+        CRecordWriter(sRecords, type).writeString(sName).writeInt(value).writeInt(counter.getLastChange());
+        return true;
+    }
+    
+    /**
+     * Execute a simple command (with the name of counter, and an optional second
+     * value) for a counter.
+     * @param sCommand command written by user
+     * @param operation the operation of the command
+     */
+    void executeSimpleCommand(const CString& sCommand, ECounterOperation operation) {
+        COUNTERS_LATENCY(PROBE_SIMPLE_COMMAND);
+        CCommandParser parser(sCommand);
+        SToken name;
+        SToken value;
+        long long step = 0;
+        bool bHasValue = false;
+        if (parser.skip().expect(name, "name of counter")) {
+            bHasValue = parser.next(value);
+            if ((!bHasValue || parser.parseInt(value, step, "value")) && parser.atEnd()) {
+                CString sName = name.toString();
+                CCounter* counter = findCounter(sName);
+                if (counter) {
+                    executeOperation(sName, *counter, operation, bHasValue, step);
+                }
+                else {
+                    PutModule("Counter " + sName + " not found.");
+                }
+                return;
+            }
+        }
+        PutModule("Error : " + parser.getError());
+    }
+    
+    /**
+     * Parse a command which only takes the name of a counter.
+     * @return false, after telling the error to the user, if the command is invalid
+     */
+    bool parseNameCommand(const CString& sCommand, CString& sName) {
+        CCommandParser parser(sCommand);
+        SToken name;
+        if (!parser.skip().expect(name, "name of counter") || !parser.atEnd()) {
+            PutModule("Error : " + parser.getError());
+            return false;
+        }
+        sName = name.toString();
+        return true;
+    }
+    
+    void resetCounterCommand(const CString& sCommand) {
+        executeSimpleCommand(sCommand, OPERATION_RESET);
+    }
+    
+    void incrementCounterCommand(const CString& sCommand) {
+        executeSimpleCommand(sCommand, OPERATION_INCREMENT);
+    }
+    
+    void decrementCounterCommand(const CString& sCommand) {
+        executeSimpleCommand(sCommand, OPERATION_DECREMENT);
+    }
+    
+    void printCounterCommand(const CString& sCommand) {
+        CString sName;
+        if (!parseNameCommand(sCommand, sName)) {
+            return;
+        }
+        CCounter* counter = findCounter(sName);
+        if (counter) {
+            putCounterMessage(counter, counter->getNamedFormat(m_sRenderBuffer), PRIORITY_PRINT);
+        }
+        else {
+            PutModule("Counter '" + sName + "' not found.");
+        }
+    }
+    
+    void infoCounterCommand(const CString& sCommand) {
+        CString sName;
+        if (!parseNameCommand(sCommand, sName)) {
+            return;
+        }
+        CCounter* counter = findCounter(sName);
+        if (counter) {
+            PutModule(counter->getInfosTable(GetUser()));
+        }
+        else {
+            PutModule("Counter " + sName + " not found.");
+        }
+    }
+    
+    void setPropertyCounterCommand(const CString& sCommand) {
+        CCommandParser parser(sCommand);
+        SToken name;
+        SToken property;
+        SToken value;
+        if (!parser.skip().expect(name, "name of counter") || !parser.expect(property, "property")
+                || !parser.expect(value, "value") || !parser.atEnd()) {
+            PutModule("Error : " + parser.getError());
+            return;
+        }
+        CString sName = name.toString();
+        CString sProperty = property.toString();
+        CString sValue = value.toString();
+        CCounter* counter = findCounter(sName);
+        if (counter && !checkScopeAccess(counter->getScope())) {
+            return;
+        }
+        if (counter && sProperty.Equals("SHARED")) {
+            if (!sValue.Equals("on") && !sValue.Equals("off")) {
+                PutModule("Incorrect shared ! Possibles values are : on and off.");
+                return;
+            }
+            if (counter->getScope() != SCOPE_NETWORK) {
+                PutModule("Counters of the user or global scope are already shared, only counters of the network can be.");
+                return;
+            }
+            CString sError = sValue.Equals("on") ? counter->checkShareable() : "";
+            if (!sError.empty()) {
+                PutModule(sError);
+                return;
+            }
+            shareCounter(sName, *counter, sValue.Equals("on"));
+            counter->writeState(m_journal.getBuffer());
+            PutModule("Property '" + sProperty + "' of counter '" + sName + 
+                    "' changed to '" + sValue + "' value.");
+        }
+        else if (counter && sProperty.Equals("NAME")) {
+            CString sError = renameCounter(sName, sValue);
+            if (!sError.empty()) {
+                PutModule(sError);
+                return;
+            }
+            CRecordWriter(m_journal.getBuffer(), RECORD_RENAME).writeString(sName).writeString(sValue);
+            PutModule("Counter '" + sName + "' renamed to '" + sValue + "'.");
+        }
+        else if (counter) {
+            CString sError = setCounterProperty(*counter, sProperty, sValue);
+            if (!sError.empty()) {
+                PutModule(sError);
+                return;
+            }
+            counter->publish();
+            CRecordWriter(getRecords(*counter), RECORD_SET).writeString(sName)
+                    .writeString(sProperty).writeString(sValue);
+            PutModule("Property '" + sProperty + "' of counter '" + sName + 
+                    "' changed to '" + sValue + "' value.");
+        }
+        else {
+            PutModule("Counter '" + sName + "' not found.");
+        }
     }
     
     /**
-     * Create a counter.
-     * @param sName the name of the counter
-     * @param initial the initial value of counter
-     * @param step the step by default to increment of decrement
-     * @param cooldown the cooldown between 2 increment or decrement
-     * @param delay the delay to write message on channel
-     * @param sMessage the message to write on channel when current value change
+     * Change a property of a counter.
+     * @return an error message, empty if the property is changed
      */
-    void createCounter(const CString& sName, const int initial,
-            const int step, const int cooldown, const int delay, const CString& sMessage) {
-        if (!m_counters.count(sName)) {
-            CCounter addCounter = CCounter(sName, initial, step, cooldown, delay, sMessage);
-            auto created = m_counters.insert(std::pair<CString, CCounter>(sName, addCounter));
-            if (created.second) {
-                PutModule("Counter '" + addCounter.getName() + "' created.");
+    CString setCounterProperty(CCounter& counter, const CString& sProperty, const CString& sValue) {
+        CCommandParser parser(sValue);
+        SToken value = SToken{sValue.data(), sValue.size()};
+        long long number;
+        int smallNumber;
+        if (sProperty.Equals("NAME"))
+            return "The name of a counter can only be changed alone, with the set command.";
+        else if (sProperty.Equals("INITIAL") || sProperty.Equals("STEP")) {
+            if (!parser.parseInt(value, number, sProperty.AsLower())) {
+                return parser.getError();
             }
+            if (sProperty.Equals("INITIAL"))
+                counter.setInitial(number);
+            else
+                counter.setStep(number);
         }
-        else {
-            PutModule("Counter '" + sName + "' already exists.");
+        else if (sProperty.Equals("COOLDOWN") || sProperty.Equals("DELAY")) {
+            if (!parser.parseDuration(value, smallNumber, sProperty.AsLower())) {
+                return parser.getError();
+            }
+            if (sProperty.Equals("COOLDOWN"))
+                counter.setCooldown(smallNumber);
+            else
+                counter.setDelay(smallNumber);
+        }
+        else if (sProperty.Equals("LOWER") || sProperty.Equals("UPPER")) {
+            bool bLower = sProperty.Equals("LOWER");
+            if (sValue.Equals("none"))
+                number = bLower ? LLONG_MIN : LLONG_MAX;
+            else if (!parser.parseInt(value, number, sProperty.AsLower() + " limit"))
+                return parser.getError();
+            else if (counter.isShared())
+                return "A shared counter can't have limits, they would only limit the part of this network.";
+            if (!counter.setLimits(bLower ? number : counter.getLowerLimit(), bLower ? counter.getUpperLimit() : number))
+                return "The lower limit must not be greater than the upper limit.";
+        }
+        else if (sProperty.Equals("EDGE")) {
+            if (!counter.setEdge(sValue))
+                return "Incorrect edge ! Possibles values are : leading, trailing and both.";
+        }
+        else if (sProperty.Equals("ARITHMETIC")) {
+            if (!counter.setArithmetic(sValue))
+                return "Incorrect arithmetic ! Possibles values are : saturate, wrap and reject.";
+        }
+        else if (sProperty.Equals("MESSAGE")) {
+            CMessageTemplate message(sValue);
+            if (counter.isShared() && (message.hasField(FIELD_MINIMUM_VALUE) || message.hasField(FIELD_MAXIMUM_VALUE)))
+                return "The message of a shared counter can't show {MINIMUM_VALUE} nor {MAXIMUM_VALUE}, "
+                        "they only know the part of this network.";
+            counter.setMessage(sValue);
+        }
+        else if (sProperty.Equals("COALESCE")) {
+            if (!counter.setCoalesce(sValue))
+                return "Incorrect coalesce ! Possibles values are : none, debounce and throttle.";
         }
+        else if (sProperty.Equals("TARGETS"))
+            counter.setTargets(sValue);
+        else if (sProperty.Equals("HISTORY")) {
+            if (!sValue.Equals("on") && !sValue.Equals("off"))
+                return "Incorrect history ! Possibles values are : on and off.";
+            counter.setHistory(sValue.Equals("on"));
+        }
+        else
+            return "Incorrect property ! Possibles properties are : name, initial, step, "
+                "cooldown, delay, edge, message, coalesce, targets, arithmetic, lower, upper, history and shared.";
+        return "";
     }
     
-    void createListener(const CString sName, const CString sNickname, const CString sListenerName) {
-        auto created = m_listeners.insert(std::make_pair(std::make_pair(sNickname,sListenerName),sName));
-        if (created.second) {
-            PutModule("Listener '" + sListenerName + "' for user '" + sNickname + 
-                    "' and counter '" + sName + "' created.");
+    void historyCounterCommand(const CString& sCommand) {
+        CString sName;
+        if (!parseNameCommand(sCommand, sName)) {
+            return;
+        }
+        CCounter* counter = findCounter(sName);
+        if (!counter) {
+            PutModule("Counter '" + sName + "' not found.");
+            return;
+        }
+        const CCounterHistory& history = counter->getHistory();
+        if (!history.isEnabled()) {
+            PutModule("History of counter '" + sName + "' is disabled, enable it with : set " + sName + " history on");
+            return;
         }
+        std::time_t now = time(nullptr);
+        CTable tableHistory = CTable();
+        tableHistory.AddColumn("Period");
+        tableHistory.AddColumn("Changes");
+        tableHistory.AddRow();
+        tableHistory.SetCell("Period","Last minute");
+        tableHistory.SetCell("Changes",CString(history.getLastMinute(now)));
+        tableHistory.AddRow();
+        tableHistory.SetCell("Period","Last hour");
+        tableHistory.SetCell("Changes",CString(history.getLastHour(now)));
+        tableHistory.AddRow();
+        tableHistory.SetCell("Period","Last 24 hours");
+        tableHistory.SetCell("Changes",CString(history.getLastDay(now)));
+        tableHistory.AddRow();
+        tableHistory.SetCell("Period","Today");
+        tableHistory.SetCell("Changes",CString(history.getToday(now)));
+        PutModule(tableHistory);
+        std::vector<CCounterHistory::SSample> samples = history.getSamples();
+        if (samples.empty()) {
+            return;
+        }
+        CTable tableSamples = CTable();
+        tableSamples.AddColumn("Time");
+        tableSamples.AddColumn("Change");
+        for (const CCounterHistory::SSample& sample : samples) {
+            tableSamples.AddRow();
+            tableSamples.SetCell("Time",CUtils::FormatTime(sample.time, "%Y/%m/%d %H:%M:%S", GetUser()->GetTimezone()));
+            tableSamples.SetCell("Change",CString(sample.delta));
+        }
+        PutModule(tableSamples);
     }
     
-    void deleteListener(const CString sNickname, const CString sListenerName) {
-        std::map<std::pair<CString,CString>,CString>::size_type removed = m_listeners.erase(std::make_pair(sNickname,sListenerName));
-        if (removed) {
-            PutModule("Listener '" + sListenerName + "' for user '" + sNickname + "' deleted.");
+    void listCountersCommand(const CString& sCommand) {
+        VCString vsNames;
+        vsNames.reserve(m_counters.size() + m_snapshot.size());
+        for (CCounterTable::SSlot& slot : m_counters.getSlots()) {
+            if (slot.bUsed) {
+                vsNames.push_back(slot.counter.getName());
+            }
         }
-        else {
-            PutModule("Listener '" + sListenerName + "' for user '" + sNickname + "' not found.");
+        for (unsigned int index = 0; vsNames.size() < m_counters.size() + m_snapshot.size(); index++) {
+            if (!m_snapshot.isTaken(index)) {
+                vsNames.push_back(m_snapshot.getName(index));
+            }
+        }
+        for (CCounterRegistry::SScope* pScope : {m_pUserScope, m_pGlobalScope}) {
+            if (!pScope) {
+                continue;
+            }
+            for (CCounterTable::SSlot& slot : pScope->counters.getSlots()) {
+                CString sName = slot.counter.getName();
+                //hidden by a counter of the network
+                if (slot.bUsed && !m_counters.find(sName) && m_snapshot.find(sName) == CCounterSnapshot::NONE
+                        && findScopedCounter(sName) == &slot.counter) {
+                    vsNames.push_back(sName + " (" + slot.counter.getScopeName() + ")");
+                }
+            }
+        }
+        std::sort(vsNames.begin(), vsNames.end());
+        CString sCounters = "Your counters : ";
+        for (VCString::const_iterator it = vsNames.cbegin(); it != vsNames.cend(); ++it) {
+            sCounters.append(*it);
+            if (it != std::prev(vsNames.cend())) {
+                sCounters.append(", ");
+            }
         }
+        PutModule(sCounters);
     }
     
-    //MODULE'S HOOKS
-    virtual EModRet OnChanMsg(CNick& Nick, CChan& Channel, CString& sMessage) override {
-        CString sListenerName = sMessage.Token(0);
-        CString sNickname = Nick.GetNick();
-        try {
-            CString sCounterName = m_listeners.at(std::make_pair(sNickname, sListenerName));
-            if (!sCounterName.empty()) {
-                try {
-                    CCounter counter = m_counters.at(sCounterName);
-                    CString sCommand = sMessage.Token(1);
-                    CString sArgs = sMessage.Token(2, true);
-                    OnModCommand(sCommand + " " + counter.getName() + " " + sArgs);
+    
+    //LISTENERS COMMANDS
+    void createListenerCommand(const CString& sCommand) {
+        CCommandParser parser(sCommand);
+        parser.skip();
+        CString sChannel;
+        CString sModes;
+        //names of counters, nickname and listener name
+        CString arguments[3];
+        unsigned int uArguments = 0;
+        SToken token;
+        while (parser.next(token)) {
+            if (token.equals("--channel") || token.equals("--mode")) {
+                SToken value;
+                if (!parser.expect(value, token.equals("--mode") ? "modes after '--mode'" : "channel after '--channel'")) {
+                    break;
                 }
-                catch (const std::out_of_range oor) {
-                    PutModule("Counter '" + sCounterName + "' not found.");
+                CString sPrefixes;
+                if (token.equals("--mode") && !CCounterListener::parseModes(value.toString(), sPrefixes)) {
+                    parser.fail("Incorrect modes ! Possibles modes are : q, a, o, h and v.");
+                    break;
                 }
+                (token.equals("--mode") ? sModes : sChannel) = value.toString();
+                continue;
+            }
+            if (token.length > 1 && token.data[0] == '-' && !uArguments) {
+                parser.fail("Unknown option '" + token.toString() + "'.");
+                break;
             }
+            if (uArguments == 3) {
+                parser.fail("Too many arguments, unexpected '" + token.toString() + "'.");
+                break;
+            }
+            arguments[uArguments++] = token.toString();
         }
-        catch (const std::out_of_range oor) {
-            
+        if (!parser.hasError() && !uArguments) {
+            parser.fail("Missing name of counter.");
         }
-        return CONTINUE;
+        if (parser.hasError()) {
+            PutModule("Error : " + parser.getError());
+            return;
+        }
+        //a listener can change several counters, separated by commas
+        VCString vsNames;
+        arguments[0].Split(",", vsNames, false);
+        for (const CString& sName : vsNames) {
+            if (!findCounter(sName)) {
+                PutModule("Counter '" + sName + "' not found.");
+                return;
+            }
+        }
+        if (vsNames.empty()) {
+            PutModule("Error : Missing name of counter.");
+            return;
+        }
+        CString sNames;
+        for (const CString& sName : vsNames) {
+            sNames += (sNames.empty() ? "" : ",") + sName;
+        }
+        CString sNickname = !arguments[1].empty() ? arguments[1] : GetUser()->GetNick();
+        CString sListenerName = !arguments[2].empty() ? arguments[2] : "!" + vsNames.front();
+        createListener(sNames, sNickname, sListenerName, sChannel, sModes);
     }
     
-    
-    //MODULE'S COMMANDS
-    //COUNTERS COMMANDS
     /**
-     * Module command to create counter, parse sCommand.
-     * @param sCommand command written by user to parse
+     * Parse the listener of a command : [--channel <channel>] <nickname> <listener_name>.
+     * @return false if an argument is missing
      */
-    void createCounterCommand(const CString& sCommand) {
-        VCString vsArgs;
-        sCommand.Split(" ", vsArgs, false, "\"", "\"", true, true);
-        std::vector<std::string> args = std::vector<std::string>();
-
-        for (const CString& arg : vsArgs) {
-            if (!arg.empty()) {
-                args.push_back((std::string)arg);
+    static bool parseListener(CCommandParser& parser, CString& sChannel, CString& sNickname, CString& sListenerName) {
+        SToken nickname;
+        SToken listener;
+        if (!parser.expect(nickname, "nickname")) {
+            return false;
+        }
+        if (nickname.equals("--channel")) {
+            SToken channel;
+            if (!parser.expect(channel, "channel after '--channel'") || !parser.expect(nickname, "nickname")) {
+                return false;
             }
+            sChannel = channel.toString();
         }
-        try {
-            m_parserCreate.parse(args);
+        if (!parser.expect(listener, "name of listener")) {
+            return false;
         }
-        catch (std::invalid_argument ex) {
-            PutModule("Error invalid argument : " + CString(ex.what()));
+        sNickname = nickname.toString();
+        sListenerName = listener.toString();
+        return true;
+    }
+    
+    void deleteListenerCommand(const CString& sCommand) {
+        CCommandParser parser(sCommand);
+        CString sChannel;
+        CString sNickname;
+        CString sListenerName;
+        if (!parseListener(parser.skip(), sChannel, sNickname, sListenerName) || !parser.atEnd()) {
+            PutModule("Error : " + parser.getError());
             return;
         }
-//        catch (std::bad_cast) {
-//            PutModule("error bad cast");
-//        }
-        //retrieve all arguments as strings because i get std::bad_cast with other typenames like int
-        CString sInitial = CString(m_parserCreate.retrieve<std::string>("initial"));
-        CString sStepValue = CString(m_parserCreate.retrieve<std::string>("step"));
-        CString sCooldownValue = CString(m_parserCreate.retrieve<std::string>("cooldown"));
-        CString sDelayValue = CString(m_parserCreate.retrieve<std::string>("delay"));
-        CString sMessage = CString(m_parserCreate.retrieve<std::string>("message"));
-        CString sName = CString(m_parserCreate.retrieve<std::string>("name"));
-        
-        createCounter(checkStringValue(sName,"counter"),convertWithDefaultValue(sInitial,DEFAULT_INITIAL),
-                convertWithDefaultValue(sStepValue,DEFAULT_STEP),convertWithDefaultValue(sCooldownValue,DEFAULT_COOLDOWN),
-                convertWithDefaultValue(sDelayValue,DEFAULT_DELAY),checkStringValue(sMessage,DEFAULT_MESSAGE));
-        m_parserCreate.clearVariables();
-//        MCString msRet;
-//        CString::size_type tokensNb4 = sCommand.OptionSplit(msRet);
-//        PutModule("Commande séparée en : " + CString(tokensNb4) + " chaines avec OptionSplit.");
-//        MCString::iterator itMap;
-//        for (itMap = msRet.begin(); itMap != msRet.end(); itMap++) {
-//            PutModule("clé : " + itMap->first + " , valeur : " + itMap->second);
-//        }
-        
+        deleteListener(sNickname, sListenerName, sChannel);
     }
     
-    void deleteCounterCommand(const CString& sCommand) {
-        CString sName = sCommand.Token(1);
-        std::map<CString,CCounter>::size_type erased = m_counters.erase(sName);
-        if (erased) {
-            PutModule("Counter '" + sName + "' deleted.");
+    void setListenerCommand(const CString& sCommand) {
+        CCommandParser parser(sCommand);
+        CString sChannel;
+        CString sNickname;
+        CString sListenerName;
+        SToken property;
+        SToken value;
+        if (!parseListener(parser.skip(), sChannel, sNickname, sListenerName)
+                || !parser.expect(property, "property") || !parser.expect(value, "value") || !parser.atEnd()) {
+            PutModule("Error : " + parser.getError());
+            return;
+        }
+        const CCounterListener* existing = m_listeners.findListener(sListenerName, sChannel, sNickname);
+        if (!existing) {
+            PutModule("Listener '" + sListenerName + "' for user '" + sNickname + "' not found"
+                    + (sChannel.empty() ? "" : " on " + sChannel) + ".");
+            return;
+        }
+        CCounterListener listener = *existing;
+        CString sValue = value.toString();
+        if (property.equals("commands")) {
+            unsigned int uPermissions;
+            if (!CCounterListener::parsePermissions(sValue, uPermissions)) {
+                PutModule("Incorrect commands ! Possibles commands, separated by commas, are : incr, decr, reset, "
+                        "print, info, history, set and delete, or all or none.");
+                return;
+            }
+            listener.uPermissions = uPermissions;
+        }
+        else if (property.equals("maxstep")) {
+            long long maxStep = LLONG_MAX;
+            if (!sValue.Equals("none") && !parser.parseInt(value, maxStep, "maximum step", 0)) {
+                PutModule("Error : " + parser.getError());
+                return;
+            }
+            listener.maxStep = maxStep;
+        }
+        else if (property.equals("channel")) {
+            listener.sChannel = sValue == "*" ? "" : sValue;
+        }
+        else if (property.equals("mode")) {
+            CString sPrefixes;
+            if (!sValue.Equals("none") && !CCounterListener::parseModes(sValue, sPrefixes)) {
+                PutModule("Incorrect modes ! Possibles modes are : q, a, o, h and v, or none.");
+                return;
+            }
+            listener.sModes = sValue.Equals("none") ? "" : sValue;
         }
         else {
-            PutModule("Counter " + sName + " not found.");
+            PutModule("Incorrect property ! Possibles properties are : commands, maxstep, channel and mode.");
+            return;
+        }
+        if (!listener.sChannel.Equals(sChannel)) {
+            //the listener moves to the listeners of its new channel
+            if (m_listeners.findListener(sListenerName, listener.sChannel, sNickname)) {
+                PutModule("Listener '" + sListenerName + "' for user '" + sNickname + "' already exists"
+                        + (listener.sChannel.empty() ? " for all channels." : " on " + listener.sChannel + "."));
+                return;
+            }
+            m_listeners.erase(sListenerName, sChannel, sNickname);
+            CRecordWriter(m_journal.getBuffer(), RECORD_DELETE_LISTENER).writeString(sListenerName)
+                    .writeString(sNickname).writeString(sChannel);
+        }
+        //the listener is compiled and indexed again
+        m_listeners.insert(sListenerName, listener, true);
+        writeListener(m_journal.getBuffer(), sListenerName, listener);
+        PutModule("Property '" + property.toString() + "' of listener '" + sListenerName + "' for user '"
+                + sNickname + "' changed to '" + sValue + "' value.");
+    }
+    
+    void listListenersCommand(const CString& sCommand) {
+        CString sListeners = "Your listeners : ";
+        bool first = true;
+        for (const CListenerIndex::STrigger& trigger : m_listeners.getTriggers()) {
+            for (const CCounterListener& listener : trigger.listeners) {
+                if (!first) {
+                    sListeners.append(", ");
+                }
+                sListeners.append(trigger.sTrigger + " for user " + listener.sNickname + " and counter "
+                        + listener.getCounterNames());
+                if (!listener.sChannel.empty()) {
+                    sListeners.append(" on " + listener.sChannel);
+                }
+                if (!listener.sModes.empty()) {
+                    sListeners.append(" with mode " + listener.sModes);
+                }
+                if (listener.uPermissions != PERMISSION_DEFAULT || listener.maxStep != LLONG_MAX) {
+                    sListeners.append(" (commands " + CCounterListener::getPermissionsString(listener.uPermissions)
+                            + ", maximum step " + CCounter::getLimitString(listener.maxStep, LLONG_MAX) + ")");
+                }
+                first = false;
+            }
         }
+        PutModule(sListeners);
     }
     
+    
+    //BATCH COMMANDS
     /**
-     * Execute a simple command (with the name of counter, and an optional second
-     * value) for a counter.\n
-     * If second value is specified, execute first function as argument with value.\n
-     * If second value is not specified, execute function that doesn't require value
-     * (use default value from the counter for this command).
-     * @param sCommand command written by user
-     * @param execute function to execute with value
-     * @param executeWithDefault function to execute without value
-     */
-    void executeSimpleCommand(const CString& sCommand, std::function<void(CCounter&,int)> execute,
-    std::function<void(CCounter&)> executeWithDefault) {
-        CString sName = sCommand.Token(1);
-        CString sStep = sCommand.Token(2);
-        if (!sName.empty()) {
-            try {
-                CCounter& counter = m_counters.at(sName);
-                if (sStep.empty()) {
-                    executeWithDefault(counter);
+     * Apply operations separated by ';' or new lines, all or none. The
+     * operations change copies of the counters which replace them once all
+     * succeeded, then each counter whose value changed is announced once.
+     * @param uOperations receives the number of operations applied
+     * @return an error message, empty if the batch is applied
+     */
+    CString executeBatch(const CString& sBatch, size_t& uOperations) {
+        struct SBatchCounter {
+            CCounter counter;
+            bool bChanged;
+        };
+        std::map<CString, SBatchCounter> counters;
+        CString sRecords;
+        CString sScopeRecords; /**< Records of counters of other scopes, not journaled. */
+        uOperations = 0;
+        size_t uStart = 0;
+        bool bQuoted = false;
+        for (size_t i = 0; i <= sBatch.size(); i++) {
+            char c = i < sBatch.size() ? sBatch[i] : ';';
+            if (c == '"') {
+                bQuoted = !bQuoted;
+            }
+            if ((c != ';' && c != '\n') || (bQuoted && i < sBatch.size())) {
+                continue;
+            }
+            CString sOperation = CString(sBatch.substr(uStart, i - uStart)).Trim_n();
+            uStart = i + 1;
+            if (sOperation.empty()) {
+                continue;
+            }
+            CCommandParser parser(sOperation);
+            SToken command;
+            SToken name;
+            parser.next(command);
+            ECounterOperation operation = CCounterListener::parseOperation(command.data, command.length);
+            if (operation == OPERATION_PRINT || (operation == OPERATION_NONE && !command.equals("set"))) {
+                return "Error in operation " + CString(uOperations + 1) + " : Unknown operation '"
+                        + command.toString() + "', possibles operations are : incr, decr, reset and set.";
+            }
+            if (!parser.expect(name, "name of counter")) {
+                return "Error in operation " + CString(uOperations + 1) + " : " + parser.getError();
+            }
+            CString sName = name.toString();
+            auto it = counters.find(sName);
+            if (it == counters.end()) {
+                CCounter* counter = findCounter(sName);
+                if (!counter) {
+                    return "Error in operation " + CString(uOperations + 1) + " : Counter '" + sName + "' not found.";
                 }
-                else {
-                    execute(counter, sStep.ToInt());
+                if (operation == OPERATION_NONE && counter->getScope() == SCOPE_GLOBAL && !GetUser()->IsAdmin()) {
+                    return "Error in operation " + CString(uOperations + 1) + " : Only admins can change global counters.";
                 }
-                if (!counter.hasActiveCooldown()) {
-#ifdef HAVE_PTHREAD
-                    AddJob(new CCounterJob(this, counter));
-#else
-                    CString formattedMessage = counter.getNamedFormat();
-                    PutModule(formattedMessage);
-                    CIRCNetwork *network = GetNetwork();
-                    std::vector<CChan*> channels = network->GetChans();
-                    for (CChan* channel : channels) {
-                        PutIRC("PRIVMSG " + channel->GetName() + " :" + formattedMessage);
-                    }
-#endif
+                it = counters.insert(std::make_pair(sName, SBatchCounter{*counter, false})).first;
+            }
+            CString& sOperationRecords = it->second.counter.getScope() == SCOPE_NETWORK ? sRecords : sScopeRecords;
+            if (operation == OPERATION_NONE) {
+                SToken property;
+                SToken value;
+                if (!parser.expect(property, "property") || !parser.expect(value, "value") || !parser.atEnd()) {
+                    return "Error in operation " + CString(uOperations + 1) + " : " + parser.getError();
+                }
+                CString sError = setCounterProperty(it->second.counter, property.toString(), value.toString());
+                if (!sError.empty()) {
+                    return "Error in operation " + CString(uOperations + 1) + " : " + sError;
+                }
+                CRecordWriter(sOperationRecords, RECORD_SET).writeString(sName).writeString(property.toString())
+                        .writeString(value.toString());
+            }
+            else {
+                SToken value;
+                long long step = 0;
+                bool bHasValue = parser.next(value);
+                if ((bHasValue && !parser.parseInt(value, step, "value")) || !parser.atEnd()) {
+                    return "Error in operation " + CString(uOperations + 1) + " : " + parser.getError();
+                }
+                if (!applyOperation(sName, it->second.counter, operation, bHasValue, step, sOperationRecords)) {
+                    return "Error in operation " + CString(uOperations + 1) + " : the value of counter '"
+                            + sName + "' would leave its limits.";
                 }
+                it->second.bChanged = true;
+            }
+            uOperations++;
+        }
+        for (auto& it : counters) {
+            CCounter* counter = findCounter(it.first);
+            *counter = it.second.counter;
+            counter->publish();
+            if (counter->getScope() != SCOPE_NETWORK) {
+                getScope(counter->getScope())->bDirty = true;
             }
-            catch (const std::out_of_range oor) {
-                PutModule("Counter " + sName + " not found.");
+            if (it.second.bChanged) {
+                announceChange(*counter);
             }
         }
+        if (!sRecords.empty()) {
+            CRecordWriter(m_journal.getBuffer(), RECORD_BATCH).writeString(sRecords);
+        }
+        return "";
     }
     
-    void resetCounterCommand(const CString& sCommand) {
-        executeSimpleCommand(sCommand,&CCounter::reset,&CCounter::resetDefault);
+    void batchCommand(const CString& sCommand) {
+        size_t uOperations;
+        CString sError = executeBatch(sCommand.Token(1, true), uOperations);
+        if (!sError.empty()) {
+            PutModule(sError + " No operation applied.");
+            return;
+        }
+        PutModule(CString(uOperations) + " operations applied.");
     }
     
-    void incrementCounterCommand(const CString& sCommand) {
-        executeSimpleCommand(sCommand,&CCounter::increment,&CCounter::incrementDefault);
+    /**
+     * Apply the operations of a file of the module's directory as a batch,
+     * one or more operations by line.
+     */
+    void importCommand(const CString& sCommand) {
+        CCommandParser parser(sCommand);
+        SToken file;
+        if (!parser.skip().expect(file, "name of file") || !parser.atEnd()) {
+            PutModule("Error : " + parser.getError());
+            return;
+        }
+        CString sFile = file.toString();
+        if (sFile.find('/') != CString::npos || sFile[0] == '.') {
+            PutModule("Error : the file must be in the directory of the module, without path.");
+            return;
+        }
+        int fd = ::open((GetSavePath() + "/" + sFile).c_str(), O_RDONLY);
+        if (fd < 0) {
+            PutModule("Unable to open '" + sFile + "' : " + CString(strerror(errno)) + ".");
+            return;
+        }
+        CString sBatch;
+        char buffer[65536];
+        ssize_t length;
+        while ((length = ::read(fd, buffer, sizeof(buffer))) > 0 && sBatch.size() <= MAX_IMPORT_SIZE) {
+            sBatch.append(buffer, length);
+        }
+        ::close(fd);
+        if (length < 0 || sBatch.size() > MAX_IMPORT_SIZE) {
+            PutModule("Unable to read '" + sFile + "', it must be smaller than " + CString(MAX_IMPORT_SIZE) + " bytes.");
+            return;
+        }
+        size_t uOperations;
+        CString sError = executeBatch(sBatch, uOperations);
+        if (!sError.empty()) {
+            PutModule(sError + " No operation applied.");
+            return;
+        }
+        PutModule(CString(uOperations) + " operations imported from '" + sFile + "'.");
     }
     
-    void decrementCounterCommand(const CString& sCommand) {
-        executeSimpleCommand(sCommand,&CCounter::decrement,&CCounter::decrementDefault);
-    }
     
-    void printCounterCommand(const CString& sCommand) {
-        CString sName = sCommand.Token(1);
-        try {
-            CCounter& counter = m_counters.at(sName);
-            CString formattedMessage = counter.getNamedFormat();
-            CIRCNetwork* network = GetNetwork();
-            std::vector<CChan*> channels = network->GetChans();
-            for (CChan* channel : channels) {
-                PutIRC("PRIVMSG " + channel->GetName() + " :" + formattedMessage);
+    //OTHER COMMANDS
+    void statsCommand(const CString& sCommand) {
+        CCommandParser parser(sCommand);
+        SToken action;
+        if (parser.skip().next(action)) {
+            if (!action.equals("reset") || !parser.atEnd()) {
+                PutModule("Usage : stats [reset]");
+                return;
             }
+#ifdef COUNTERS_STATS
+            CLatencyHistograms::reset();
+            PutModule("Latencies reset.");
+#else
+            PutModule("Latencies are not measured, the module is built without COUNTERS_STATS.");
+#endif
+            return;
         }
-        catch (const std::out_of_range oor) {
-            PutModule("Counter '" + sName + "' not found.");
+        else if (parser.hasError()) {
+            PutModule("Error : " + parser.getError());
+            return;
         }
+        CTable tableStats = CTable();
+        tableStats.AddColumn("Statistic");
+        tableStats.AddColumn("Value");
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Counters");
+        tableStats.SetCell("Value",CString(m_counters.size() + m_snapshot.size()));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Counters not loaded from snapshot");
+        tableStats.SetCell("Value",CString(m_snapshot.size()));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Counters of the user");
+        tableStats.SetCell("Value",CString(m_pUserScope ? m_pUserScope->counters.size() : 0));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Global counters");
+        tableStats.SetCell("Value",CString(m_pGlobalScope ? m_pGlobalScope->counters.size() : 0));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Listeners");
+        tableStats.SetCell("Value",CString(m_listeners.size()));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines filtered by first byte");
+        tableStats.SetCell("Value",CString(m_uLinesPrefiltered));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines missed in listeners");
+        tableStats.SetCell("Value",CString(m_uLinesMissed));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines matched");
+        tableStats.SetCell("Value",CString(m_uLinesMatched));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines refused, command or value not allowed");
+        tableStats.SetCell("Value",CString(m_uLinesRefused));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines refused, nickname rate limit");
+        tableStats.SetCell("Value",CString(m_nickLimiter.uLimited));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Nicknames rate limited (evicted)");
+        tableStats.SetCell("Value",CString(m_nickLimiter.size()) + " (" + CString(m_nickLimiter.uEvicted) + ")");
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Operations on counters");
+        tableStats.SetCell("Value",CString(m_uOperations));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Operations rejected by limits");
+        tableStats.SetCell("Value",CString(m_uOperationsRejected));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Announcements");
+        tableStats.SetCell("Value",CString(m_uAnnouncements));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Changes held by cooldown");
+        tableStats.SetCell("Value",CString(m_uChangesInCooldown));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Delayed announcements");
+        tableStats.SetCell("Value",CString(m_announcements.size()));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Queued lines");
+        tableStats.SetCell("Value",CString(m_queue.size()));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Maximum queued lines");
+        tableStats.SetCell("Value",CString(m_queue.uMaxDepthReached));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines sent");
+        tableStats.SetCell("Value",CString(m_queue.uSent));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines merged in queue");
+        tableStats.SetCell("Value",CString(m_queue.uMerged));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines dropped, queue full");
+        tableStats.SetCell("Value",CString(m_queue.uDroppedFull));
+        tableStats.AddRow();
+        tableStats.SetCell("Statistic","Lines dropped, too old");
+        tableStats.SetCell("Value",CString(m_queue.uDroppedStale));
+        PutModule(tableStats);
+#ifdef COUNTERS_STATS
+        putLatencies();
+#endif
     }
     
-    void infoCounterCommand(const CString& sCommand) {
-        CString sName = sCommand.Token(1);
-        try {
-            CCounter& counter = m_counters.at(sName);
-            PutModule(counter.getInfosTable(GetUser()));
-        }
-        catch (const std::out_of_range oor) {
-            PutModule("Counter " + sName + " not found.");
+#ifdef COUNTERS_STATS
+    /**
+     * Show the latencies of the hot paths in the current window. They are
+     * measured for all networks, as the hot paths share the main loop of ZNC.
+     */
+    void putLatencies() {
+        static const char* const names[PROBE_COUNT] = {"Channel line", "Simple command", "Format message", "Send line"};
+        CTable tableLatencies = CTable();
+        tableLatencies.AddColumn("Path");
+        tableLatencies.AddColumn("Calls");
+        tableLatencies.AddColumn("p50 (ns)");
+        tableLatencies.AddColumn("p99 (ns)");
+        tableLatencies.AddColumn("Max (ns)");
+        for (unsigned int probe = 0; probe < PROBE_COUNT; probe++) {
+            CLatencyHistograms::SSummary summary = CLatencyHistograms::summarize((EProbe) probe);
+            tableLatencies.AddRow();
+            tableLatencies.SetCell("Path",names[probe]);
+            tableLatencies.SetCell("Calls",CString(summary.uCount));
+            tableLatencies.SetCell("p50 (ns)",CString(summary.uP50));
+            tableLatencies.SetCell("p99 (ns)",CString(summary.uP99));
+            tableLatencies.SetCell("Max (ns)",CString(summary.uMax));
         }
+        PutModule(tableLatencies);
+        PutModule("Latencies of all networks over the last " + CString(CLatencyHistograms::getWindowDuration() / 1000)
+                + " seconds, to start again : stats reset");
     }
+#endif
     
-    //TODO : to improve or change because it's possible to change counter's name
-    //but this doesn't change used name in the map m_counters
-    void setPropertyCounterCommand(const CString& sCommand) {
-        VCString vsArgs;
-        sCommand.Split(" ", vsArgs, false, "\"", "\"", true, true);
-        try {
-            CString sName = vsArgs.at(1);
-            CString sProperty = vsArgs.at(2);
-            CString sValue = vsArgs.at(3);
-            try {
-                CCounter& counter = m_counters.at(sName);
-                if (sProperty.Equals("NAME"))
-                    counter.setName(sValue);
-                else if (sProperty.Equals("INITIAL"))
-                    counter.setInitial(convertWithDefaultValue(sValue, 0));
-                else if (sProperty.Equals("STEP"))
-                    counter.setStep(convertWithDefaultValue(sValue, 1));
-                else if (sProperty.Equals("COOLDOWN"))
-                    counter.setCooldown(convertWithDefaultValue(sValue, 0));
-                else if (sProperty.Equals("DELAY"))
-                    counter.setDelay(convertWithDefaultValue(sValue, 0));
-                else if (sProperty.Equals("MESSAGE"))
-                    counter.setMessage(sValue);
-                else
-                    PutModule("Incorrect property ! Possibles properties are : name, "
-                        "initial, step, cooldown, delay and message.");
-                
-                PutModule("Property '" + sProperty + "' of counter '" + sName + 
-                        "' changed to '" + sValue + "' value.");
+    /**
+     * Call visit for each counter of the network, then of the user and global
+     * scopes. The counters of the snapshot are read without being materialized.
+     */
+    void forEachCounter(const std::function<void(CCounter&)>& visit) {
+        for (CCounterTable::SSlot& slot : m_counters.getSlots()) {
+            if (slot.bUsed) {
+                visit(slot.counter);
             }
-            catch (const std::out_of_range oor) {
-                PutModule("Counter '" + sName + "' not found.");
+        }
+        size_t uRead = 0;
+        for (unsigned int index = 0; uRead < m_snapshot.size(); index++) {
+            if (!m_snapshot.isTaken(index)) {
+                CCounter counter = m_snapshot.read(index);
+                visit(counter);
+                uRead++;
             }
         }
-        catch (const std::out_of_range oor) {
-            PutModule("Too few arguments.");
+        for (CCounterRegistry::SScope* pScope : {m_pUserScope, m_pGlobalScope}) {
+            if (pScope) {
+                for (CCounterTable::SSlot& slot : pScope->counters.getSlots()) {
+                    if (slot.bUsed) {
+                        visit(slot.counter);
+                    }
+                }
+            }
         }
     }
     
-    void listCountersCommand(const CString& sCommand) {
-        CString sCounters = "Your counters : ";
-        for (std::map<CString,CCounter>::const_iterator it = m_counters.cbegin(); it != m_counters.cend(); ++it) {
-            sCounters.append(it->first);
-            if (it != std::prev(m_counters.cend())) {
-                sCounters.append(", ");
+    /**
+     * Write the values of all counters and the statistics of the module, the
+     * same as the "stats" command.
+     */
+    void writeMetrics(CMetricsWriter& writer) {
+        writer.family("znc_counters_value", "gauge", "Current value of the counter, of all networks if it is shared.");
+        forEachCounter([&writer](CCounter& counter) {
+            writer.sample("znc_counters_value").label("counter", counter.getName())
+                    .label("scope", counter.getScopeName()).value(counter.getValues().current);
+        });
+        writer.family("znc_counters_minimum", "gauge", "Minimum value reached by the counter.");
+        //a shared counter doesn't track its minimum and maximum
+        forEachCounter([&writer](CCounter& counter) {
+            if (counter.isShared()) {
+                return;
+            }
+            writer.sample("znc_counters_minimum").label("counter", counter.getName())
+                    .label("scope", counter.getScopeName()).value(counter.getMinimumValue());
+        });
+        writer.family("znc_counters_maximum", "gauge", "Maximum value reached by the counter.");
+        forEachCounter([&writer](CCounter& counter) {
+            if (counter.isShared()) {
+                return;
             }
+            writer.sample("znc_counters_maximum").label("counter", counter.getName())
+                    .label("scope", counter.getScopeName()).value(counter.getMaximumValue());
+        });
+        writer.family("znc_counters_counters", "gauge", "Counters by scope.");
+        writer.sample("znc_counters_counters").label("scope", "network").value(m_counters.size() + m_snapshot.size());
+        writer.sample("znc_counters_counters").label("scope", "user")
+                .value(m_pUserScope ? m_pUserScope->counters.size() : 0);
+        writer.sample("znc_counters_counters").label("scope", "global")
+                .value(m_pGlobalScope ? m_pGlobalScope->counters.size() : 0);
+        writer.family("znc_counters_listeners", "gauge", "Listeners of the network.");
+        writer.sample("znc_counters_listeners").value(m_listeners.size());
+        writer.family("znc_counters_lines", "counter", "Channel lines checked for a listener, by result.");
+        writer.sample("znc_counters_lines_total").label("result", "prefiltered").value(m_uLinesPrefiltered);
+        writer.sample("znc_counters_lines_total").label("result", "missed").value(m_uLinesMissed);
+        writer.sample("znc_counters_lines_total").label("result", "matched").value(m_uLinesMatched);
+        writer.family("znc_counters_lines_refused", "counter", "Matched lines ignored, by reason.");
+        writer.sample("znc_counters_lines_refused_total").label("reason", "permission").value(m_uLinesRefused);
+        writer.sample("znc_counters_lines_refused_total").label("reason", "rate_limit").value(m_nickLimiter.uLimited);
+        writer.family("znc_counters_nicknames", "gauge", "Nicknames tracked by the rate limit of listeners.");
+        writer.sample("znc_counters_nicknames").value(m_nickLimiter.size());
+        writer.family("znc_counters_operations", "counter", "Operations executed on counters by commands and listeners.");
+        writer.sample("znc_counters_operations_total").value(m_uOperations);
+        writer.family("znc_counters_operations_rejected", "counter", "Operations rejected by the limits of their counter.");
+        writer.sample("znc_counters_operations_rejected_total").value(m_uOperationsRejected);
+        writer.family("znc_counters_announcements", "counter", "Messages of changes, sent or delayed.");
+        writer.sample("znc_counters_announcements_total").value(m_uAnnouncements);
+        writer.family("znc_counters_cooldown_changes", "counter", "Changes not announced at once because of a cooldown.");
+        writer.sample("znc_counters_cooldown_changes_total").value(m_uChangesInCooldown);
+        writer.family("znc_counters_delayed_announcements", "gauge", "Messages and ends of cooldowns waiting in the timer wheel.");
+        writer.sample("znc_counters_delayed_announcements").value(m_announcements.size());
+        writer.family("znc_counters_queue_depth", "gauge", "Lines waiting in the outbound queue.");
+        writer.sample("znc_counters_queue_depth").value(m_queue.size());
+        writer.family("znc_counters_queue_max_depth", "gauge", "Maximum number of lines reached by the outbound queue.");
+        writer.sample("znc_counters_queue_max_depth").value(m_queue.uMaxDepthReached);
+        writer.family("znc_counters_queue_lines", "counter", "Lines of the outbound queue, by result.");
+        writer.sample("znc_counters_queue_lines_total").label("result", "sent").value(m_queue.uSent);
+        writer.sample("znc_counters_queue_lines_total").label("result", "merged").value(m_queue.uMerged);
+        writer.sample("znc_counters_queue_lines_total").label("result", "dropped_full").value(m_queue.uDroppedFull);
+        writer.sample("znc_counters_queue_lines_total").label("result", "dropped_stale").value(m_queue.uDroppedStale);
+#ifdef COUNTERS_STATS
+        static const char* const paths[PROBE_COUNT] = {"chan_msg", "simple_command", "format", "put_irc"};
+        CLatencyHistograms::SSummary summaries[PROBE_COUNT];
+        for (unsigned int probe = 0; probe < PROBE_COUNT; probe++) {
+            summaries[probe] = CLatencyHistograms::summarize((EProbe) probe);
         }
-        PutModule(sCounters);
+        writer.family("znc_counters_latency_nanoseconds", "summary", "Latency of the hot paths of all networks, "
+                "since the last reset of the stats command.");
+        for (unsigned int probe = 0; probe < PROBE_COUNT; probe++) {
+            writer.sample("znc_counters_latency_nanoseconds").label("path", paths[probe]).label("quantile", "0.5")
+                    .value(summaries[probe].uP50);
+            writer.sample("znc_counters_latency_nanoseconds").label("path", paths[probe]).label("quantile", "0.99")
+                    .value(summaries[probe].uP99);
+            writer.sample("znc_counters_latency_nanoseconds_count").label("path", paths[probe])
+                    .value(summaries[probe].uCount);
+            writer.sample("znc_counters_latency_nanoseconds_sum").label("path", paths[probe])
+                    .value(summaries[probe].uSum);
+        }
+        writer.family("znc_counters_latency_max_nanoseconds", "gauge", "Maximum latency of the hot paths of all "
+                "networks, since the last reset of the stats command.");
+        for (unsigned int probe = 0; probe < PROBE_COUNT; probe++) {
+            writer.sample("znc_counters_latency_max_nanoseconds").label("path", paths[probe])
+                    .value(summaries[probe].uMax);
+        }
+#endif
+        writer.finish();
     }
     
-    
-    //LISTENERS COMMANDS
-    void createListenerCommand(const CString& sCommand) {
-        CString sName = sCommand.Token(1);
-        if (m_counters.count(sName)) {
-            CString sNickname = sCommand.Token(2);
-            CString sListenerName = sCommand.Token(3);
-            if (sNickname.empty()) {
-                sNickname = GetUser()->GetNick();
-            }
-            if (sListenerName.empty()) {
-                sListenerName = "!" + sName;
+    /**
+     * Read the settings of the outbound queue saved by the "Queue" command.
+     */
+    void loadQueueSettings() {
+        for (const char* sSetting : {"burst", "rate", "targetburst", "targetrate", "maxdepth", "maxage",
+                "nickburst", "nickrate"}) {
+            CString sValue = GetNV(CString("queue_") + sSetting);
+            if (!sValue.empty()) {
+                setQueueSetting(sSetting, sValue);
             }
-            createListener(sName, sNickname, sListenerName);
-        }
-        else {
-            PutModule("Counter '" + sName + "' not found.");
         }
     }
     
-    void deleteListenerCommand(const CString& sCommand) {
-        CString sNickname = sCommand.Token(1);
-        CString sListenerName = sCommand.Token(2);
-        deleteListener(sNickname, sListenerName);
+    /**
+     * Change a setting of the outbound queue.
+     * @return an error message, empty if the setting is changed
+     */
+    CString setQueueSetting(const CString& sSetting, const CString& sValue) {
+        CCommandParser parser(sValue);
+        double value;
+        if (!parser.parseDouble(SToken{sValue.data(), sValue.size()}, value, sSetting.AsLower())) {
+            return parser.getError();
+        }
+        if (value <= 0)
+            return "The value of '" + sSetting.AsLower() + "' must be positive.";
+        if (sSetting.Equals("burst"))
+            m_queue.dBurst = value;
+        else if (sSetting.Equals("rate"))
+            m_queue.dRate = value;
+        else if (sSetting.Equals("targetburst"))
+            m_queue.dTargetBurst = value;
+        else if (sSetting.Equals("targetrate"))
+            m_queue.dTargetRate = value;
+        else if (sSetting.Equals("maxdepth"))
+            m_queue.uMaxDepth = (size_t) value;
+        else if (sSetting.Equals("maxage"))
+            m_queue.dMaxAge = value;
+        else if (sSetting.Equals("nickburst"))
+            m_nickLimiter.dBurst = value;
+        else if (sSetting.Equals("nickrate"))
+            m_nickLimiter.dRate = value;
+        else
+            return "Incorrect setting ! Possibles settings are : burst, rate, "
+                "targetburst, targetrate, maxdepth, maxage, nickburst and nickrate.";
+        return "";
     }
     
-    void listListenersCommand(const CString& sCommand) {
-        CString sListeners = "Your listeners : ";
-        for (std::map<std::pair<CString,CString>,CString>::const_iterator it = m_listeners.cbegin(); it != m_listeners.cend(); ++it) {
-            sListeners.append(it->first.second + " for user " + it->first.first + " and counter " + it->second);
-            if (it != std::prev(m_listeners.cend())) {
-                sListeners.append(", ");
+    void queueCommand(const CString& sCommand) {
+        CCommandParser parser(sCommand);
+        SToken setting;
+        SToken value;
+        if (parser.skip().next(setting)) {
+            if (!parser.expect(value, "value of setting") || !parser.atEnd()) {
+                PutModule("Error : " + parser.getError());
+                return;
+            }
+            CString sSetting = setting.toString();
+            CString sValue = value.toString();
+            CString sError = setQueueSetting(sSetting, sValue);
+            if (!sError.empty()) {
+                PutModule(sError);
+                return;
             }
+            SetNV("queue_" + sSetting.AsLower(), sValue);
         }
-        PutModule(sListeners);
+        else if (parser.hasError()) {
+            PutModule("Error : " + parser.getError());
+            return;
+        }
+        CTable tableQueue = CTable();
+        tableQueue.AddColumn("Setting");
+        tableQueue.AddColumn("Value");
+        tableQueue.AddRow();
+        tableQueue.SetCell("Setting","Burst (lines)");
+        tableQueue.SetCell("Value",CString(m_queue.dBurst));
+        tableQueue.AddRow();
+        tableQueue.SetCell("Setting","Rate (lines per second)");
+        tableQueue.SetCell("Value",CString(m_queue.dRate));
+        tableQueue.AddRow();
+        tableQueue.SetCell("Setting","Target burst (lines)");
+        tableQueue.SetCell("Value",CString(m_queue.dTargetBurst));
+        tableQueue.AddRow();
+        tableQueue.SetCell("Setting","Target rate (lines per second)");
+        tableQueue.SetCell("Value",CString(m_queue.dTargetRate));
+        tableQueue.AddRow();
+        tableQueue.SetCell("Setting","Maximum depth (lines)");
+        tableQueue.SetCell("Value",CString(m_queue.uMaxDepth));
+        tableQueue.AddRow();
+        tableQueue.SetCell("Setting","Maximum age (seconds)");
+        tableQueue.SetCell("Value",CString(m_queue.dMaxAge));
+        tableQueue.AddRow();
+        tableQueue.SetCell("Setting","Nickname burst (lines)");
+        tableQueue.SetCell("Value",CString(m_nickLimiter.dBurst));
+        tableQueue.AddRow();
+        tableQueue.SetCell("Setting","Nickname rate (lines per second)");
+        tableQueue.SetCell("Value",CString(m_nickLimiter.dRate));
+        PutModule(tableQueue);
     }
     
     
 public:
     MODCONSTRUCTOR(CCountersMod) {
-        //create ArgumentParser to parse arguments for the command that create a counter
-        m_parserCreate = ArgumentParser();
-        m_parserCreate.useExceptions(true);
-        m_parserCreate.ignoreFirstArgument(true);
-        m_parserCreate.addArgument("-i", "--initial", 1, true);
-        m_parserCreate.addArgument("-s", "--step", 1, true);
-        m_parserCreate.addArgument("-c", "--cooldown", 1, true);
-        m_parserCreate.addArgument("-d", "--delay", 1, true);
-        m_parserCreate.addArgument("-m", "--message", 1, true);
-        m_parserCreate.addFinalArgument("name", 1, false);
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("NAME", ""));
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("INITIAL", ""));
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("STEP", ""));
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("COOLDOWN", ""));
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("DELAY", ""));
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("PREVIOUS_VALUE", ""));
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("CURRENT_VALUE", ""));
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("MINIMUM_VALUE", ""));
-        MyMap::getInstance().insert(std::make_pair<CString, CString>("MAXIMUM_VALUE", ""));
+        m_wheelEpoch = getMonotonicMs();
+        m_pAnnouncementTimer = nullptr;
+        m_uArmedTick = CAnnouncementWheel::NEVER;
+        m_uLinesPrefiltered = m_uLinesMissed = m_uLinesMatched = m_uLinesRefused = 0;
+        m_uOperations = m_uOperationsRejected = m_uAnnouncements = m_uChangesInCooldown = 0;
+        m_lastSnapshot = time(nullptr);
+        m_uMaxTargets = 0;
+        m_uShard = CShardedValue::allocateShard();
+        m_pUserScope = m_pGlobalScope = nullptr;
 
         AddHelpCommand();
         //COMMAND FOR COUNTERS
         AddCommand("Create", t_d("[--initial | -i <initial>] [--step | -s <step>] [--cooldown | -c <cooldown>]"
-                "[--delay | -d <delay>] [--message | -m \"<message>\"] <name>"),
+                "[--delay | -d <delay>] [--message | -m \"<message>\"] [--scope network|user|global] <name>"),
                 t_d("Create a counter."),
                 [ = ](const CString & sLine){CCountersMod::createCounterCommand(sLine);});
         AddCommand("Delete", "<name>", "Delete <name> counter.",
@@ -726,25 +6252,174 @@ public:
                 [ = ](const CString & sLine){CCountersMod::listCountersCommand(sLine);});
         AddCommand("Print", "<name>", "Print message for <name> counter.",
                 [ = ](const CString & sLine){CCountersMod::printCounterCommand(sLine);});
+        AddCommand("History", "<name>", "Show the recent changes of <name> counter.",
+                [ = ](const CString & sLine){CCountersMod::historyCounterCommand(sLine);});
 
         //COMMANDS FOR LISTENERS
-        AddCommand("CreateListener", "<name> <nickname> <listener_name>", "Create a listener : alias that can be used "
-                "on any IRC client (like Twitch).",
+        AddCommand("CreateListener", "[--channel <channel>] [--mode <modes>] <name>[,<name>...] <nickname|mask> "
+                "<listener_name>",
+                "Create a listener : alias that can be used on any IRC client (like Twitch).",
                 [ = ](const CString & sLine){CCountersMod::createListenerCommand(sLine);});
-        AddCommand("DeleteListener", "<nickname> <listener_name>", "Delete a listener.",
+        AddCommand("DeleteListener", "[--channel <channel>] <nickname> <listener_name>", "Delete a listener.",
                 [ = ](const CString & sLine){CCountersMod::deleteListenerCommand(sLine);});
+        AddCommand("SetListener", "[--channel <channel>] <nickname> <listener_name> <property> <value>",
+                "Set the commands (commands), the maximum step (maxstep), the channel (channel) or the modes (mode) "
+                "of a listener.",
+                [ = ](const CString & sLine){CCountersMod::setListenerCommand(sLine);});
         AddCommand("ListListeners", "", "List listeners.",
                 [ = ](const CString & sLine){CCountersMod::listListenersCommand(sLine);});
+        
+        //OTHER COMMANDS
+        AddCommand("Batch", "<operation>; <operation>...", "Apply operations (incr, decr, reset and set) "
+                "all or none, each counter is announced once.",
+                [ = ](const CString & sLine){CCountersMod::batchCommand(sLine);});
+        AddCommand("Import", "<file>", "Apply the operations of a file of the module's directory like Batch.",
+                [ = ](const CString & sLine){CCountersMod::importCommand(sLine);});
+        AddCommand("Stats", "[reset]", "Show statistics of the module, or start again the measure of latencies.",
+                [ = ](const CString & sLine){CCountersMod::statsCommand(sLine);});
+        AddCommand("Queue", "[<setting> <value>]", "Show or change the rate limits of messages.",
+                [ = ](const CString & sLine){CCountersMod::queueCommand(sLine);});
+    }
+    
+    /**
+     * The page "metrics" of the module gives the counters and the statistics
+     * in the OpenMetrics text format, to be scraped by Prometheus.
+     */
+    virtual bool OnWebRequest(CWebSock& WebSock, const CString& sPageName, CTemplate& Tmpl) override {
+        if (sPageName != "metrics") {
+            return false;
+        }
+        //the length is not known before the end, the response ends with the connection
+        WebSock.PrintHeader(0, "application/openmetrics-text; version=1.0.0; charset=utf-8");
+        CMetricsWriter writer(WebSock);
+        writeMetrics(writer);
+        WebSock.Close(Csock::CLT_AFTERWRITE);
+        return false;
+    }
+    
+    virtual void OnIRCConnected() override {
+        m_uMaxTargets = 0;
     }
     
     virtual bool OnLoad(const CString& sArgs, CString& sMessage) override {
+        CString sJournal;
+        m_snapshot.open(GetSavePath() + "/counters.snapshot");
+        m_journal.load(GetSavePath(), m_snapshot.getGeneration(), sJournal);
+        replayRecords(m_snapshot.getRecords());
+        sJournal.resize(replayRecords(sJournal));
+        if (!m_journal.open(sJournal)) {
+            sMessage = "Unable to open the journal, counters will not be saved.";
+        }
+        //scopes are used after the replay, so records only apply to counters of the network
+        CString sUserDirectory = GetUser()->GetUserPath() + "/moddata/counters";
+        CString sGlobalDirectory = CZNC::Get().GetZNCPath() + "/moddata/counters";
+        CDir::MakeDir(sUserDirectory);
+        CDir::MakeDir(sGlobalDirectory);
+        m_sUserScope = "user:" + GetUser()->GetUserName();
+        m_pUserScope = CCounterRegistry::get().acquire(m_sUserScope, SCOPE_USER, sUserDirectory + "/counters.scope");
+        m_pGlobalScope = CCounterRegistry::get().acquire("global", SCOPE_GLOBAL, sGlobalDirectory + "/counters.scope");
+        m_pAnnouncementTimer = new CAnnouncementTimer(this);
+        AddTimer(m_pAnnouncementTimer);
+        AddTimer(new CJournalTimer(this));
+        AddTimer(new CQueueTimer(this));
+        loadQueueSettings();
+        //shared counters are materialized to add their value to the shared one
+        for (unsigned int index = 0; index < m_snapshot.getCount(); index++) {
+            if (!m_snapshot.isTaken(index) && m_snapshot.isShared(index)) {
+                findCounter(m_snapshot.getName(index));
+            }
+        }
+        for (CCounterTable::SSlot& slot : m_counters.getSlots()) {
+            if (slot.bUsed && slot.counter.isShared()) {
+                shareCounter(slot.counter.getName(), slot.counter, true);
+            }
+        }
         return true;
     }
     
+    /**
+     * Send the lines of the outbound queue allowed by its rate limits. Called
+     * after each message and every second by CQueueTimer.
+     */
+    void onQueueTimer() {
+        if (m_queue.size() == 0) {
+            return;
+        }
+        m_queue.drain(getMonotonicTime(), [this](const SOutboundLine& line) {
+            COUNTERS_LATENCY(PROBE_PUT_IRC);
+            CString& sTargets = m_sTargetsBuffer;
+            sTargets.clear();
+            for (const CString& sTarget : line.vsTargets) {
+                if (!sTargets.empty()) {
+                    sTargets += ',';
+                }
+                sTargets += sTarget;
+            }
+            PutIRC("PRIVMSG " + sTargets + " :" + line.sMessage);
+        });
+    }
+    
+    /**
+     * Write the journal and the changed scopes to disk, and write a snapshot
+     * when the journal is too big or too old. Called by CJournalTimer.
+     */
+    void onJournalTimer() {
+        CCounterRegistry::get().save();
+        //without a journal file, flush() drops the records so they don't pile up in memory
+        m_journal.flush();
+        if (!m_journal.isOpen()) {
+            return;
+        }
+        if (m_journal.size() > CCountersJournal::COMPACT_SIZE
+                || (m_journal.size() > 0 && time(nullptr) - m_lastSnapshot >= SNAPSHOT_INTERVAL)) {
+            writeSnapshot();
+        }
+    }
+    
+    /**
+     * Send the delayed messages and end the cooldowns which are due, called
+     * by CAnnouncementTimer, which is then armed for the next due tick.
+     */
+    void onAnnouncementTimer() {
+        long long now = getMonotonicMs();
+        m_announcements.advance((now - m_wheelEpoch) / CAnnouncementWheel::TICK_MS,
+                [this](const SPendingAnnouncement& announcement) {
+            sendAnnouncement(announcement);
+        });
+        armAnnouncementTimer(true);
+    }
+    
     virtual ~CCountersMod() {
-        
+        for (CCounterTable::SSlot& slot : m_counters.getSlots()) {
+            slot.counter.detachShared();
+        }
+        //a counter of another scope waiting for an end of cooldown of this wheel would wait forever
+        m_announcements.forEach([this](const SPendingAnnouncement& announcement) {
+            if (announcement.kind == ANNOUNCEMENT_COOLDOWN && announcement.scope != SCOPE_NETWORK) {
+                CCounter* counter = getCounter(announcement.scope, announcement.counter);
+                if (counter) {
+                    counter->dropCooldownPending();
+                }
+            }
+        });
+        if (m_pUserScope) {
+            CCounterRegistry::get().release(m_sUserScope);
+            CCounterRegistry::get().release("global");
+        }
     }
 
 };
 
+void CAnnouncementTimer::RunJob() {
+    static_cast<CCountersMod*>(GetModule())->onAnnouncementTimer();
+}
+
+void CJournalTimer::RunJob() {
+    static_cast<CCountersMod*>(GetModule())->onJournalTimer();
+}
+
+void CQueueTimer::RunJob() {
+    static_cast<CCountersMod*>(GetModule())->onQueueTimer();
+}
+
 NETWORKMODULEDEFS(CCountersMod, "Module to count things using commands")
\ No newline at end of file